@@ -28,6 +28,7 @@ Globals::Globals() : viterbi(new viterbi_parameters())
 	param.num_random_samples = 1000;
 	param.pvalue = 0.01;
 	param.quiet = 0;
+	param.log_level = CAFE_LOG_DETAIL;
 	param.pcafe = NULL;
 	param.pfamily = NULL;
 	param.lambda = NULL;
@@ -37,6 +38,7 @@ Globals::Globals() : viterbi(new viterbi_parameters())
 	param.prior_rfsize = NULL;
 	param.parameters = NULL;
 	param.str_fdata = NULL;
+	param.trace = NULL;
 	viterbi->viterbiPvalues = NULL;
 	viterbi->cutPvalues = NULL;
 	mu_tree = NULL;
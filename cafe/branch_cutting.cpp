@@ -1,6 +1,7 @@
 #include <sstream>
 #include <utility>
 #include <algorithm>
+#include <map>
 
 #include "branch_cutting.h"
 #include "conditional_distribution.h"
@@ -11,6 +12,63 @@ extern "C" {
 #include "cafe.h"
 }
 
+/* pvalue() for a value with less entries of conddist below it and equal entries equal to it */
+static double pvalue_of_counts(int less, int equal, int size)
+{
+	if (equal == 0)
+		return (double)less / (double)size;
+	return (double)(less + 1 + (equal - 1) / 2.0) / (double)size;
+}
+
+/*
+* Mean over t of pvalue(lh / second[t], first, cdlen), for second sorted ascending and positive.
+* The values then only decrease with t, so one pass moving two positions down first replaces a
+* binary search per value. Stops and returns -1 once the mean can no longer exceed bound.
+*/
+static double pvalue_of_product(double lh, const double* second, const double* first, int cdlen, double bound)
+{
+	double x = lh / second[0];
+	int less = std::lower_bound(first, first + cdlen, x) - first;
+	int leq = std::upper_bound(first, first + cdlen, x) - first;
+	double p = 0;
+	for (int t = 0; t < cdlen; t++)
+	{
+		x = lh / second[t];
+		while (less > 0 && first[less - 1] >= x) less--;
+		while (leq > 0 && first[leq - 1] > x) leq--;
+		double term = pvalue_of_counts(less, leq - less, cdlen);
+		p += term;
+		// every term left is at most this one
+		if ((p + term * (cdlen - t - 1)) / cdlen < bound)
+			return -1;
+	}
+	return p / cdlen;
+}
+
+/* whether the rows of cd can be passed to pvalue_of_product */
+static std::vector<bool> product_rows(const matrix& cd, int rows, int cdlen)
+{
+	std::vector<bool> result(rows, false);
+	for (int s = 0; s < rows; s++)
+	{
+		const std::vector<double>& row = cd[s];
+		result[s] = row[0] > 0 && std::adjacent_find(row.begin(), row.begin() + cdlen, std::greater<double>()) == row.begin() + cdlen;
+	}
+	return result;
+}
+
+static double pvalue_of_two_trees(double lh1, double lh2, const std::vector<double>& second, const std::vector<double>& first, bool sorted, int cdlen, double bound)
+{
+	if (sorted)
+		return pvalue_of_product(lh1 * lh2, &second[0], &first[0], cdlen, bound);
+	double p = 0;
+	for (int t = 0; t < cdlen; t++)
+	{
+		p += pvalue(lh1 * lh2 / second[t], &first[0], cdlen);
+	}
+	return p / cdlen;
+}
+
 /*
 * cdlen: length of conddist : number of trials
 */
@@ -22,38 +80,74 @@ double** p_values_of_two_trees(pCafeTree pcafe1, pCafeTree pcafe2,
 	compute_tree_likelihoods(pcafe2);
 	double* lh1 = get_likelihoods(pcafe1);
 	double* lh2 = get_likelihoods(pcafe2);
-	int s1, s2, t;
-	double p;
+	std::vector<bool> sorted = product_rows(cond_dist.second, pcafe1->rfsize, cdlen);
+	int s1, s2;
 	for (s2 = 0; s2 < pcafe1->rfsize; s2++)
 	{
 		for (s1 = 0; s1 < pcafe1->rfsize; s1++)
 		{
-			p = 0;
-			for (t = 0; t < cdlen; t++)
-			{
-				p += pvalue(lh1[s1] * lh2[s2] / (cond_dist.second[s2])[t], &cond_dist.first[s1][0], cdlen);
-			}
-			pvalues[s1][s2] = p / cdlen;
+			pvalues[s1][s2] = pvalue_of_two_trees(lh1[s1], lh2[s2], cond_dist.second[s2], cond_dist.first[s1], sorted[s2], cdlen, -1);
 		}
 	}
 	return pvalues;
 }
 
+/* a pair of root sizes and the largest p-value it can have */
+struct pvalue_cell
+{
+	double bound;
+	int s1;
+	int s2;
+	bool operator<(const pvalue_cell& other) const { return bound > other.bound; }
+};
+
+/**
+* \brief Largest entry of the grid p_values_of_two_trees would fill
+*
+* The p-value of a pair of root sizes is at most its first term, so the pairs are visited by that
+* bound, largest first. The search ends at the first pair whose bound is below the largest p-value
+* found, and a pair is left as soon as its remaining terms cannot lift it above that either.
+*/
+double max_p_value_of_two_trees(pCafeTree pcafe1, pCafeTree pcafe2, const std::pair<matrix, matrix>& cond_dist, int cdlen)
+{
+	compute_tree_likelihoods(pcafe1);
+	compute_tree_likelihoods(pcafe2);
+	double* lh1 = get_likelihoods(pcafe1);
+	double* lh2 = get_likelihoods(pcafe2);
+	int rfsize = pcafe1->rfsize;
+	if (cdlen <= 0)
+		return 0;
+	std::vector<bool> sorted = product_rows(cond_dist.second, rfsize, cdlen);
+
+	std::vector<pvalue_cell> cells;
+	cells.reserve((size_t)rfsize * rfsize);
+	for (int s2 = 0; s2 < rfsize; s2++)
+	{
+		for (int s1 = 0; s1 < rfsize; s1++)
+		{
+			pvalue_cell cell;
+			cell.s1 = s1;
+			cell.s2 = s2;
+			cell.bound = sorted[s2] ? pvalue(lh1[s1] * lh2[s2] / cond_dist.second[s2][0], &cond_dist.first[s1][0], cdlen) : HUGE_VAL;
+			cells.push_back(cell);
+		}
+	}
+	std::sort(cells.begin(), cells.end());
 
+	double result = 0;
+	for (size_t c = 0; c < cells.size() && cells[c].bound > result; c++)
+	{
+		const pvalue_cell& cell = cells[c];
+		double p = pvalue_of_two_trees(lh1[cell.s1], lh2[cell.s2], cond_dist.second[cell.s2], cond_dist.first[cell.s1], sorted[cell.s2], cdlen, result);
+		if (p > result)
+			result = p;
+	}
+	return result;
+}
 
 /**************************************************************************
 * BranchCutting
 **************************************************************************/
-typedef struct
-{
-	pCafeParam cafeparam;
-	viterbi_parameters *viterbi;
-	CutBranch *cb;
-	int range[2];
-}BranchCuttingParam;
-
-typedef BranchCuttingParam* pBranchCuttingParam;
-
 void set_size_for_split(pCafeFamily pcf, int idx, pCafeTree pcafe)
 {
 	int i, j;
@@ -80,28 +174,81 @@ void set_size_for_split(pCafeFamily pcf, int idx, pCafeTree pcafe)
 	}
 }
 
+/* cafe_tree_copy keeps neither mu nor the lambdas set by the lambda command, which the split needs to rebuild its matrices */
+static void copy_rates(pCafeTree pdest, pCafeTree psrc)
+{
+	pArrayList nlist = psrc->super.nlist;
+	for (int i = 0; i < nlist->size; i++)
+	{
+		struct probabilities* src = &((pCafeNode)nlist->array[i])->birth_death_probabilities;
+		struct probabilities* dest = &((pCafeNode)pdest->super.nlist->array[i])->birth_death_probabilities;
+		dest->lambda = src->param_lambdas ? src->param_lambdas[0] : src->lambda;
+		dest->mu = src->param_mus ? src->param_mus[0] : src->mu;
+	}
+}
+
 pArrayList to_arraylist(matrix& v)
 {
 	pArrayList result = arraylist_new(10);
 	for (size_t i = 0; i < v.size(); ++i)
 	{
 		double * temp = (double *)calloc(v[i].size(), sizeof(double));
-		std::copy(temp, temp + v[i].size(), v[i].begin());
+		std::copy(v[i].begin(), v[i].end(), temp);
 		arraylist_add(result,temp);
 	}
 	return result;
 }
 
-void compute_cutpvalues(pCafeTree pparamcafe, pCafeFamily family, int num_random_samples, int b, int range_start, int range_stop, viterbi_parameters& viterbi, double pvalue, double *p1, double** p2, CutBranch& cb)
+/* a tree cut at one branch, built once and then only read */
+struct branch_split
 {
-	pTree ptree = (pTree)pparamcafe;
-	if (tree_is_root(ptree, (pTreeNode)ptree->nlist->array[b]))
+	/* the tree left after the cut, and the subtree below the cut branch */
+	pCafeTree pcafe;
+	pCafeTree psub;
+	/* ids the nodes of both trees had before the cut */
+	std::map<pTreeNode, int> ids;
+	/* whether the distribution of pcafe may be taken from a pool simulated on the uncut tree */
+	bool pcafe_pooled;
+
+	branch_split() : pcafe(NULL), psub(NULL), pcafe_pooled(true) {}
+};
+
+static void split_branch(branch_split& split, pCafeTree paramCafe, int b)
+{
+	split.pcafe = cafe_tree_copy(paramCafe);
+	copy_rates(split.pcafe, paramCafe);
+	for (int n = 0; n < split.pcafe->super.nlist->size; n++)
 	{
-		return;
+		pTreeNode pnode = (pTreeNode)split.pcafe->super.nlist->array[n];
+		split.ids[pnode] = pnode->id;
+	}
+
+	// the cut removes the parent of b, and its sibling's branch takes over the parent's
+	// branch at the sibling's rates; pooled families went down that stretch at the parent's
+	pTreeNode pnode = (pTreeNode)split.pcafe->super.nlist->array[b];
+	split.pcafe_pooled = true;
+	if (!tree_is_root((pTree)split.pcafe, pnode->parent))
+	{
+		struct probabilities* parent = &((pCafeNode)pnode->parent)->birth_death_probabilities;
+		struct probabilities* sibling = &((pCafeNode)phylogeny_get_sibling((pTree)split.pcafe, pnode))->birth_death_probabilities;
+		split.pcafe_pooled = parent->lambda == sibling->lambda && parent->mu == sibling->mu;
 	}
+	split.psub = cafe_tree_split(split.pcafe, b);
+}
 
-	pCafeTree pcafe = cafe_tree_copy(pparamcafe);
-	pCafeTree psub = cafe_tree_split(pcafe, b);
+static void free_split(branch_split& split)
+{
+	cafe_tree_free(split.pcafe);
+	cafe_tree_free(split.psub);
+	split.pcafe = split.psub = NULL;
+}
+
+/* cut p-values of branch b for families [range_start, range_stop), on copies of the split trees */
+static void cut_pvalues(const branch_split& split, pCafeFamily family, int num_random_samples, int b, int range_start, int range_stop, viterbi_parameters& viterbi, double pvalue, double *p1, CutBranch& cb)
+{
+	pCafeTree pcafe = cafe_tree_copy(split.pcafe);
+	pCafeTree psub = cafe_tree_copy(split.psub);
+	pArrayList arr = NULL;
 
 	for (int i = range_start; i < range_stop; i++)
 	{
@@ -116,57 +263,38 @@ void compute_cutpvalues(pCafeTree pparamcafe, pCafeFamily family, int num_random
 		{
 			pCafeTree pct = tree_is_leaf(psub->super.root) ? pcafe : psub;
 			set_size_for_split(family, i, pct);
-			pArrayList arr = to_arraylist(cb.pCDSs[b].first);
+			if (arr == NULL)
+				arr = to_arraylist(cb.pCDSs[b].first);
 			assert(cb.pCDSs[b].first.size() == (size_t)pct->rfsize);
+			assert(cb.pCDSs[b].first[0].size() >= (size_t)num_random_samples);
 			cafe_tree_p_values(pct, p1, arr, num_random_samples);
-			arraylist_free(arr, free);
 			viterbi.cutPvalues[b][i] = *std::max_element(p1, p1+pcafe->rfsize);
 		}
 		else
 		{
 			set_size_for_split(family, i, pcafe);
 			set_size_for_split(family, i, psub);
-			p_values_of_two_trees(pcafe, psub, p2, cb.pCDSs[b], num_random_samples / 10);
-			viterbi.cutPvalues[b][i] = 0;
-			int m, n;
-			for (m = 0; m < pcafe->rfsize; m++)
-			{
-				for (n = 0; n < pcafe->rfsize; n++)
-				{
-					if (p2[m][n] > viterbi.cutPvalues[b][i])
-					{
-						viterbi.cutPvalues[b][i] = p2[m][n];
-					}
-				}
-			}
+			viterbi.cutPvalues[b][i] = max_p_value_of_two_trees(pcafe, psub, cb.pCDSs[b], num_random_samples / 10);
 		}
 	}
+	if (arr)
+		arraylist_free(arr, free);
 	cafe_tree_free(pcafe);
 	cafe_tree_free(psub);
 }
 
-void* __cafe_branch_cutting_thread_func(void* ptr)
+void compute_cutpvalues(pCafeTree pparamcafe, pCafeFamily family, int num_random_samples, int b, int range_start, int range_stop, viterbi_parameters& viterbi, double pvalue, double *p1, CutBranch& cb)
 {
-	pBranchCuttingParam pbc = (pBranchCuttingParam)ptr;
-	pCafeParam param = pbc->cafeparam;
-
-#ifdef VERBOSE
-	printf("Branch cutting : %d ~ %d\n", pbc->range[0], pbc->range[1] - 1);
-#endif
-
-	pTree ptree = (pTree)param->pcafe;
-	int nnodes = ptree->nlist->size;
-	double* p1 = (double*)memory_new(param->pcafe->rfsize, sizeof(double));
-	double** p2 = (double**)memory_new_2dim(param->pcafe->rfsize, param->pcafe->rfsize, sizeof(double));
-
-	for (int b = 0; b < nnodes; b++)
+	pTree ptree = (pTree)pparamcafe;
+	if (tree_is_root(ptree, (pTreeNode)ptree->nlist->array[b]))
 	{
-		compute_cutpvalues(param->pcafe, param->pfamily, param->num_random_samples, b, pbc->range[0], pbc->range[1], *pbc->viterbi, param->pvalue, p1, p2, *pbc->cb);
+		return;
 	}
-	memory_free(p1);
-	p1 = NULL;
-	memory_free_2dim((void**)p2, param->pcafe->rfsize, param->pcafe->rfsize, NULL);
-	return (NULL);
+
+	branch_split split;
+	split_branch(split, pparamcafe, b);
+	cut_pvalues(split, family, num_random_samples, b, range_start, range_stop, viterbi, pvalue, p1, cb);
+	free_split(split);
 }
 
 std::ostream& operator<<(std::ostream& os, CafeTree& tree)
@@ -178,42 +306,158 @@ std::ostream& operator<<(std::ostream& os, CafeTree& tree)
 }
 
 
-void cut_branch(CutBranch& cb, pTree ptree, pCafeTree paramCafe, family_size_range& range, int num_threads, int num_random_samples, int b, std::ostream& ost)
+/* ids in the pooled tree of the nodes of a tree split off it, by the ids the nodes had before the split */
+static std::vector<int> pooled_node_ids(pTree split, const std::map<pTreeNode, int>& ids)
 {
-	if (tree_is_root(ptree, (pTreeNode)ptree->nlist->array[b]))
+	std::vector<int> result(split->nlist->size, -1);
+	for (int n = 0; n < split->nlist->size; n++)
 	{
-		cb.pCDSs[b].first.clear();
-		cb.pCDSs[b].second.clear();
-		return;
+		std::map<pTreeNode, int>::const_iterator it = ids.find((pTreeNode)split->nlist->array[n]);
+		if (it != ids.end())
+			result[n] = it->second;
 	}
-	pCafeTree pcafe = cafe_tree_copy(paramCafe);
-	pCafeTree psub = cafe_tree_split(pcafe, b);
+	return result;
+}
 
-	ost << ">> " << b << "  --------------------\n";
-	ost << *pcafe << "\n";
-	ost << *psub << "\n";
+static matrix split_conditional_distribution(pCafeTree split, const std::map<pTreeNode, int>& ids, const simulation_pool* pool, family_size_range& range, int num_threads, int num_random_samples)
+{
+	if (pool)
+		return pooled_conditional_distribution(*pool, split, pooled_node_ids((pTree)split, ids), &range, num_threads, num_random_samples);
+	return cafe_conditional_distribution(split, &range, num_threads, num_random_samples);
+}
 
-	if (tree_is_leaf(psub->super.root))
+static void branch_distributions(CutBranch& cb, const branch_split& split, family_size_range& range, int num_threads, int num_random_samples, int b, const simulation_pool* pool)
+{
+	const simulation_pool* pcafe_pool = split.pcafe_pooled ? pool : NULL;
+	if (tree_is_leaf(split.psub->super.root))
 	{
-		cb.pCDSs[b].first = cafe_conditional_distribution(pcafe, &range, num_threads, num_random_samples);
+		cb.pCDSs[b].first = split_conditional_distribution(split.pcafe, split.ids, pcafe_pool, range, num_threads, num_random_samples);
 		cb.pCDSs[b].second.clear();
 	}
-	else if (tree_is_leaf(pcafe->super.root))
+	else if (tree_is_leaf(split.pcafe->super.root))
 	{
-		cb.pCDSs[b].first = cafe_conditional_distribution(psub, &range, num_threads, num_random_samples);
+		cb.pCDSs[b].first = split_conditional_distribution(split.psub, split.ids, pool, range, num_threads, num_random_samples);
 		cb.pCDSs[b].second.clear();
 	}
 	else
 	{
 		num_random_samples /= 10;
-		cb.pCDSs[b].first = cafe_conditional_distribution(pcafe, &range, num_threads, num_random_samples);
-		cb.pCDSs[b].second = cafe_conditional_distribution(psub, &range, num_threads, num_random_samples);
+		cb.pCDSs[b].first = split_conditional_distribution(split.pcafe, split.ids, pcafe_pool, range, num_threads, num_random_samples);
+		cb.pCDSs[b].second = split_conditional_distribution(split.psub, split.ids, pool, range, num_threads, num_random_samples);
 	}
+}
 
-	cafe_tree_free(pcafe);
-	cafe_tree_free(psub);
+static void log_split(std::ostream& ost, const branch_split& split, int b)
+{
+	ost << ">> " << b << "  --------------------\n";
+	ost << *split.pcafe << "\n";
+	ost << *split.psub << "\n";
+}
+
+/**
+* \brief Computes the conditional distributions of the two trees left by cutting branch b
+*
+* If pool is given it must have been simulated on paramCafe, and the distributions are taken
+* from it instead of simulating each tree again. The tree above the cut is still simulated
+* when the cut merges two branches with different rates.
+*/
+void cut_branch(CutBranch& cb, pTree ptree, pCafeTree paramCafe, family_size_range& range, int num_threads, int num_random_samples, int b, std::ostream& ost, const simulation_pool* pool)
+{
+	if (tree_is_root(ptree, (pTreeNode)ptree->nlist->array[b]))
+	{
+		cb.pCDSs[b].first.clear();
+		cb.pCDSs[b].second.clear();
+		return;
+	}
+	branch_split split;
+	split_branch(split, paramCafe, b);
+	log_split(ost, split, b);
+	branch_distributions(cb, split, range, num_threads, num_random_samples, b, pool);
+	free_split(split);
+}
+
+/* families handed to a branch cutting task at once */
+const int BRANCH_CUTTING_FAMILY_BLOCK = 32;
+
+/* a branch cutting task: the distributions of branch b if start < 0, otherwise the cut p-values of families [start, stop) */
+struct BranchCuttingTask
+{
+	int b;
+	int start;
+	int stop;
+};
+
+struct BranchCuttingQueue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;
+	std::vector<BranchCuttingTask> tasks;
+	size_t next;
+	/* whether the distributions of each branch are done */
+	std::vector<bool> ready;
+	std::vector<branch_split>* splits;
+	CutBranch* cb;
+	const simulation_pool* pool;
+	uint64_t seed;
+};
+
+typedef struct
+{
+	pCafeParam cafeparam;
+	viterbi_parameters *viterbi;
+	BranchCuttingQueue* queue;
+}BranchCuttingParam;
+
+void* __cafe_branch_cutting_thread_func(void* ptr)
+{
+	BranchCuttingParam* ptparam = (BranchCuttingParam*)ptr;
+	BranchCuttingQueue* queue = ptparam->queue;
+	pCafeParam param = ptparam->cafeparam;
+	double* p1 = (double*)memory_new(param->pcafe->rfsize, sizeof(double));
+	while (true)
+	{
+		pthread_mutex_lock(&queue->lock);
+		size_t i = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (i >= queue->tasks.size()) break;
+
+		const BranchCuttingTask& task = queue->tasks[i];
+		const branch_split& split = (*queue->splits)[task.b];
+		if (task.start < 0)
+		{
+			RandomStream stream;
+			random_stream_init(&stream, queue->seed, task.b);
+			pRandomStream old = unifrnd_set_stream(&stream);
+			branch_distributions(*queue->cb, split, param->family_size, 1, param->num_random_samples, task.b, queue->pool);
+			unifrnd_set_stream(old);
+
+			pthread_mutex_lock(&queue->lock);
+			queue->ready[task.b] = true;
+			pthread_cond_broadcast(&queue->ready_cond);
+			pthread_mutex_unlock(&queue->lock);
+		}
+		else
+		{
+			// every distribution task is taken before any family task, so some thread is working on this one
+			pthread_mutex_lock(&queue->lock);
+			while (!queue->ready[task.b])
+				pthread_cond_wait(&queue->ready_cond, &queue->lock);
+			pthread_mutex_unlock(&queue->lock);
+
+			cut_pvalues(split, param->pfamily, param->num_random_samples, task.b, task.start, task.stop, *ptparam->viterbi, param->pvalue, p1, *queue->cb);
+		}
+	}
+	memory_free(p1);
+	return (NULL);
 }
 
+/**
+* \brief Computes the cut p-values of every family at every branch
+*
+* Each branch is split once up front. The threads then take the conditional distributions of one
+* branch at a time, followed by blocks of families at one branch, so that all of them stay busy
+* while the distributions are computed as well as afterwards.
+*/
 void cafe_branch_cutting(pCafeParam param, viterbi_parameters& viterbi)
 {
 	cafe_log(param, "Running Branch Cutting....\n");
@@ -221,19 +465,23 @@ void cafe_branch_cutting(pCafeParam param, viterbi_parameters& viterbi)
 	pTree ptree = (pTree)param->pcafe;
 	int i, b;
 	int nnodes = ptree->nlist->size;
+	int nrows = param->pfamily->flist->size;
 	CutBranch cb(nnodes);
 
+	// every cut takes its distributions from the same families simulated on the whole tree
+	simulation_pool pool = cafe_simulation_pool(param->pcafe, &param->family_size, param->num_threads, param->num_random_samples);
+
+	// splitting sets up the birth-death matrices of the new trees, so it is done before any thread starts
+	std::vector<branch_split> splits(nnodes);
 	for (b = 0; b < nnodes; b++)
 	{
+		if (tree_is_root(ptree, (pTreeNode)ptree->nlist->array[b])) continue;
+		split_branch(splits[b], param->pcafe, b);
 		std::ostringstream ost;
-		cut_branch(cb, ptree, param->pcafe, param->family_size, param->num_threads, param->num_random_samples, b, ost);
+		log_split(ost, splits[b], b);
 		cafe_log(param, ost.str().c_str());
 	}
 
-	int threadstep = param->pfamily->flist->size / param->num_threads;
-	pBranchCuttingParam ptparam = (pBranchCuttingParam)calloc(param->num_threads, sizeof(BranchCuttingParam));
-
-	int nrows = param->pfamily->flist->size;
 	viterbi.cutPvalues = (double**)memory_new_2dim(nnodes, nrows, sizeof(double));
 	int rid = ptree->root->id;
 	for (i = 0; i < nrows; i++)
@@ -241,16 +489,42 @@ void cafe_branch_cutting(pCafeParam param, viterbi_parameters& viterbi)
 		viterbi.cutPvalues[rid][i] = -1;
 	}
 
-	int r = 0;
-	for (i = 0; i < param->num_threads; i++, r += threadstep)
+	BranchCuttingQueue queue;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.ready_cond, NULL);
+	for (b = 0; b < nnodes; b++)
+	{
+		if (b == rid) continue;
+		BranchCuttingTask task = { b, -1, -1 };
+		queue.tasks.push_back(task);
+	}
+	for (b = 0; b < nnodes; b++)
+	{
+		if (b == rid) continue;
+		for (i = 0; i < nrows; i += BRANCH_CUTTING_FAMILY_BLOCK)
+		{
+			BranchCuttingTask task = { b, i, MIN(i + BRANCH_CUTTING_FAMILY_BLOCK, nrows) };
+			queue.tasks.push_back(task);
+		}
+	}
+	queue.next = 0;
+	queue.ready.assign(nnodes, false);
+	queue.splits = &splits;
+	queue.cb = &cb;
+	queue.pool = &pool;
+	queue.seed = unifrnd_split();
+
+	int numthreads = MAX(1, MIN(param->num_threads, (int)queue.tasks.size()));
+	std::vector<BranchCuttingParam> ptparam(numthreads);
+	for (i = 0; i < numthreads; i++)
 	{
 		ptparam[i].cafeparam = param;
-		ptparam[i].cb = &cb;
-		ptparam[i].range[0] = r;
-		ptparam[i].range[1] = r + threadstep;
+		ptparam[i].viterbi = &viterbi;
+		ptparam[i].queue = &queue;
 	}
-	ptparam[param->num_threads - 1].range[1] = param->pfamily->flist->size;
-	thread_run(param->num_threads, __cafe_branch_cutting_thread_func, ptparam, sizeof(BranchCuttingParam));
+	thread_run(numthreads, __cafe_branch_cutting_thread_func, &ptparam[0], sizeof(BranchCuttingParam));
+	pthread_cond_destroy(&queue.ready_cond);
+	pthread_mutex_destroy(&queue.lock);
 
 	for (i = 0; i < nrows; i++)
 	{
@@ -262,8 +536,10 @@ void cafe_branch_cutting(pCafeParam param, viterbi_parameters& viterbi)
 		}
 	}
 
-	memory_free(ptparam);
-	ptparam = NULL;
+	for (b = 0; b < nnodes; b++)
+	{
+		if (splits[b].pcafe)
+			free_split(splits[b]);
+	}
 	cafe_log(param, "Done : Branch Cutting\n");
 }
-
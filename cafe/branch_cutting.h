@@ -2,12 +2,14 @@
 #define BRANCH_CUTTING_H_043A6EEC_78B6_4760_A3B8_F9343BB71F0E
 
 #include <vector>
+#include <utility>
 
 extern "C" {
 #include <family.h>
 }
 
 class viterbi_parameters;
+struct simulation_pool;
 
 typedef std::vector<std::vector<double> > matrix;
 
@@ -22,9 +24,11 @@ public:
 	}
 };
 
+double** p_values_of_two_trees(pCafeTree pcafe1, pCafeTree pcafe2, double** pvalues, const std::pair<matrix, matrix>& cond_dist, int cdlen);
+double max_p_value_of_two_trees(pCafeTree pcafe1, pCafeTree pcafe2, const std::pair<matrix, matrix>& cond_dist, int cdlen);
 void set_size_for_split(pCafeFamily pcf, int idx, pCafeTree pcafe);
 void cafe_branch_cutting(pCafeParam param, viterbi_parameters& viterbi);
-void cut_branch(CutBranch& cb, pTree ptree, pCafeTree paramCafe, family_size_range& range, int num_threads, int num_random_samples, int b, std::ostream& ost);
-void compute_cutpvalues(pCafeTree pparamcafe, pCafeFamily family, int num_random_samples, int b, int range_start, int range_stop, viterbi_parameters& viterbi, double pvalue, double *p1, double** p2, CutBranch& cb);
+void cut_branch(CutBranch& cb, pTree ptree, pCafeTree paramCafe, family_size_range& range, int num_threads, int num_random_samples, int b, std::ostream& ost, const simulation_pool* pool = NULL);
+void compute_cutpvalues(pCafeTree pparamcafe, pCafeFamily family, int num_random_samples, int b, int range_start, int range_stop, viterbi_parameters& viterbi, double pvalue, double *p1, CutBranch& cb);
 
 #endif
@@ -67,6 +67,8 @@ extern void cafe_tree_p_values(pCafeTree pcafe, double* p,  pArrayList pconddist
 
 extern pCafeParam cafe_copy_parameters(pCafeParam psrc);
 extern void cafe_free_copy_parameters(pCafeParam param);
+extern pCafeParam cafe_thread_copy_parameters(pCafeParam psrc);
+extern void cafe_thread_free_parameters(pCafeParam param);
 
 extern double cafe_tree_mp_remark(pString str, pTree ptree, pMetapostConfig pmc, va_list ap);
 extern double cafe_tree_mp_annotation(pString str, pTreeNode pnode, pMetapostConfig pmc, va_list ap);
@@ -74,6 +76,8 @@ extern pMetapostConfig cafe_tree_get_default_mpconfig(int id, double width, doub
 extern pString cafe_tree_metapost(pCafeTree pcafe, int id, char* title, double width, double height);
 extern int cafe_tree_random_familysize(pCafeTree pcafe, int rootFamilysize );
 void node_set_birthdeath_matrix(pCafeNode pcnode, pBirthDeathCacheArray cache, int num_lambdas);
+void cafe_tree_set_birthdeath_with_cache(pCafeTree pcafe, pBirthDeathCacheArray cache);
+void cafe_tree_set_shared_birthdeath(pCafeTree pcafe, pSharedBirthDeathCache pshared, int maxFamilysize, pBirthDeathCacheArray* overflow);
 
 
 /****************************************************************************
@@ -109,17 +113,87 @@ extern void cafe_family_read_query_family(pCafeParam param, const char* file);
 ****************************************************************************/
 
 extern void cafe_log(pCafeParam param, const char* msg, ... );
+extern void cafe_log_level(pCafeParam param, int level, const char* msg, ... );
+extern int cafe_log_enabled(pCafeParam param, int level);
+extern void cafe_log_async_begin(pCafeParam param);
+extern void cafe_log_async_end();
 extern void reset_birthdeath_cache(pCafeTree tree, int k_value, family_size_range* range);
+
+typedef void (*restart_search_func)(pFMinSearch pfm, int run, void* args);
+
+/*! \brief Options of \ref cafe_restart_search
+*/
+typedef struct
+{
+	math_func eq;
+	void* eq_args;
+	int N;
+	double tol;
+	/* shape of param->parameters, for the random starting points */
+	int lambda_len;
+	int mu_len;
+	int k;
+	/* starting points are drawn from this stream, or from the calling thread's unifrnd stream if NULL */
+	pRandomStream stream;
+	/* runs the simplex search of a run; NULL runs fminsearch_min from param->parameters */
+	restart_search_func search;
+	void* search_args;
+	int max_runs;
+	/* max_runs long, holding the scores of the first_run runs already made */
+	double* scores;
+	int first_run;
+	/* the first run continues from param->parameters instead of a random point */
+	int resumed;
+}RestartSearch;
+
+extern int cafe_restart_search(pCafeParam param, RestartSearch* prs, int* runs);
 extern double* cafe_best_lambda_by_fminsearch(pCafeParam param, int lambda_len, int k);
+extern double* cafe_best_lambda_by_fminsearch_checkpoint(pCafeParam param, int lambda_len, int k, const char* checkpoint, int interval, int resume);
 extern double* cafe_best_lambda_mu_by_fminsearch(pCafeParam param, int lambda_len, int mu_len, int k );
+extern double* cafe_best_lambda_mu_by_fminsearch_checkpoint(pCafeParam param, int lambda_len, int mu_len, int k, const char* checkpoint, int interval, int resume);
 extern double* cafe_best_lambda_mu_eqbg_by_fminsearch(pCafeParam param, int lambda_len, int mu_len );
 extern double* cafe_each_best_lambda_by_fminsearch(pCafeParam param, int lambda_len );
 extern void cafe_lambda_set_default(pCafeParam param, double* lambda);
 
+extern double cafe_get_posterior_for_lambdas(pCafeParam param, double* plambda);
 extern void cafe_free_birthdeath_cache(pCafeTree pcafe);
 extern void cafe_likelihood_ratio_test(pCafeParam param, double *maximumPvalues);
 extern pGMatrix cafe_lambda_distribution(pCafeParam param, int numrange, double** range );
 
+/****************************************************************************
+ * Cafe Trace
+****************************************************************************/
+
+/*! \brief Records one line per score computed by the lambda search
+*
+* Attached to \ref CafeParam as trace; the search callbacks fill in the
+* timings and cache counts while scoring, and \ref cafe_trace_end writes them out.
+*/
+typedef struct tagOptimizerTrace
+{
+	FILE* fp;
+	int binary;
+	int num_params;
+	int evaluation;
+	/// search whose current step is recorded with each evaluation, if any
+	pFMinSearch search;
+	double start;
+	double matrix_time;
+	double prune_time;
+	double reduce_time;
+	size_t cache_hits;
+	size_t cache_misses;
+}OptimizerTrace;
+typedef OptimizerTrace* pOptimizerTrace;
+
+extern pOptimizerTrace cafe_trace_new(const char* file, int binary, int num_params);
+extern void cafe_trace_free(pOptimizerTrace trace);
+extern double cafe_trace_clock();
+extern void cafe_trace_begin(pOptimizerTrace trace);
+extern void cafe_trace_matrices_done(pOptimizerTrace trace, pBirthDeathCacheArray cache);
+extern void cafe_trace_end(pOptimizerTrace trace, double* parameters, double score);
+extern double cafe_get_posterior_traced(pCafeFamily pfamily, pCafeTree pcafe, family_size_range*range, double *ML, double *MAP, double *prior_rfsize, int quiet, pOptimizerTrace trace);
+
 void initialize_leaf_likelihoods_for_viterbi(double **matrix, int num_rows, int range, int familysize, int num_cols, pErrorStruct errormodel);
 void reset_k_likelihoods(pCafeNode pcnode, int k, int num_factors);
 
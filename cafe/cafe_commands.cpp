@@ -10,6 +10,7 @@
 #include <iterator>
 #include <algorithm>
 #include <stdexcept>
+#include <climits>
 
 #include<dirent.h>
 
@@ -23,6 +24,7 @@
 #include "log_buffer.h"
 #include "Globals.h"
 #include "viterbi.h"
+#include "marginal.h"
 
 /**
 	\defgroup Commands Commands that are available in CAFE
@@ -92,6 +94,8 @@ map<string, cafe_command2> get_dispatcher()
 	dispatcher["esterror"] = cafe_cmd_esterror;
 	dispatcher["noerrormodel"] = cafe_cmd_noerrormodel;
 	dispatcher["rootdist"] = cafe_cmd_rootdist;
+	dispatcher["seed"] = cafe_cmd_seed;
+	dispatcher["cache"] = cafe_cmd_cache;
 	dispatcher["lambdamu"] = cafe_cmd_lambdamu;
 #ifdef DEBUG
 	dispatcher["score"] = cafe_cmd_score;
@@ -201,6 +205,8 @@ int cafe_cmd_exit(Globals& globals, std::vector<std::string> tokens)
 * 
 * with the argument "stdout" the current log file is closed and log data goes to stdout
 *
+* "log -v level" sets how much is logged: 0 for errors only, 1 to leave out
+* the line written for every evaluation during searches, 2 (the default) for everything
 */
 int cafe_cmd_log(Globals& globals, std::vector<std::string> tokens)
 {
@@ -208,6 +214,15 @@ int cafe_cmd_log(Globals& globals, std::vector<std::string> tokens)
 	{
 		printf("Log: %s\n", globals.param.flog == stdout ? "stdout" : globals.param.str_log->buf);
 	}
+	else if (tokens[1] == "-v")
+	{
+		if (tokens.size() < 3)
+			throw std::runtime_error("ERROR(log): -v requires a level\n");
+		int level = atoi(tokens[2].c_str());
+		if (level < CAFE_LOG_ERROR || level > CAFE_LOG_DETAIL)
+			throw std::runtime_error("ERROR(log): level must be between 0 and 2\n");
+		globals.param.log_level = level;
+	}
 	else
 	{
 		string file_name;
@@ -223,6 +238,60 @@ int cafe_cmd_log(Globals& globals, std::vector<std::string> tokens)
 	return 0;
 }
 
+/**
+\ingroup Commands
+\ingroup Setters
+\brief Sets the seed of the random number generator
+*
+* With no arguments, writes the current seed to the log. Simulations run with the
+* same seed and number of threads give the same results.
+*/
+int cafe_cmd_seed(Globals& globals, std::vector<std::string> tokens)
+{
+	if (tokens.size() == 1)
+	{
+		cafe_log(&globals.param, "Seed: %u\n", unifrnd_get_seed());
+		return 0;
+	}
+	char* end;
+	unsigned long seed = strtoul(tokens[1].c_str(), &end, 10);
+	if (*end || tokens[1][0] == '-' || seed > UINT_MAX)
+		throw std::runtime_error("ERROR(seed): seed must be a non-negative integer\n");
+	unifrnd_seed((unsigned int)seed);
+	return 0;
+}
+
+/**
+\ingroup Commands
+\ingroup Setters
+\brief Sets the directory conditional distributions are cached in
+*
+* With a directory, the conditional distributions computed by pvalue, report and
+* gainloss are saved there and loaded again whenever the tree, rates, ranges and
+* number of samples match. The Viterbi results of report and gainloss are saved
+* alongside and reused when the families match as well. "cache off" stops caching; with no arguments the
+* current directory is written to the log.
+*/
+int cafe_cmd_cache(Globals& globals, std::vector<std::string> tokens)
+{
+	if (tokens.size() == 1)
+	{
+		string dir = get_conditional_distribution_cache();
+		cafe_log(&globals.param, "Cache: %s\n", dir.empty() ? "off" : dir.c_str());
+		return 0;
+	}
+	if (tokens[1] == "off")
+	{
+		set_conditional_distribution_cache("");
+		return 0;
+	}
+	struct stat st;
+	if (stat(tokens[1].c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+		throw std::runtime_error("ERROR(cache): " + tokens[1] + " is not a directory\n");
+	set_conditional_distribution_cache(tokens[1]);
+	return 0;
+}
+
 void write_version(ostream &ost)
 {
 	ost << "Version: " << CAFE_VERSION << ", built at " << __DATE__ << "\n";
@@ -465,15 +534,36 @@ void verify_directory(string dirname)
 	}
 }
 
-int* get_root_dist(pCafeTree pcafe, pCafeFamily pfamily, int k_value, family_size_range* range)
+/**
+* \brief Counts the families whose Viterbi root has each size
+*
+* With clusters, each family is reconstructed with the rates of its most probable cluster.
+*/
+int* get_root_dist(pCafeParam param)
 {
+	pCafeTree pcafe = param->pcafe;
+	pCafeFamily pfamily = param->pfamily;
 	int *root_dist = (int*)memory_new(pcafe->rfsize + 1, sizeof(int));
 	int num_families = pfamily->flist->size;
 	pCafeNode croot = (pCafeNode)pcafe->super.root;
 
-	reset_birthdeath_cache(pcafe, k_value, range);
+	reset_birthdeath_cache(pcafe, param->parameterized_k_value, &param->family_size);
 	printf("Viterbi\n");
 
+	if (param->parameterized_k_value > 0)
+	{
+		viterbi_parameters viterbi;
+		viterbi.cutPvalues = NULL;
+		cafe_clustered_viterbi(param, viterbi);
+		int root = pcafe->super.root->id / 2;
+		for (int i = 0; i < num_families; i++)
+		{
+			root_dist[viterbi.viterbiNodeFamilysizes[root][i]]++;
+		}
+		viterbi_parameters_clear(&viterbi, pcafe->super.nlist->size);
+		return root_dist;
+	}
+
 	for (int i = 0; i < num_families; i++)
 	{
 		if (i % 1000 == 0)
@@ -481,12 +571,7 @@ int* get_root_dist(pCafeTree pcafe, pCafeFamily pfamily, int k_value, family_siz
 			printf("%d ...\n", i);
 		}
 		cafe_family_set_size(pfamily, i, pcafe);
-		if (k_value > 0) {
-			cafe_tree_clustered_viterbi(pcafe, k_value);
-		}
-		else {
-			cafe_tree_viterbi(pcafe);
-		}
+		cafe_tree_viterbi(pcafe);
 		root_dist[croot->familysize]++;
 	}
 
@@ -587,7 +672,7 @@ int cafe_cmd_generate_random_family(Globals& globals, std::vector<std::string> t
 
 		num_families = param->pfamily->flist->size;
 		param->param_set_func(param, param->parameters);
-		param->root_dist = get_root_dist(pcafe, param->pfamily, param->parameterized_k_value, &param->family_size);
+		param->root_dist = get_root_dist(param);
 	}
 	else {
 		num_families = 0;
@@ -827,6 +912,13 @@ struct family_args get_family_arguments(vector<Argument> pargs)
 \ingroup Commands
 \brief Reports
 *
+* With "sequential", family p-values are estimated from blocks of simulated families
+* that grow only until each p-value is clearly above or below the -p threshold, and
+* are written with their Monte Carlo error and the number of samples used.
+*
+* With "importance", families are simulated with lambda (and mu) doubled and weighted
+* by their likelihood ratio, which resolves p-values much smaller than one over the
+* number of samples.
 */
 int cafe_cmd_report(Globals& globals, std::vector<std::string> tokens)
 {
@@ -1104,6 +1196,8 @@ struct pvalue_args get_pvalue_arguments(vector<Argument> pargs)
 {
 	struct pvalue_args args;
 	args.index = -1;
+	args.text = false;
+	args.all = false;
 
 	for (size_t i = 0; i < pargs.size(); i++)
 	{
@@ -1125,28 +1219,30 @@ struct pvalue_args get_pvalue_arguments(vector<Argument> pargs)
 				throw std::runtime_error("ERROR(pvalue): idx parameter is not an integer\n");
 			}
 		}
+		if (!strcmp(parg->opt, "-text"))
+		{
+			args.text = true;
+		}
+		if (!strcmp(parg->opt, "-all"))
+		{
+			args.all = true;
+		}
 	}
 
 	return args;
 }
 
-static pArrayList to_arraylist(matrix& v)
-{
-	pArrayList result = arraylist_new(10);
-	for (size_t i = 0; i < v.size(); ++i)
-	{
-		double * temp = (double *)calloc(v[i].size(), sizeof(double));
-		std::copy(temp, temp + v[i].size(), v[i].begin());
-		arraylist_add(result, temp);
-	}
-	return result;
-}
-
-
 /**
 \ingroup Commands
 \brief Calculates pvalues
 
+With -o, simulates the conditional distribution of the likelihood for each root
+size and saves it in the binary format -i maps back into memory; add -text to
+write tab-separated values instead. -i reads either format.
+
+With -all -o, writes the most likely root size and maximum p-value of every
+family to the file instead, using the distribution loaded with -i or a newly
+simulated one.
 */
 int cafe_cmd_pvalue(Globals& globals, std::vector<std::string> tokens)
 {
@@ -1154,28 +1250,76 @@ int cafe_cmd_pvalue(Globals& globals, std::vector<std::string> tokens)
 
 	pvalue_args args = get_pvalue_arguments(build_argument_list(tokens));
 
-	if (args.outfile.size() > 0)
+	if (args.all)
 	{
-		prereqs(param, REQUIRES_TREE | REQUIRES_LAMBDA);
+		prereqs(param, REQUIRES_FAMILY | REQUIRES_TREE | REQUIRES_LAMBDA);
+		if (args.outfile.empty())
+		{
+			throw std::runtime_error("ERROR(pvalue): -all requires an output file (-o)\n");
+		}
 		ofstream ofst(args.outfile.c_str());
 		if (!ofst)
 		{
 			throw io_error("pvalue", args.outfile, true);
 		}
+		param->param_set_func(param, param->parameters);
+		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
+		if (ConditionalDistribution::empty())
+		{
+			ConditionalDistribution::reset(param->pcafe, &param->family_size, param->num_threads, param->num_random_samples);
+		}
+		std::vector<family_pvalue> values = pvalues_for_all_families(param->pcafe, param->pfamily, param->num_threads, param->num_random_samples);
+		write_family_pvalues(ofst, param->pfamily, values);
+	}
+	else if (args.outfile.size() > 0)
+	{
+		prereqs(param, REQUIRES_TREE | REQUIRES_LAMBDA);
 		matrix m = cafe_conditional_distribution(param->pcafe, &param->family_size, param->num_threads, param->num_random_samples);
-		pArrayList cond_dist = to_arraylist(m);
-		write_pvalues(ofst, cond_dist, param->num_random_samples);
-		arraylist_free(cond_dist, free);
+		if (args.text)
+		{
+			ofstream ofst(args.outfile.c_str());
+			if (!ofst)
+			{
+				throw io_error("pvalue", args.outfile, true);
+			}
+			write_pvalues(ofst, m);
+		}
+		else
+		{
+			uint64_t key = conditional_distribution_key(param->pcafe, &param->family_size, param->num_random_samples);
+			if (!write_conditional_distribution_cache(args.outfile, key, m))
+			{
+				throw io_error("pvalue", args.outfile, true);
+			}
+		}
 	}
 	else if (args.infile.size() > 0)
 	{
 		cafe_log(param, "Loading p-values ... \n");
-		ifstream ifst(args.infile.c_str());
-		if (!ifst)
+		if (ConditionalDistribution::map(args.infile))
 		{
-			throw io_error("pvalue", args.outfile, true);
+			if (ConditionalDistribution::mapped.cols != param->num_random_samples)
+			{
+				int cols = ConditionalDistribution::mapped.cols;
+				ConditionalDistribution::clear();
+				ostringstream ost;
+				ost << "ERROR(pvalue): " << args.infile << " holds " << cols << " samples per root size, expected " << param->num_random_samples << "\n";
+				throw std::runtime_error(ost.str());
+			}
+			if (param->pcafe && param->lambda && ConditionalDistribution::mapped.key != conditional_distribution_key(param->pcafe, &param->family_size, param->num_random_samples))
+			{
+				cafe_log(param, "WARNING: %s was computed for a different tree, lambda or family size range\n", args.infile.c_str());
+			}
+		}
+		else
+		{
+			ifstream ifst(args.infile.c_str());
+			if (!ifst)
+			{
+				throw io_error("pvalue", args.infile, false);
+			}
+			read_pvalues(ifst, param->num_random_samples);
 		}
-		read_pvalues(ifst, param->num_random_samples);
 		cafe_log(param, "Done Loading p-values ... \n");
 	}
 	else if (args.index >= 0)
@@ -1683,6 +1827,9 @@ int cafe_cmd_lambdamu(Globals& globals, std::vector<std::string> tokens)
 	int bdone = 0;
 	int bsearch = 0;
 	int bprint = 0;
+	string checkpoint;
+	int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+	bool resume = false;
 
 	//////
 	CafeParam tmpparam;
@@ -1703,6 +1850,19 @@ int cafe_cmd_lambdamu(Globals& globals, std::vector<std::string> tokens)
 		{
 			tmp_param->checkconv = 1;
 		}
+		else if (!strcmp(parg->opt, "-checkpoint"))
+		{
+			checkpoint = parg->argv[0];
+			if (parg->argc > 1)
+			{
+				sscanf(parg->argv[1], "%d", &checkpoint_interval);
+			}
+		}
+		else if (!strcmp(parg->opt, "-resume"))
+		{
+			checkpoint = parg->argv[0];
+			resume = true;
+		}
 		else if (!strcmp(parg->opt, "-t"))
 		{
 			bdone = __cafe_cmd_lambda_tree(parg);
@@ -1834,7 +1994,22 @@ int cafe_cmd_lambdamu(Globals& globals, std::vector<std::string> tokens)
 			}
 			// search
 			if (tmp_param->checkconv) { param->checkconv = 1; }
-			cafe_best_lambda_mu_by_fminsearch(param, param->num_lambdas, param->num_mus, param->parameterized_k_value);
+			if (checkpoint.empty())
+			{
+				cafe_best_lambda_mu_by_fminsearch(param, param->num_lambdas, param->num_mus, param->parameterized_k_value);
+			}
+			else
+			{
+				if (resume)
+				{
+					cafe_log(param, "Resuming search from %s\n", checkpoint.c_str());
+				}
+				if (cafe_best_lambda_mu_by_fminsearch_checkpoint(param, param->num_lambdas, param->num_mus, param->parameterized_k_value,
+					checkpoint.c_str(), checkpoint_interval, resume) == NULL)
+				{
+					throw std::runtime_error("ERROR(lambdamu): Cannot resume from checkpoint " + checkpoint + "\n");
+				}
+			}
 		}
 		else {
 			if (tmp_param->lambda_tree != NULL) {
@@ -2195,23 +2370,48 @@ int cafe_cmd_accuracy(Globals& globals, std::vector<std::string> tokens)
 \ingroup Commands
 \brief Write gains and losses
 *
+* Arguments: name [marginal]
+*
+* Gains and losses are taken from the Viterbi reconstruction, or with marginal
+* are the posterior expectations of \ref cafe_marginals.
 */
 int cafe_cmd_gainloss(Globals& globals, std::vector<std::string> tokens)
 {
 	pCafeParam param = &globals.param;
 	prereqs(param, REQUIRES_FAMILY | REQUIRES_TREE | REQUIRES_LAMBDA);
 
+	if (tokens.size() > 2 && tokens[2] == "marginal")
+	{
+		param->param_set_func(param, param->parameters);
+		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
+		marginal_parameters marginals;
+		cafe_marginals(param, marginals);
+
+		string name = tokens[1] + ".gs";
+		ofstream ofst(name.c_str());
+		write_marginal_gainloss(ofst, param, marginals);
+		return 0;
+	}
+
 	if (globals.viterbi->viterbiNodeFamilysizes == NULL)
 	{
-		if (ConditionalDistribution::matrix.empty())
+		param->param_set_func(param, param->parameters);
+		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
+		// a distribution loaded with pvalue -i is not what the stored results were computed against
+		bool use_store = ConditionalDistribution::empty() ||
+			ConditionalDistribution::simulated_for(param->pcafe, &param->family_size, param->num_random_samples);
+		if (!use_store || !load_viterbi_results(param, VITERBI_PVALUES_FIXED, *globals.viterbi))
 		{
-			param->param_set_func(param, param->parameters);
-			reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
-			ConditionalDistribution::reset(param->pcafe, &param->family_size, param->num_threads, param->num_random_samples);
+			if (ConditionalDistribution::empty())
+			{
+				ConditionalDistribution::reset(param->pcafe, &param->family_size, param->num_threads, param->num_random_samples);
+			}
+			pArrayList cd = ConditionalDistribution::to_arraylist();
+			cafe_viterbi(param, *globals.viterbi, cd);
+			arraylist_free(cd, NULL);
+			if (use_store)
+				save_viterbi_results(param, VITERBI_PVALUES_FIXED, *globals.viterbi);
 		}
-		pArrayList cd = ConditionalDistribution::to_arraylist();
-		cafe_viterbi(param, *globals.viterbi, cd);
-		arraylist_free(cd, NULL);
 	}
 
 	string name = tokens[1] + ".gs";
@@ -21,6 +21,7 @@ typedef int(*cafe_command2)(Globals& globals, std::vector<std::string>);
 
 COMMAND(accuracy);
 COMMAND(branchlength);
+COMMAND(cache);
 COMMAND(cvfamily);
 COMMAND(cvspecies);
 COMMAND(date);
@@ -44,6 +45,7 @@ COMMAND(retrieve);
 COMMAND(rootdist);
 COMMAND(save);
 COMMAND(score);
+COMMAND(seed);
 COMMAND(simerror);
 COMMAND(simextinct);
 COMMAND(source);
@@ -92,6 +94,8 @@ struct pvalue_args
 	std::string infile;
 	std::string outfile;
 	int index;
+	bool text;
+	bool all;
 };
 
 struct lhtest_args
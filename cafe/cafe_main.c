@@ -37,6 +37,142 @@ variable in cafe_shell.c .
 
 pBirthDeathCacheArray probability_cache = NULL;
 
+/**
+* \brief Background writer used by \ref cafe_log while a search is running
+*
+* Messages are appended to text under the lock and written out by the
+* writer thread, so a search callback never waits on the terminal or the disk.
+*/
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_t thread;
+	int depth;
+	int stop;
+	FILE* flog;
+	int quiet;
+	char* text;
+	size_t len;
+	size_t capacity;
+}AsyncLog;
+
+static AsyncLog async_log = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void __cafe_log_write(FILE* flog, int quiet, const char* text, size_t len)
+{
+	if ( flog != stderr && flog != stdout )
+	{
+		fwrite(text, 1, len, flog);
+		fflush(flog);
+	}
+	if (!quiet)
+	{
+		fwrite(text, 1, len, stdout);
+		fflush(stdout);
+	}
+}
+
+static void* __cafe_log_thread_func(void* ptr)
+{
+	size_t capacity = 0;
+	char* text = NULL;
+	pthread_mutex_lock(&async_log.lock);
+	while (1)
+	{
+		while (async_log.len == 0 && !async_log.stop)
+		{
+			pthread_cond_wait(&async_log.ready, &async_log.lock);
+		}
+		if (async_log.len == 0) break;
+		// swap buffers so writing happens without the lock
+		char* full = async_log.text;
+		size_t full_capacity = async_log.capacity;
+		size_t len = async_log.len;
+		async_log.text = text;
+		async_log.capacity = capacity;
+		async_log.len = 0;
+		text = full;
+		capacity = full_capacity;
+		pthread_mutex_unlock(&async_log.lock);
+		__cafe_log_write(async_log.flog, async_log.quiet, text, len);
+		pthread_mutex_lock(&async_log.lock);
+	}
+	pthread_mutex_unlock(&async_log.lock);
+	if (text) memory_free(text);
+	return NULL;
+}
+
+/**
+* \brief Routes \ref cafe_log output for param through the background writer until \ref cafe_log_async_end
+*
+* Calls nest; only the outermost pair starts and stops the writer. Must be
+* called from the main thread. Other output written straight to stdout or the
+* log file in between may appear out of order.
+*/
+void cafe_log_async_begin(pCafeParam param)
+{
+	if (async_log.depth++ > 0) return;
+	async_log.flog = param->flog;
+	async_log.quiet = param->quiet;
+	async_log.stop = 0;
+	pthread_create(&async_log.thread, NULL, __cafe_log_thread_func, NULL);
+}
+
+/// Waits for everything queued to be written and stops the writer
+void cafe_log_async_end()
+{
+	if (async_log.depth == 0 || --async_log.depth > 0) return;
+	pthread_mutex_lock(&async_log.lock);
+	async_log.stop = 1;
+	pthread_cond_signal(&async_log.ready);
+	pthread_mutex_unlock(&async_log.lock);
+	pthread_join(async_log.thread, NULL);
+	if (async_log.text) memory_free(async_log.text);
+	async_log.text = NULL;
+	async_log.len = async_log.capacity = 0;
+}
+
+int cafe_log_enabled(pCafeParam param, int level)
+{
+	return level <= param->log_level;
+}
+
+static void __cafe_vlog(pCafeParam param, const char* msg, va_list ap)
+{
+	char buf[STRING_STEP_SIZE];
+	char* text = buf;
+	va_list ap2;
+	va_copy(ap2, ap);
+	int len = vsnprintf(buf, STRING_STEP_SIZE, msg, ap2);
+	va_end(ap2);
+	if (len < 0) return;
+	if (len >= STRING_STEP_SIZE)
+	{
+		text = (char*)memory_new(len + 1, sizeof(char));
+		vsnprintf(text, len + 1, msg, ap);
+	}
+	if (async_log.depth > 0 && param->flog == async_log.flog && param->quiet == async_log.quiet)
+	{
+		pthread_mutex_lock(&async_log.lock);
+		if (async_log.len + len > async_log.capacity)
+		{
+			size_t capacity = MAX(2 * async_log.capacity, async_log.len + len);
+			async_log.text = (char*)memory_realloc(async_log.text, capacity, sizeof(char));
+			async_log.capacity = capacity;
+		}
+		memcpy(async_log.text + async_log.len, text, len);
+		async_log.len += len;
+		pthread_cond_signal(&async_log.ready);
+		pthread_mutex_unlock(&async_log.lock);
+	}
+	else
+	{
+		__cafe_log_write(param->flog, param->quiet, text, len);
+	}
+	if (text != buf) memory_free(text);
+}
+
 /**
 \brief Logs the message and parameters in a standard way
 *
@@ -48,19 +184,19 @@ pBirthDeathCacheArray probability_cache = NULL;
 {
   va_list ap;
   va_start(ap, msg);
-  if ( param->flog != stderr && param->flog != stdout )
-  {
-    va_list ap2; 
-    va_copy(ap2, ap); 
-    vfprintf(param->flog, msg, ap2); 
-    va_end(ap2);
-  }
-  if (!param->quiet)
-  {
-	  vfprintf(stdout, msg, ap);
-	  fflush(stdout);
-  }
-  fflush(param->flog);
+  __cafe_vlog(param, msg, ap);
+  va_end(ap);
+}
+
+/**
+* \brief Same as \ref cafe_log, but only if level is within the verbosity set by "log -v"
+*/
+void cafe_log_level(pCafeParam param, int level, const char* msg, ... )
+{
+  if (!cafe_log_enabled(param, level)) return;
+  va_list ap;
+  va_start(ap, msg);
+  __cafe_vlog(param, msg, ap);
   va_end(ap);
 }
 
@@ -80,13 +216,38 @@ void copy_range_to_tree(pCafeTree tree, family_size_range* range)
 
 }
 
-void thread_run(int numthreads, void* (*run)(void*), void* param, int size )
+typedef struct
+{
+	void* (*run)(void*);
+	void* arg;
+	RandomStream stream;
+}ThreadStart;
+
+static void* __thread_start(void* ptr)
+{
+	ThreadStart* start = (ThreadStart*)ptr;
+	unifrnd_set_stream(&start->stream);
+	return start->run(start->arg);
+}
+
+/**
+* \brief Runs run on numthreads threads, each with its own random stream
+*
+* The streams are split off the caller's stream, so thread i sees the same
+* numbers for a given seed and thread count.
+*/
+static void __thread_run_args(int numthreads, void* (*run)(void*), void** args)
 {
 	int i;
+	uint64_t seed = unifrnd_split();
 	pthread_t* pthreads = (pthread_t*)memory_new( numthreads, sizeof(pthread_t));
+	ThreadStart* starts = (ThreadStart*)memory_new( numthreads, sizeof(ThreadStart));
 	for ( i = 0 ; i < numthreads ; i++ )
 	{
-		if ( pthread_create(&pthreads[i],NULL, run, (void*)((char*)param+size*i)) != 0 )			
+		starts[i].run = run;
+		starts[i].arg = args[i];
+		random_stream_init(&starts[i].stream, seed, i);
+		if ( pthread_create(&pthreads[i],NULL, __thread_start, &starts[i]) != 0 )
 		{
 			print_error(__FILE__,(char*)__FUNCTION__,__LINE__,
 					    "create %dth thread", i);		
@@ -96,28 +257,26 @@ void thread_run(int numthreads, void* (*run)(void*), void* param, int size )
 	{
 		pthread_join(pthreads[i], NULL);
 	}
+	memory_free(starts);
 	memory_free(pthreads);
 	pthreads = NULL;
 }
 
-void thread_run_with_arraylist(int numthreads, void* (*run)(void*), pArrayList pal )
+void thread_run(int numthreads, void* (*run)(void*), void* param, int size )
 {
 	int i;
-	pthread_t* pthreads = (pthread_t*)memory_new( numthreads, sizeof(pthread_t));
-	for ( i = 0 ; i < numthreads ; i++ )
-	{
-		if ( pthread_create(&pthreads[i],NULL, run, pal->array[i] ) != 0 )			
-		{
-			print_error(__FILE__,(char*)__FUNCTION__,__LINE__,
-					    "create %dth thread", i);		
-		}
-	}
+	void** args = (void**)memory_new( numthreads, sizeof(void*));
 	for ( i = 0 ; i < numthreads ; i++ )
 	{
-		pthread_join(pthreads[i], NULL);
+		args[i] = (void*)((char*)param+size*i);
 	}
-	memory_free(pthreads);
-	pthreads = NULL;
+	__thread_run_args(numthreads, run, args);
+	memory_free(args);
+}
+
+void thread_run_with_arraylist(int numthreads, void* (*run)(void*), pArrayList pal )
+{
+	__thread_run_args(numthreads, run, pal->array);
 }
 
 
@@ -143,6 +302,14 @@ void show_sizes(FILE* f, pCafeTree pcafe, family_size_range* range, pCafeFamilyI
 }
 
 double cafe_get_posterior(pCafeFamily pfamily, pCafeTree pcafe, family_size_range*range, double *ML, double *MAP, double *prior_rfsize, int quiet)
+{
+	return cafe_get_posterior_traced(pfamily, pcafe, range, ML, MAP, prior_rfsize, quiet, NULL);
+}
+
+/**
+* \brief Same as \ref cafe_get_posterior, adding the time spent pruning and reducing each family to trace if it is not NULL
+*/
+double cafe_get_posterior_traced(pCafeFamily pfamily, pCafeTree pcafe, family_size_range*range, double *ML, double *MAP, double *prior_rfsize, int quiet, pOptimizerTrace trace)
 {
 	int i, j;
 	double score = 0;
@@ -152,8 +319,15 @@ double cafe_get_posterior(pCafeFamily pfamily, pCafeTree pcafe, family_size_rang
 		pCafeFamilyItem pitem = (pCafeFamilyItem)pfamily->flist->array[i];
 		if ( pitem->ref < 0 || pitem->ref == i ) 
 		{
+			double t = trace ? cafe_trace_clock() : 0;
 			cafe_family_set_size(pfamily, i, pcafe);	// this part is just setting the leave counts.
 			compute_tree_likelihoods(pcafe);
+			if (trace)
+			{
+				double now = cafe_trace_clock();
+				trace->prune_time += now - t;
+				t = now;
+			}
 			likelihood = get_likelihoods(pcafe);		// likelihood of the whole tree = multiplication of likelihood of all nodes
 			ML[i] = __max(likelihood, pcafe->rfsize);			// this part find root size condition with maxlikelihood for each family			
 			if ( pitem->maxlh < 0 )
@@ -176,6 +350,7 @@ double cafe_get_posterior(pCafeFamily pfamily, pCafeTree pcafe, family_size_rang
 			MAP[i] = __max(posterior, pcafe->rfsize);			// this part find root size condition with maxlikelihood for each family			
 			memory_free(posterior);
 			posterior = NULL;
+			if (trace) trace->reduce_time += cafe_trace_clock() - t;
 		}
 		else
 		{
@@ -311,8 +486,15 @@ double cafe_get_clustered_posterior(pCafeParam param)
 		pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[i];
 		if ( pitem->ref < 0 || pitem->ref == i ) 
 		{
+			double t = param->trace ? cafe_trace_clock() : 0;
 			cafe_family_set_size(param->pfamily, i, param->pcafe);
 			k_likelihoods = cafe_tree_clustered_likelihood(param->pcafe);		// likelihood of the whole tree = multiplication of likelihood of all nodes
+			if (param->trace)
+			{
+				double now = cafe_trace_clock();
+				param->trace->prune_time += now - t;
+				t = now;
+			}
 			
 			// find the p_z_membership conditioned on the current parameter.
 			// it is just proportional to the likelihood of each datapoint in each cluster weighted by the k_weights.
@@ -356,6 +538,7 @@ double cafe_get_clustered_posterior(pCafeParam param)
 				int max_k = __maxidx(param->p_z_membership[i],k);
 				pitem->maxlh = __maxidx(k_likelihoods[max_k],param->pcafe->rfsize);	
 			}
+			if (param->trace) param->trace->reduce_time += cafe_trace_clock() - t;
 		}
 		else
 		{
@@ -506,6 +689,7 @@ double __cafe_cluster_lambda_search(double* parameters, void* args)
 	pCafeTree pcafe = (pCafeTree)param->pcafe;
 	double score = 0;
 	int skip = 0;
+	if (param->trace) cafe_trace_begin(param->trace);
 	for ( i = 0 ; i < param->num_params; i++ )
 	{
 		if ( parameters[i] < 0 ) 
@@ -520,21 +704,26 @@ double __cafe_cluster_lambda_search(double* parameters, void* args)
 		param->param_set_func(param,parameters);
 
 		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
+		if (param->trace) cafe_trace_matrices_done(param->trace, probability_cache);
 		score = cafe_get_clustered_posterior(param);
 		cafe_free_birthdeath_cache(pcafe);
 		cafe_tree_node_free_clustered_likelihoods(param);
 	}
-	char buf[STRING_STEP_SIZE];
-	buf[0] = '\0';
-	string_pchar_join_double(buf,",", param->num_lambdas*(param->parameterized_k_value-param->fixcluster0), parameters );
-	fprintf(stdout, "Lambda : %s\n", buf);
-	buf[0] = '\0';
-	if (param->parameterized_k_value > 0) {
-		string_pchar_join_double(buf,",", param->parameterized_k_value, param->k_weights );
-		fprintf(stdout, "p : %s\n", buf);
+	if (param->trace) cafe_trace_end(param->trace, parameters, score);
+	if (cafe_log_enabled(param, CAFE_LOG_DETAIL))
+	{
+		char buf[STRING_STEP_SIZE];
+		buf[0] = '\0';
+		string_pchar_join_double(buf,",", param->num_lambdas*(param->parameterized_k_value-param->fixcluster0), parameters );
+		cafe_log(param, "Lambda : %s\n", buf);
+		buf[0] = '\0';
+		if (param->parameterized_k_value > 0) {
+			string_pchar_join_double(buf,",", param->parameterized_k_value, param->k_weights );
+			cafe_log(param, "p : %s\n", buf);
+		}
+		cafe_log(param, "Score: %f\n", score);
+		cafe_log(param, ".");
 	}
-	fprintf(stdout, "Score: %f\n", score);
-	fprintf(stdout, ".");
 	return -score;
 }
 
@@ -566,24 +755,25 @@ double __cafe_cluster_lambda_mu_search(double* parameters, void* args)
 		cafe_free_birthdeath_cache(pcafe);
 		cafe_tree_node_free_clustered_likelihoods(param);
 	}
+	if (!cafe_log_enabled(param, CAFE_LOG_DETAIL)) return -score;
 	char buf[STRING_STEP_SIZE];
 	buf[0] = '\0';
 	for( i=0; i<param->num_lambdas; i++) {
 	string_pchar_join_double(buf,",", (param->parameterized_k_value-param->fixcluster0), &parameters[i*(param->parameterized_k_value-param->fixcluster0)] );
-	fprintf(stdout, "Lambda branch %d: %s\n", i, buf);
+	cafe_log(param, "Lambda branch %d: %s\n", i, buf);
 	buf[0] = '\0';
 	}
 	for (i=0; i<param->num_mus; i++) {
 	string_pchar_join_double(buf,",", (param->parameterized_k_value-param->fixcluster0), &parameters[param->num_lambdas*(param->parameterized_k_value-param->fixcluster0)+i*(param->parameterized_k_value-param->fixcluster0)]);
-	fprintf(stdout, "Mu branch %d: %s \n", i, buf);
+	cafe_log(param, "Mu branch %d: %s \n", i, buf);
 	buf[0] = '\0';
 	}
 	if (param->parameterized_k_value > 0) {
 		string_pchar_join_double(buf,",", param->parameterized_k_value, param->k_weights );
-		fprintf(stdout, "p : %s\n", buf);
+		cafe_log(param, "p : %s\n", buf);
 	}
 	//cafe_log(param, "Score: %f\n", score);
-	fprintf(stdout, ".");
+	cafe_log(param, ".");
 	return -score;
 }
 
@@ -617,6 +807,7 @@ double __cafe_best_lambda_mu_search(double* parameters, void* args)
 		score = cafe_get_posterior(param->pfamily, param->pcafe, &param->family_size, param->ML, param->MAP, param->prior_rfsize, param->quiet);
 		cafe_free_birthdeath_cache(pcafe);
 	}
+	if (!cafe_log_enabled(param, CAFE_LOG_DETAIL)) return -score;
 	char buf[STRING_STEP_SIZE];
 	buf[0] = '\0';
 	string_pchar_join_double(buf,",", param->num_lambdas, parameters );
@@ -635,6 +826,7 @@ double __cafe_best_lambda_search(double* plambda, void* args)
 	pCafeTree pcafe = (pCafeTree)param->pcafe;
 	double score = 0;
 	int skip = 0;
+	if (param->trace) cafe_trace_begin(param->trace);
 	for ( i = 0 ; i < param->num_lambdas ; i++ )
 	{
 		if ( plambda[i] < 0 ) 
@@ -649,9 +841,12 @@ double __cafe_best_lambda_search(double* plambda, void* args)
 		param->param_set_func(param,plambda);
 
 		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
-        score = cafe_get_posterior(param->pfamily, param->pcafe, &param->family_size, param->ML, param->MAP, param->prior_rfsize, param->quiet);
+		if (param->trace) cafe_trace_matrices_done(param->trace, probability_cache);
+        score = cafe_get_posterior_traced(param->pfamily, param->pcafe, &param->family_size, param->ML, param->MAP, param->prior_rfsize, param->quiet, param->trace);
 		cafe_free_birthdeath_cache(pcafe);
 	}
+	if (param->trace) cafe_trace_end(param->trace, plambda, score);
+	if (!cafe_log_enabled(param, CAFE_LOG_DETAIL)) return -score;
 	char buf[STRING_STEP_SIZE];
 	buf[0] = '\0';
 	string_pchar_join_double(buf,",", param->num_lambdas, plambda );
@@ -660,52 +855,335 @@ double __cafe_best_lambda_search(double* plambda, void* args)
 	return -score;
 }
 
+/**
+* \brief Scores the given lambdas against all families using a private birthdeath cache
+*
+* Does the same work as \ref __cafe_best_lambda_search without logging and without
+* touching the global probability_cache, so several threads may score at once as long
+* as each one passes its own parameters from \ref cafe_thread_copy_parameters and
+* \ref chooseln_cache_reserve has been called beforehand.
+*/
+double cafe_get_posterior_for_lambdas(pCafeParam param, double* plambda)
+{
+	int i;
+	for ( i = 0 ; i < param->num_lambdas ; i++ )
+	{
+		if ( plambda[i] < 0 ) return log(0);
+	}
+	param->param_set_func(param, plambda);
+
+	pBirthDeathCacheArray cache = birthdeath_cache_init(MAX(param->family_size.max, param->family_size.root_max));
+	cafe_tree_set_birthdeath_with_cache(param->pcafe, cache);
+	double score = cafe_get_posterior(param->pfamily, param->pcafe, &param->family_size, param->ML, param->MAP, param->prior_rfsize, param->quiet);
+	birthdeath_cache_array_free(cache);
+	return score;
+}
 
 extern int chooseln_cache_size;
 
-double* cafe_best_lambda_by_fminsearch(pCafeParam param, int lambda_len, int k )
+/**
+* \brief State of a lambda search that is written to and read back from a checkpoint file
+*
+* The simplex itself lives in the FMinSearch; this holds everything around it that
+* \ref cafe_best_lambda_by_fminsearch_checkpoint needs to pick the search up again:
+* the restart index, the step of the k weight loop, earlier scores and the last point
+* scored, which is scored again on resume so p_z_membership and k_weights match.
+* The root size prior is saved too, since the empirical prior depends on its own
+* random starting point.
+*/
+typedef struct
 {
-	int i,j;
-	int max_runs = 10;
-	double* scores = memory_new(max_runs, sizeof(double));
+	const char* file;
+	int interval;
+	pCafeParam param;
+	int k;
+	int lambda_len;
+	/* 0 for a lambda search */
+	int mu_len;
+	math_func eq;
+	int N;
+	double* x_last;
+	int run;
+	int step;
+	double current_p;
+	double* scores;
+	int max_runs;
+	/* simplex read from the file, used by the first search after resuming */
+	int pending;
+	int iters;
+	double** v;
+	double* fv;
+}SearchCheckpoint;
+
+static void __cafe_search_checkpoint_init(SearchCheckpoint* pcp, pCafeParam param, int lambda_len, int mu_len, int k, const char* file, int interval, double* scores, int max_runs)
+{
+	memset(pcp, 0, sizeof(SearchCheckpoint));
+	pcp->file = file;
+	pcp->interval = interval;
+	pcp->param = param;
+	pcp->k = k;
+	pcp->lambda_len = lambda_len;
+	pcp->mu_len = mu_len;
+	pcp->N = k > 0 || mu_len > 0 ? param->num_params : lambda_len;
+	pcp->x_last = (double*)memory_new(pcp->N, sizeof(double));
+	pcp->v = (double**)memory_new_2dim(pcp->N + 1, pcp->N, sizeof(double));
+	pcp->fv = (double*)memory_new(pcp->N + 1, sizeof(double));
+	pcp->scores = scores;
+	pcp->max_runs = max_runs;
+}
+
+static void __cafe_search_checkpoint_free(SearchCheckpoint* pcp)
+{
+	memory_free(pcp->x_last);
+	memory_free_2dim((void**)pcp->v, pcp->N + 1, pcp->N, NULL);
+	memory_free(pcp->fv);
+}
+
+static double __cafe_search_checkpoint_eq(double* x, void* args)
+{
+	SearchCheckpoint* pcp = (SearchCheckpoint*)args;
+	memcpy(pcp->x_last, x, sizeof(double)*pcp->N);
+	return pcp->eq(x, pcp->param);
+}
+
+static void __write_doubles(FILE* fp, const char* key, double* values, int size)
+{
+	int i;
+	fprintf(fp, "%s %d", key, size);
+	for (i = 0; i < size; i++) fprintf(fp, " %.17g", values[i]);
+	fprintf(fp, "\n");
+}
+
+/**
+* \brief Writes the search state to pcp->file
+*
+* The file is written next to the target and renamed over it, so an interrupted
+* write leaves the previous checkpoint in place.
+*/
+static void __cafe_search_checkpoint(struct tagFMinSearch* pfm, void* args)
+{
+	int i;
+	SearchCheckpoint* pcp = (SearchCheckpoint*)args;
+	pCafeParam param = pcp->param;
+	char tmp[STRING_STEP_SIZE];
+	snprintf(tmp, STRING_STEP_SIZE, "%s.tmp", pcp->file);
+	FILE* fp = fopen(tmp, "w");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot write checkpoint %s\n", tmp);
+		return;
+	}
+	unsigned int seed;
+	unsigned long draws;
+	unifrnd_get_state(&seed, &draws);
+	fprintf(fp, "# CAFE lambda search checkpoint\n");
+	fprintf(fp, "num_params %d\nk %d\nlambda_len %d\nmu_len %d\n", param->num_params, pcp->k, pcp->lambda_len, pcp->mu_len);
+	fprintf(fp, "rng %u %lu\n", seed, draws);
+	fprintf(fp, "run %d\nstep %d\ncurrent_p %.17g\n", pcp->run, pcp->step, pcp->current_p);
+	__write_doubles(fp, "scores", pcp->scores, pcp->run);
+	__write_doubles(fp, "parameters", param->parameters, param->num_params);
+	__write_doubles(fp, "k_weights", param->k_weights, pcp->k > 0 ? pcp->k : 0);
+	__write_doubles(fp, "prior_rfsize", param->prior_rfsize, param->prior_rfsize ? FAMILYSIZEMAX : 0);
+	fprintf(fp, "simplex %d %d\n", pfm->N, pfm->iters);
+	for (i = 0; i < pfm->N1; i++)
+	{
+		__write_doubles(fp, "v", pfm->v[i], pfm->N);
+	}
+	__write_doubles(fp, "fv", pfm->fv, pfm->N1);
+	__write_doubles(fp, "last", pcp->x_last, pfm->N);
+	if (fclose(fp) != 0 || rename(tmp, pcp->file) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot write checkpoint %s\n", pcp->file);
+	}
+}
+
+static int __read_int(FILE* fp, const char* key, int* value)
+{
+	char buf[STRING_STEP_SIZE];
+	return fscanf(fp, "%2047s %d", buf, value) == 2 && strcmp(buf, key) == 0 ? 0 : -1;
+}
+
+static int __read_doubles(FILE* fp, const char* key, double* values, int size)
+{
+	int i, n;
+	if (__read_int(fp, key, &n) < 0 || n != size) return -1;
+	for (i = 0; i < size; i++)
+	{
+		if (fscanf(fp, "%lf", &values[i]) != 1) return -1;
+	}
+	return 0;
+}
+
+/**
+* \brief Reads a checkpoint written by \ref __cafe_search_checkpoint into pcp and param
+*
+* Fails if the file is missing, truncated, or was written for a different
+* number of parameters or clusters. On success the unifrnd stream is put back
+* where it was and pcp->pending is set.
+*/
+static int __cafe_search_checkpoint_read(SearchCheckpoint* pcp)
+{
+	int i, num_params, k, lambda_len, mu_len, N;
+	unsigned int seed;
+	unsigned long draws;
+	pCafeParam param = pcp->param;
+	char buf[STRING_STEP_SIZE];
+	FILE* fp = fopen(pcp->file, "r");
+	if (fp == NULL) return -1;
+	int ok = fgets(buf, STRING_STEP_SIZE, fp) != NULL
+		&& __read_int(fp, "num_params", &num_params) == 0 && num_params == param->num_params
+		&& __read_int(fp, "k", &k) == 0 && k == pcp->k
+		&& __read_int(fp, "lambda_len", &lambda_len) == 0 && lambda_len == pcp->lambda_len
+		&& __read_int(fp, "mu_len", &mu_len) == 0 && mu_len == pcp->mu_len
+		&& fscanf(fp, "%2047s %u %lu", buf, &seed, &draws) == 3 && strcmp(buf, "rng") == 0
+		&& __read_int(fp, "run", &pcp->run) == 0 && pcp->run >= 0 && pcp->run < pcp->max_runs
+		&& __read_int(fp, "step", &pcp->step) == 0
+		&& fscanf(fp, "%2047s %lf", buf, &pcp->current_p) == 2 && strcmp(buf, "current_p") == 0
+		&& __read_doubles(fp, "scores", pcp->scores, pcp->run) == 0
+		&& __read_doubles(fp, "parameters", param->parameters, param->num_params) == 0
+		&& __read_doubles(fp, "k_weights", param->k_weights, k > 0 ? k : 0) == 0
+		&& __read_doubles(fp, "prior_rfsize", param->prior_rfsize, param->prior_rfsize ? FAMILYSIZEMAX : 0) == 0
+		&& fscanf(fp, "%2047s %d %d", buf, &N, &pcp->iters) == 3 && strcmp(buf, "simplex") == 0 && N == pcp->N;
+	for (i = 0; ok && i <= pcp->N; i++)
+	{
+		ok = __read_doubles(fp, "v", pcp->v[i], pcp->N) == 0;
+	}
+	ok = ok && __read_doubles(fp, "fv", pcp->fv, pcp->N + 1) == 0
+		&& __read_doubles(fp, "last", pcp->x_last, pcp->N) == 0;
+	fclose(fp);
+	if (!ok) return -1;
+	unifrnd_set_state(seed, draws);
+	pcp->pending = 1;
+	return 0;
+}
+
+/* Starts a search at X0, or continues the one read from the checkpoint */
+static void __cafe_search_checkpoint_min(SearchCheckpoint* pcp, pFMinSearch pfm, double* X0)
+{
+	int i;
+	if (pcp->pending)
+	{
+		for (i = 0; i <= pfm->N; i++)
+		{
+			memcpy(pfm->v[i], pcp->v[i], sizeof(double)*pfm->N);
+		}
+		memcpy(pfm->fv, pcp->fv, sizeof(double)*pfm->N1);
+		pfm->iters = pcp->iters;
+		pfm->eq(pcp->x_last, pfm->args);
+		pcp->pending = 0;
+		fminsearch_min_resume(pfm);
+	}
+	else
+	{
+		fminsearch_min(pfm, X0);
+	}
+}
+
+/**
+* \brief Minimizes prs->eq over param->parameters from random starting points
+*
+* Each run draws a starting point with \ref __cafe_randomize_cluster_parameters and runs a
+* simplex search from it, leaving its best point in param->parameters. With param->checkconv
+* set, runs are repeated until one scores within 10 * tol of the best earlier run, for at
+* most max_runs runs. Returns 1 if the score converged, and sets runs to the number of runs.
+*/
+int cafe_restart_search(pCafeParam param, RestartSearch* prs, int* runs)
+{
+	int i;
 	int converged = 0;
-	int runs = 0;
-	
+	int run = prs->first_run;
 	do
 	{
-		
-		if ( param->num_params > 0 )
+		if ( param->num_params > 0 && !(prs->resumed && run == prs->first_run) )
 		{
-			__cafe_randomize_cluster_parameters( param, param->num_lambdas, param->num_mus, param->parameterized_k_value);
-            //__cafe_scaleup_cluster_parameters( param, param->num_lambdas, param->num_mus, param->parameterized_k_value);
+			pRandomStream old = prs->stream ? unifrnd_set_stream(prs->stream) : NULL;
+			__cafe_randomize_cluster_parameters( param, prs->lambda_len, prs->mu_len, prs->k);
+			if (prs->stream) unifrnd_set_stream(old);
 		}
 		
 		copy_range_to_tree(param->pcafe, &param->family_size);
 		
-		pFMinSearch pfm;
-		if (k > 0) {
-			pfm = fminsearch_new_with_eq(__cafe_cluster_lambda_search, param->num_params, param);
-			pfm->tolx = 1e-5;
-			pfm->tolf = 1e-5;
+		pFMinSearch pfm = fminsearch_new_with_eq(prs->eq, prs->N, prs->eq_args);
+		pfm->tolx = prs->tol;
+		pfm->tolf = prs->tol;
+		if (prs->search) {
+			prs->search(pfm, run, prs->search_args);
 		}
 		else {
-			pfm = fminsearch_new_with_eq(__cafe_best_lambda_search,lambda_len,param);
-			pfm->tolx = 1e-6;
-			pfm->tolf = 1e-6;
+			fminsearch_min(pfm, param->parameters);
+			double *re = fminsearch_get_minX(pfm);
+			for ( i = 0 ; i < prs->N ; i++ ) param->parameters[i] = re[i];
+		}
+		if (run > 0) {
+			double minscore = __min(prs->scores, run);
+			if (fabs(minscore - (*pfm->fv)) < 10*pfm->tolf) {
+				converged = 1;
+			}
+		}
+		prs->scores[run] = *pfm->fv;
+		fminsearch_free(pfm);
+		
+		copy_range_to_tree(param->pcafe, &param->family_size);
+		
+		run++;
+	} while (param->checkconv && !converged && run < prs->max_runs);
+	*runs = run;
+	return converged;
+}
+
+/* Routes the scores of pfm through the checkpoint, if there is one, and notes the run */
+static void __cafe_search_checkpoint_attach(SearchCheckpoint* pcp, pFMinSearch pfm, int run)
+{
+	if (pcp->file) {
+		pcp->eq = pfm->eq;
+		fminsearch_set_equation(pfm, __cafe_search_checkpoint_eq, pfm->N, pcp);
+		fminsearch_set_checkpoint(pfm, __cafe_search_checkpoint, pcp->interval, pcp);
+	}
+	if (!pcp->pending) {
+		pcp->run = run;
+		pcp->step = 0;
+	}
+}
+
+static void __cafe_search_log_convergence(pCafeParam param, int converged, int runs, int max_runs)
+{
+	if (param->checkconv) {
+		if (converged) {
+			cafe_log(param,"score converged in %d runs.\n", runs);
 		}
-		fminsearch_min(pfm, param->parameters);
+		else {
+			cafe_log(param,"score failed to converge in %d runs.\n", max_runs);
+		}
+	}
+}
+
+/* One run of the lambda search: the simplex search, then with clusters the k weight updates */
+static void __cafe_best_lambda_run(pFMinSearch pfm, int run, void* args)
+{
+	int i,j;
+	SearchCheckpoint* pcp = (SearchCheckpoint*)args;
+	pCafeParam param = pcp->param;
+	int k = pcp->k;
+	int lambda_len = pcp->lambda_len;
+	if (param->trace) param->trace->search = pfm;
+	__cafe_search_checkpoint_attach(pcp, pfm, run);
+
+	double current_p;
+	if (pcp->pending && pcp->step > 0) {
+		current_p = pcp->current_p;
+	}
+	else {
+		__cafe_search_checkpoint_min(pcp, pfm, param->parameters);
 		double *re = fminsearch_get_minX(pfm);
 		for ( i = 0 ; i < param->num_params ; i++ ) param->parameters[i] = re[i];
-        
-        
-        //__cafe_scaledown_cluster_parameters( param, param->num_lambdas, param->num_mus, param->parameterized_k_value);
-        
-
-		double current_p = param->parameters[(lambda_len)*(k-param->fixcluster0)];
-		double prev_p;
-		if (k>0) 
-		{
-			do {
+		current_p = param->parameters[(lambda_len)*(k-param->fixcluster0)];
+	}
+
+	double prev_p;
+	if (k>0) 
+	{
+		do {
+			if (!pcp->pending) {
 				double* sumofweights = (double*) memory_new(param->parameterized_k_value, sizeof(double));
 				for ( i = 0 ; i < param->pfamily->flist->size ; i++ ) {
 					for (j = 0; j<k; j++) {
@@ -716,174 +1194,211 @@ double* cafe_best_lambda_by_fminsearch(pCafeParam param, int lambda_len, int k )
 					param->parameters[(lambda_len)*(k-param->fixcluster0)+j] = sumofweights[j]/param->pfamily->flist->size;
 				}
 				memory_free(sumofweights);
+				pcp->step++;
+				pcp->current_p = current_p;
+			}
 
-				fminsearch_min(pfm, param->parameters);	
-				
-				double *re = fminsearch_get_minX(pfm);
-				for ( i = 0 ; i < param->num_params ; i++ ) param->parameters[i] = re[i];
-				
-				prev_p = current_p;
-				current_p = param->parameters[(lambda_len)*(k-param->fixcluster0)];
-			} while (current_p - prev_p > pfm->tolx);
+			__cafe_search_checkpoint_min(pcp, pfm, param->parameters);
+			
+			double *re = fminsearch_get_minX(pfm);
+			for ( i = 0 ; i < param->num_params ; i++ ) param->parameters[i] = re[i];
+			
+			prev_p = current_p;
+			current_p = param->parameters[(lambda_len)*(k-param->fixcluster0)];
+		} while (current_p - prev_p > pfm->tolx);
+	}
+
+	cafe_log(param, "\n");
+	cafe_log(param,"Lambda Search Result: %d\n", pfm->iters );
+	if (k > 0) {
+		char buf[STRING_STEP_SIZE];
+		buf[0] = '\0';
+		if (param->fixcluster0) {
+			strncat(buf, "0,", 2);
+			string_pchar_join_double(buf,",", param->num_lambdas*(param->parameterized_k_value-param->fixcluster0), param->parameters );
 		}
-		
-		cafe_log(param, "\n");
-		cafe_log(param,"Lambda Search Result: %d\n", pfm->iters );
-		if (k > 0) {
-			char buf[STRING_STEP_SIZE];
-			buf[0] = '\0';
+		else {
+			string_pchar_join_double(buf,",", param->num_lambdas*param->parameterized_k_value, param->parameters );
+		}
+		cafe_log(param,"Lambda : %s\n", buf);
+		buf[0] = '\0';
+		if (param->parameterized_k_value > 0) {
+			string_pchar_join_double(buf,",", param->parameterized_k_value, param->k_weights );
+			cafe_log(param, "p : %s\n", buf);
+			cafe_log(param, "p0 : %f\n", param->parameters[param->num_lambdas*(param->parameterized_k_value-param->fixcluster0)+0]);
+		}
+		cafe_log(param, "Score: %f\n", *pfm->fv);
+	}
+	else {
+		char buf[STRING_STEP_SIZE];
+		buf[0] = '\0';
+		string_pchar_join_double(buf,",", param->num_lambdas, param->parameters );
+		cafe_log(param,"Lambda : %s & Score: %f\n", buf, *pfm->fv);
+	}
+	if (param->trace) param->trace->search = NULL;
+}
+
+/* One run of the lambda and mu search */
+static void __cafe_best_lambda_mu_run(pFMinSearch pfm, int run, void* args)
+{
+	int i;
+	SearchCheckpoint* pcp = (SearchCheckpoint*)args;
+	pCafeParam param = pcp->param;
+	int k = pcp->k;
+	__cafe_search_checkpoint_attach(pcp, pfm, run);
+	__cafe_search_checkpoint_min(pcp, pfm, param->parameters);
+	double *re = fminsearch_get_minX(pfm);
+	for ( i = 0 ; i < param->num_params ; i++ ) param->parameters[i] = re[i];
+
+	cafe_log(param, "\n");
+	cafe_log(param,"Lambda Search Result: %d\n", pfm->iters );
+	// print
+	if (k>0) {
+		char buf[STRING_STEP_SIZE];
+		buf[0] = '\0';
+		for( i=0; i<param->num_lambdas; i++) {
 			if (param->fixcluster0) {
 				strncat(buf, "0,", 2);
-				string_pchar_join_double(buf,",", param->num_lambdas*(param->parameterized_k_value-param->fixcluster0), param->parameters );
+				string_pchar_join_double(buf,",", (param->parameterized_k_value-param->fixcluster0),  &param->parameters[i*(param->parameterized_k_value-param->fixcluster0)] );
 			}
 			else {
-				string_pchar_join_double(buf,",", param->num_lambdas*param->parameterized_k_value, param->parameters );
+				string_pchar_join_double(buf,",", param->parameterized_k_value, &param->parameters[i*param->parameterized_k_value] );
 			}
-			cafe_log(param,"Lambda : %s\n", buf);
+			cafe_log(param,"Lambda branch %d: %s\n", i, buf);
 			buf[0] = '\0';
-			if (param->parameterized_k_value > 0) {
-				string_pchar_join_double(buf,",", param->parameterized_k_value, param->k_weights );
-				cafe_log(param, "p : %s\n", buf);
-				cafe_log(param, "p0 : %f\n", param->parameters[param->num_lambdas*(param->parameterized_k_value-param->fixcluster0)+0]);
-			}
-			cafe_log(param, "Score: %f\n", *pfm->fv);
 		}
-		else {
-			char buf[STRING_STEP_SIZE];
+		for (i=0; i<param->num_mus-param->eqbg; i++) {
+			if (param->fixcluster0) {
+				strncat(buf, "0,", 2);
+				string_pchar_join_double(buf,",", (param->parameterized_k_value-param->fixcluster0),  &param->parameters[param->num_lambdas*(param->parameterized_k_value-param->fixcluster0)+i*(param->parameterized_k_value-param->fixcluster0)] );
+			}
+			else {
+				string_pchar_join_double(buf,",", param->parameterized_k_value, &param->parameters[param->num_lambdas*param->parameterized_k_value+i*param->parameterized_k_value]);
+			}
+			cafe_log(param,"Mu branch %d: %s \n", i, buf);
 			buf[0] = '\0';
-			string_pchar_join_double(buf,",", param->num_lambdas, param->parameters );
-			cafe_log(param,"Lambda : %s & Score: %f\n", buf, *pfm->fv);
 		}
-		if (runs > 0) {
-			double minscore = __min(scores, runs);
-			if (abs(minscore - (*pfm->fv)) < 10*pfm->tolf) {
-				converged = 1;
-			}
+		if (param->parameterized_k_value > 0) {
+			string_pchar_join_double(buf,",", param->parameterized_k_value, param->k_weights );
+			cafe_log(param, "p : %s\n", buf);
+			cafe_log(param, "p0 : %f\n", param->parameters[param->num_lambdas*(param->parameterized_k_value-param->fixcluster0)+(param->num_mus-param->eqbg)*(param->parameterized_k_value-param->fixcluster0)+0]);
 		}
-		scores[runs] = *pfm->fv;
-		fminsearch_free(pfm);
-		
-		copy_range_to_tree(param->pcafe, &param->family_size);
-		
-		runs++;
+		cafe_log(param, "Score: %f\n", *pfm->fv);
+	}
+	else {
+		char buf[STRING_STEP_SIZE];
+		buf[0] = '\0';
+		string_pchar_join_double(buf,",", param->num_lambdas, param->parameters );
+		cafe_log(param,"Lambda : %s ", buf, *pfm->fv);
+		buf[0] = '\0';
+		string_pchar_join_double(buf,",", param->num_mus-param->eqbg, param->parameters+param->num_lambdas );
+		cafe_log(param,"Mu : %s & Score: %f\n", buf, *pfm->fv);		
+	}
+}
 
-	} while (param->checkconv && !converged && runs<max_runs); 
-		
-//	string_free(pstr);
-	if (param->checkconv) {
-		if (converged) {
-			cafe_log(param,"score converged in %d runs.\n", runs);
-		}
-		else {
-			cafe_log(param,"score failed to converge in %d runs.\n", max_runs);
+double* cafe_best_lambda_by_fminsearch(pCafeParam param, int lambda_len, int k )
+{
+	return cafe_best_lambda_by_fminsearch_checkpoint(param, lambda_len, k, NULL, 0, 0);
+}
+
+/**
+* \brief Searches for the best lambdas, optionally saving the search state to a checkpoint file
+*
+* With a checkpoint file the state is written every interval iterations of the simplex
+* search; with resume set the search starts from the state in that file instead of from
+* random parameters. Returns NULL if the checkpoint could not be read.
+*/
+double* cafe_best_lambda_by_fminsearch_checkpoint(pCafeParam param, int lambda_len, int k, const char* checkpoint, int interval, int resume)
+{
+	int max_runs = 10;
+	double* scores = memory_new(max_runs, sizeof(double));
+	int runs = 0;
+	SearchCheckpoint cp;
+	__cafe_search_checkpoint_init(&cp, param, lambda_len, 0, k, checkpoint, interval, scores, max_runs);
+	if (checkpoint && resume)
+	{
+		if (__cafe_search_checkpoint_read(&cp) < 0)
+		{
+			__cafe_search_checkpoint_free(&cp);
+			memory_free(scores);
+			return NULL;
 		}
 	}
+	cafe_log_async_begin(param);
+
+	RestartSearch rs;
+	memset(&rs, 0, sizeof(RestartSearch));
+	rs.eq = k > 0 ? __cafe_cluster_lambda_search : __cafe_best_lambda_search;
+	rs.eq_args = param;
+	rs.N = cp.N;
+	rs.tol = k > 0 ? 1e-5 : 1e-6;
+	rs.lambda_len = param->num_lambdas;
+	rs.mu_len = param->num_mus;
+	rs.k = param->parameterized_k_value;
+	rs.search = __cafe_best_lambda_run;
+	rs.search_args = &cp;
+	rs.max_runs = max_runs;
+	rs.scores = scores;
+	rs.first_run = cp.run;
+	rs.resumed = cp.pending;
+	int converged = cafe_restart_search(param, &rs, &runs);
+
+	__cafe_search_log_convergence(param, converged, runs, max_runs);
+	__cafe_search_checkpoint_free(&cp);
+	cafe_log_async_end();
 	memory_free(scores);
 	return param->parameters;
 }
 
 double* cafe_best_lambda_mu_by_fminsearch(pCafeParam param, int lambda_len, int mu_len, int k )
 {
-	int i;
+	return cafe_best_lambda_mu_by_fminsearch_checkpoint(param, lambda_len, mu_len, k, NULL, 0, 0);
+}
+
+/**
+* \brief Searches for the best lambdas and mus, optionally saving the search state to a checkpoint file
+*
+* Checkpoints the same way as \ref cafe_best_lambda_by_fminsearch_checkpoint. Returns NULL
+* if the checkpoint could not be read.
+*/
+double* cafe_best_lambda_mu_by_fminsearch_checkpoint(pCafeParam param, int lambda_len, int mu_len, int k, const char* checkpoint, int interval, int resume)
+{
 	int max_runs = 10;
 	double* scores = memory_new(max_runs, sizeof(double));
-	int converged = 0;
 	int runs = 0;
-	
-	do
+	SearchCheckpoint cp;
+	__cafe_search_checkpoint_init(&cp, param, lambda_len, mu_len, k, checkpoint, interval, scores, max_runs);
+	if (checkpoint && resume)
 	{
-		if ( param->num_params > 0 )
+		if (__cafe_search_checkpoint_read(&cp) < 0)
 		{
-			__cafe_randomize_cluster_parameters( param, param->num_lambdas, param->num_mus, param->parameterized_k_value);
-            //__cafe_scaleup_cluster_parameters( param, param->num_lambdas, param->num_mus, param->parameterized_k_value);
-		}
-		
-		copy_range_to_tree(param->pcafe, &param->family_size);
-		
-		pFMinSearch pfm;
-		if (k > 0) {
-			pfm = fminsearch_new_with_eq(__cafe_cluster_lambda_mu_search, param->num_params, param);
-		}
-		else {
-			pfm = fminsearch_new_with_eq(__cafe_best_lambda_mu_search, param->num_params, param);
-		}
-		pfm->tolx = 1e-6;
-		pfm->tolf = 1e-6;
-		fminsearch_min(pfm, param->parameters);
-		double *re = fminsearch_get_minX(pfm);
-		for ( i = 0 ; i < param->num_params ; i++ ) param->parameters[i] = re[i];
-        
-        //__cafe_scaledown_cluster_parameters( param, param->num_lambdas, param->num_mus, param->parameterized_k_value);
-		
-		cafe_log(param, "\n");
-		cafe_log(param,"Lambda Search Result: %d\n", pfm->iters );
-		// print
-		if (k>0) {
-			char buf[STRING_STEP_SIZE];
-			buf[0] = '\0';
-			for( i=0; i<param->num_lambdas; i++) {
-				if (param->fixcluster0) {
-					strncat(buf, "0,", 2);
-					string_pchar_join_double(buf,",", (param->parameterized_k_value-param->fixcluster0),  &param->parameters[i*(param->parameterized_k_value-param->fixcluster0)] );
-				}
-				else {
-					string_pchar_join_double(buf,",", param->parameterized_k_value, &param->parameters[i*param->parameterized_k_value] );
-				}
-				cafe_log(param,"Lambda branch %d: %s\n", i, buf);
-				buf[0] = '\0';
-			}
-			for (i=0; i<param->num_mus-param->eqbg; i++) {
-				if (param->fixcluster0) {
-					strncat(buf, "0,", 2);
-					string_pchar_join_double(buf,",", (param->parameterized_k_value-param->fixcluster0),  &param->parameters[param->num_lambdas*(param->parameterized_k_value-param->fixcluster0)+i*(param->parameterized_k_value-param->fixcluster0)] );
-				}
-				else {
-					string_pchar_join_double(buf,",", param->parameterized_k_value, &param->parameters[param->num_lambdas*param->parameterized_k_value+i*param->parameterized_k_value]);
-				}
-				cafe_log(param,"Mu branch %d: %s \n", i, buf);
-				buf[0] = '\0';
-			}
-			if (param->parameterized_k_value > 0) {
-				string_pchar_join_double(buf,",", param->parameterized_k_value, param->k_weights );
-				cafe_log(param, "p : %s\n", buf);
-				cafe_log(param, "p0 : %f\n", param->parameters[param->num_lambdas*(param->parameterized_k_value-param->fixcluster0)+(param->num_mus-param->eqbg)*(param->parameterized_k_value-param->fixcluster0)+0]);
-			}
-			cafe_log(param, "Score: %f\n", *pfm->fv);
-		}
-		else {
-			char buf[STRING_STEP_SIZE];
-			buf[0] = '\0';
-			string_pchar_join_double(buf,",", param->num_lambdas, param->parameters );
-			cafe_log(param,"Lambda : %s ", buf, *pfm->fv);
-			buf[0] = '\0';
-			string_pchar_join_double(buf,",", param->num_mus-param->eqbg, param->parameters+param->num_lambdas );
-			cafe_log(param,"Mu : %s & Score: %f\n", buf, *pfm->fv);		
-		}
-		if (runs > 0) {
-			double minscore = __min(scores, runs);
-			if (abs(minscore - (*pfm->fv)) < 10*pfm->tolf) {
-				converged = 1;
-			}
-		}
-		scores[runs] = *pfm->fv;
-		fminsearch_free(pfm);
-		
-		copy_range_to_tree(param->pcafe, &param->family_size);
-		
-		runs++;
-        
-	} while (param->checkconv && !converged && runs<max_runs); 
-		
-
-//	string_free(pstr);
-	if (param->checkconv) {
-		if (converged) {
-			cafe_log(param,"score converged in %d runs.\n", runs);
-		}
-		else {
-			cafe_log(param,"score failed to converge in %d runs.\n", max_runs);
+			__cafe_search_checkpoint_free(&cp);
+			memory_free(scores);
+			return NULL;
 		}
 	}
+	cafe_log_async_begin(param);
+
+	RestartSearch rs;
+	memset(&rs, 0, sizeof(RestartSearch));
+	rs.eq = k > 0 ? __cafe_cluster_lambda_mu_search : __cafe_best_lambda_mu_search;
+	rs.eq_args = param;
+	rs.N = param->num_params;
+	rs.tol = 1e-6;
+	rs.lambda_len = param->num_lambdas;
+	rs.mu_len = param->num_mus;
+	rs.k = param->parameterized_k_value;
+	rs.search = __cafe_best_lambda_mu_run;
+	rs.search_args = &cp;
+	rs.max_runs = max_runs;
+	rs.scores = scores;
+	rs.first_run = cp.run;
+	rs.resumed = cp.pending;
+	int converged = cafe_restart_search(param, &rs, &runs);
+
+	__cafe_search_log_convergence(param, converged, runs, max_runs);
+	__cafe_search_checkpoint_free(&cp);
+	cafe_log_async_end();
 	memory_free(scores);
 	return param->parameters;
 }
@@ -898,10 +1413,31 @@ void reset_birthdeath_cache(pCafeTree tree, int k_value, family_size_range* rang
 	cafe_tree_set_birthdeath(tree);
 }
 
+/// Upper bound on the probabilities kept in the cache shared by the per-family searches
+#define EACH_LAMBDA_SHARED_CACHE_VALUES (1 << 25)
+
+typedef struct
+{
+	pCafeParam param;
+	pSharedBirthDeathCache shared;
+	pString* logs;
+	int* iters;
+	int* next;
+	int* next_log;
+	int lambda_len;
+	double* X0;
+	pString log;
+}EachLambdaParam;
+
+typedef EachLambdaParam* pEachLambdaParam;
+
+pthread_mutex_t mutex_cafe_each_lambda = PTHREAD_MUTEX_INITIALIZER;
+
 double __cafe_each_best_lambda_search(double* plambda, void* args)
 {
 	int i;
-	pCafeParam param = (pCafeParam)args;
+	pEachLambdaParam pel = (pEachLambdaParam)args;
+	pCafeParam param = pel->param;
 	pCafeTree pcafe = (pCafeTree)param->pcafe;
 	double score = 0;
 	int skip = 0;
@@ -919,60 +1455,81 @@ double __cafe_each_best_lambda_search(double* plambda, void* args)
 	{
 		param->param_set_func(param,plambda);
 
-		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
+		pBirthDeathCacheArray overflow = NULL;
+		cafe_tree_set_shared_birthdeath(pcafe, pel->shared, MAX(param->family_size.max, param->family_size.root_max), &overflow);
 		compute_tree_likelihoods(pcafe);
 		double* likelihood = get_likelihoods(pcafe);
 		score = log(__max(likelihood,pcafe->rfsize));
-		cafe_free_birthdeath_cache(pcafe);
-		probability_cache = NULL;
+		if (overflow)
+			birthdeath_cache_array_free(overflow);
 	}
 
+	if (!cafe_log_enabled(param, CAFE_LOG_DETAIL)) return -score;
 	char buf[STRING_STEP_SIZE];
 	buf[0] = '\0';
 	string_pchar_join_double(buf,",", param->num_lambdas, plambda );
-	cafe_log(param,"\tLambda : %s & Score: %f\n", buf, score);
-	cafe_log(param, "\n");
+	string_fadd(pel->log, "\tLambda : %s & Score: %f\n", buf, score);
+	string_fadd(pel->log, "\n");
 	return -score;
 
 }
 
-double* cafe_each_best_lambda_by_fminsearch(pCafeParam param, int lambda_len )
+/**
+* \brief Logs, in family order, every finished family that has not been logged yet
+*
+* Families that refer to an identical family take their lambdas from it here,
+* since it is guaranteed to be finished. Called with mutex_cafe_each_lambda held.
+*/
+void __cafe_each_best_lambda_flush(pEachLambdaParam pel)
 {
-	double* old_lambda = NULL;
-	if( param->lambda ) 
+	pCafeParam param = pel->param;
+	pArrayList flist = param->pfamily->flist;
+	for ( ; *pel->next_log < flist->size ; (*pel->next_log)++ )
 	{
-		old_lambda = param->lambda;
-	}
-	param->lambda = (double*)memory_new(lambda_len, sizeof(double));
-	param->num_lambdas = lambda_len;
-
-	family_size_range temp_range = param->family_size;
-
-	int i, j;
-	for ( i = 0 ; i < lambda_len ; i++ )
-	{
-		param->lambda[i] = 0.5/param->max_branch_length;
-	}
-	pFMinSearch pfm = fminsearch_new_with_eq(__cafe_each_best_lambda_search,lambda_len,param);
-	pfm->tolx = 1e-6;
-	pfm->tolf = 1e-6;
-	int fsize = param->pfamily->flist->size;
-	for ( i = 0 ; i < param->pfamily->flist->size ; i++ )
-	{
-		pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[i];
+		int i = *pel->next_log;
+		pCafeFamilyItem pitem = (pCafeFamilyItem)flist->array[i];
 		if ( pitem->ref >= 0 && pitem->ref != i )
 		{
-			pCafeFamilyItem pref = (pCafeFamilyItem)param->pfamily->flist->array[pitem->ref];
+			pCafeFamilyItem pref = (pCafeFamilyItem)flist->array[pitem->ref];
 			pitem->lambda = pref->lambda;
 			pitem->mu = pref->mu;
+			pel->iters[i] = pel->iters[pitem->ref];
+			cafe_family_set_size_with_family_forced(param->pfamily, i, param->pcafe);
 			param->param_set_func(param,pitem->lambda);
 
-			cafe_log(param,"%s: Lambda Search Result of %d/%d in %d iteration \n", pitem->id, i+1, fsize, pfm->iters );
+			cafe_log(param,"%s: Lambda Search Result of %d/%d in %d iteration \n", pitem->id, i+1, flist->size, pel->iters[i] );
 			pString pstr = cafe_tree_string_with_familysize_lambda(param->pcafe);
 			cafe_log(param,"%s: %s\n", pitem->id, pstr->buf );
 			string_free(pstr);
 			continue;
 		}
+		if ( pel->logs[i] == NULL ) break;
+		cafe_log(param, "%s", pel->logs[i]->buf);
+		string_free(pel->logs[i]);
+		pel->logs[i] = NULL;
+	}
+}
+
+void* __cafe_each_best_lambda_thread_func(void* ptr)
+{
+	int j;
+	pEachLambdaParam pel = (pEachLambdaParam)ptr;
+	pCafeParam param = pel->param;
+	pArrayList flist = param->pfamily->flist;
+	int lambda_len = pel->lambda_len;
+
+	pFMinSearch pfm = fminsearch_new_with_eq(__cafe_each_best_lambda_search,lambda_len,pel);
+	pfm->tolx = 1e-6;
+	pfm->tolf = 1e-6;
+	while (1)
+	{
+		pthread_mutex_lock(&mutex_cafe_each_lambda);
+		int i = (*pel->next)++;
+		pthread_mutex_unlock(&mutex_cafe_each_lambda);
+		if ( i >= flist->size ) break;
+
+		pCafeFamilyItem pitem = (pCafeFamilyItem)flist->array[i];
+		if ( pitem->ref >= 0 && pitem->ref != i ) continue;
 
 		cafe_family_set_size_with_family_forced(param->pfamily,i,param->pcafe);
 
@@ -981,19 +1538,10 @@ double* cafe_each_best_lambda_by_fminsearch(pCafeParam param, int lambda_len )
 		param->family_size.min = param->pcafe->familysizes[0];
 		param->family_size.max = param->pcafe->familysizes[1];
 
-		cafe_log(param,"%s:\n", pitem->id );
+		pel->log = string_new();
+		string_fadd(pel->log, "%s:\n", pitem->id );
 		
-		fminsearch_min(pfm, param->lambda );
-
-/*
-		printf("%d %d:", param->rootfamily_sizes[1], param->family_sizes[1] );
-		for ( j = 0 ; j < param->pcafe->super.nlist->size ; j+=2 )
-		{
-			pCafeNode pnode = (pCafeNode)param->pcafe->super.nlist->array[j];
-			printf(" %d",  pnode->familysize );
-		}
-		printf("\n");
-*/
+		fminsearch_min(pfm, pel->X0 );
 
 		double *re = fminsearch_get_minX(pfm);
 		if ( pitem->lambda ) {memory_free( pitem->lambda ); pitem->lambda = NULL; }
@@ -1004,9 +1552,7 @@ double* cafe_each_best_lambda_by_fminsearch(pCafeParam param, int lambda_len )
 		for ( j = 0 ; j < lambda_len ; j++ ) 
 		{
 			pitem->lambda[j] = re[j];
-			//pitem->mu[j] = re[j];
 			double a = re[j] * param->max_branch_length;
-//			printf("%f\n", a);
 			if ( a >= 0.5 || fabs(a-0.5) < 1e-3 )
 			{
 				lambda_check = 1;	
@@ -1014,27 +1560,95 @@ double* cafe_each_best_lambda_by_fminsearch(pCafeParam param, int lambda_len )
 		}
 		param->param_set_func(param,re);
 
-		cafe_log(param,"Lambda Search Result of %d/%d in %d iteration \n", i+1, fsize, pfm->iters );
+		string_fadd(pel->log,"Lambda Search Result of %d/%d in %d iteration \n", i+1, flist->size, pfm->iters );
 		if ( lambda_check )
 		{
-			cafe_log(param,"Caution : at least one lambda near boundary\n" );
+			string_fadd(pel->log,"Caution : at least one lambda near boundary\n" );
 		}
 		pString pstr = cafe_tree_string_with_familysize_lambda(param->pcafe);
 		if ( lambda_check )
 		{
-			cafe_log(param,"@@ ");
+			string_fadd(pel->log,"@@ ");
 		}
-		cafe_log(param,"%s\n", pstr->buf );
+		string_fadd(pel->log,"%s\n", pstr->buf );
 		string_free(pstr);
+
+		pthread_mutex_lock(&mutex_cafe_each_lambda);
+		pel->iters[i] = pfm->iters;
+		pel->logs[i] = pel->log;
+		__cafe_each_best_lambda_flush(pel);
+		pthread_mutex_unlock(&mutex_cafe_each_lambda);
+		pel->log = NULL;
 	}
 	fminsearch_free(pfm);
+	return NULL;
+}
+
+/**
+* \brief Finds the best lambdas for each family separately
+*
+* Families are handed out one at a time to param->num_threads workers, each with its own
+* tree and optimizer. Transition matrices go to a cache shared by all workers so that a
+* matrix computed for one family is reused by the others. The log is written in family
+* order regardless of which family finishes first.
+*/
+double* cafe_each_best_lambda_by_fminsearch(pCafeParam param, int lambda_len )
+{
+	int i;
+	param->num_lambdas = lambda_len;
+
+	family_size_range temp_range = param->family_size;
+	int fsize = param->pfamily->flist->size;
+
+	double* X0 = (double*)memory_new(lambda_len, sizeof(double));
+	for ( i = 0 ; i < lambda_len ; i++ )
+	{
+		X0[i] = 0.5/param->max_branch_length;
+	}
+
+	int max_size = 0;
+	for ( i = 0 ; i < fsize ; i++ )
+	{
+		cafe_family_set_size_with_family_forced(param->pfamily,i,param->pcafe);
+		max_size = MAX(max_size, MAX(param->pcafe->familysizes[1], param->pcafe->rootfamilysizes[1]));
+	}
+	pSharedBirthDeathCache shared = shared_birthdeath_cache_new(max_size, EACH_LAMBDA_SHARED_CACHE_VALUES);
+
+	pString* logs = (pString*)memory_new(fsize, sizeof(pString));
+	int* iters = (int*)memory_new(fsize, sizeof(int));
+	int next = 0;
+	int next_log = 0;
+	int num_threads = MAX(1, MIN(param->num_threads, fsize));
+	pEachLambdaParam ptparam = (pEachLambdaParam)memory_new(num_threads, sizeof(EachLambdaParam));
+	for ( i = 0 ; i < num_threads ; i++ )
+	{
+		ptparam[i].param = cafe_thread_copy_parameters(param);
+		ptparam[i].shared = shared;
+		ptparam[i].logs = logs;
+		ptparam[i].iters = iters;
+		ptparam[i].next = &next;
+		ptparam[i].next_log = &next_log;
+		ptparam[i].lambda_len = lambda_len;
+		ptparam[i].X0 = X0;
+	}
+	cafe_log_async_begin(param);
+	thread_run(num_threads, __cafe_each_best_lambda_thread_func, ptparam, sizeof(EachLambdaParam));
+	cafe_log_async_end();
+
+	for ( i = 0 ; i < num_threads ; i++ )
+	{
+		cafe_thread_free_parameters(ptparam[i].param);
+	}
+	memory_free(ptparam);
+	memory_free(iters);
+	memory_free(logs);
+	memory_free(X0);
+	shared_birthdeath_cache_free(shared);
 
 	copy_range_to_tree(param->pcafe, &temp_range);
 
 	param->family_size = temp_range;
 
-	memory_free(param->lambda);
-	param->lambda = old_lambda;
 	return param->lambda;
 }
 
@@ -1174,3 +1788,33 @@ void cafe_free_copy_parameters(pCafeParam param)
 	memory_free(param);
 	param = NULL;
 }
+
+/**
+* \brief Copies the parameters for use by a worker thread
+*
+* In addition to the tree copied by \ref cafe_copy_parameters, the copy gets its own
+* parameter, ML and MAP arrays so that param_set_func and \ref cafe_get_posterior
+* can be called on it without disturbing the source.
+*/
+pCafeParam cafe_thread_copy_parameters(pCafeParam psrc)
+{
+	pCafeParam param = cafe_copy_parameters(psrc);
+	param->num_lambdas = psrc->num_lambdas;
+	param->parameters = (double*)memory_new(MAX(psrc->num_params, psrc->num_lambdas), sizeof(double));
+	if (psrc->parameters)
+		memcpy(param->parameters, psrc->parameters, psrc->num_params*sizeof(double));
+	param->lambda = param->parameters;
+	param->trace = NULL;
+	int fsize = psrc->pfamily ? psrc->pfamily->flist->size : 0;
+	param->ML = (double*)memory_new(fsize, sizeof(double));
+	param->MAP = (double*)memory_new(fsize, sizeof(double));
+	return param;
+}
+
+void cafe_thread_free_parameters(pCafeParam param)
+{
+	memory_free(param->parameters);
+	memory_free(param->ML);
+	memory_free(param->MAP);
+	cafe_free_copy_parameters(param);
+}
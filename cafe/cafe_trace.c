@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cafe.h"
+#include<stdio.h>
+#include<stdint.h>
+#include<time.h>
+#include<mathfunc.h>
+#include<memalloc.h>
+
+/**
+* \file cafe_trace.c
+* \brief Optimizer trace written by the lambda search
+*
+* The text format is tab separated with a header line. The binary format starts
+* with the 8 bytes "CAFETRC1" and an int32 parameter count, followed by one record
+* per evaluation: int32 evaluation, int32 simplex step (see FMINSEARCH_OP, -1 if
+* none), doubles score, total, matrix, prune and reduce seconds, int64 cache hits
+* and misses, and the parameters as doubles, all in native byte order.
+*/
+
+pOptimizerTrace cafe_trace_new(const char* file, int binary, int num_params)
+{
+	int i;
+	FILE* fp = fopen(file, binary ? "wb" : "w");
+	if (fp == NULL) return NULL;
+	pOptimizerTrace trace = (pOptimizerTrace)memory_new(1, sizeof(OptimizerTrace));
+	trace->fp = fp;
+	trace->binary = binary;
+	trace->num_params = num_params;
+	if (binary)
+	{
+		int32_t n = num_params;
+		fwrite("CAFETRC1", 1, 8, fp);
+		fwrite(&n, sizeof(n), 1, fp);
+	}
+	else
+	{
+		fprintf(fp, "evaluation\tstep\tscore\ttotal_ms\tmatrix_ms\tprune_ms\treduce_ms\tcache_hits\tcache_misses");
+		for (i = 0; i < num_params; i++) fprintf(fp, "\tp%d", i + 1);
+		fprintf(fp, "\n");
+	}
+	return trace;
+}
+
+void cafe_trace_free(pOptimizerTrace trace)
+{
+	fclose(trace->fp);
+	memory_free(trace);
+}
+
+/// Monotonic wall clock in seconds
+double cafe_trace_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void cafe_trace_begin(pOptimizerTrace trace)
+{
+	trace->matrix_time = trace->prune_time = trace->reduce_time = 0;
+	trace->cache_hits = trace->cache_misses = 0;
+	trace->start = cafe_trace_clock();
+}
+
+/// Called once the transition matrices for the tree are built from cache
+void cafe_trace_matrices_done(pOptimizerTrace trace, pBirthDeathCacheArray cache)
+{
+	trace->matrix_time = cafe_trace_clock() - trace->start;
+	if (cache)
+	{
+		trace->cache_hits = cache->hits;
+		trace->cache_misses = cache->misses;
+	}
+}
+
+void cafe_trace_end(pOptimizerTrace trace, double* parameters, double score)
+{
+	int i;
+	double total = cafe_trace_clock() - trace->start;
+	int op = trace->search ? trace->search->op : -1;
+	trace->evaluation++;
+	if (trace->binary)
+	{
+		int32_t ints[2] = { trace->evaluation, op };
+		double times[5] = { score, total, trace->matrix_time, trace->prune_time, trace->reduce_time };
+		int64_t counts[2] = { (int64_t)trace->cache_hits, (int64_t)trace->cache_misses };
+		fwrite(ints, sizeof(int32_t), 2, trace->fp);
+		fwrite(times, sizeof(double), 5, trace->fp);
+		fwrite(counts, sizeof(int64_t), 2, trace->fp);
+		fwrite(parameters, sizeof(double), trace->num_params, trace->fp);
+	}
+	else
+	{
+		fprintf(trace->fp, "%d\t%s\t%.10g\t%.3f\t%.3f\t%.3f\t%.3f\t%lu\t%lu", trace->evaluation,
+			op < 0 ? "none" : fminsearch_op_name(op), score, total*1000, trace->matrix_time*1000,
+			trace->prune_time*1000, trace->reduce_time*1000, (unsigned long)trace->cache_hits, (unsigned long)trace->cache_misses);
+		for (i = 0; i < trace->num_params; i++) fprintf(trace->fp, "\t%.17g", parameters[i]);
+		fprintf(trace->fp, "\n");
+	}
+}
@@ -229,66 +229,41 @@ double cafe_tree_mp_remark(pString pstr, pTree ptree, pMetapostConfig pmc, va_li
  *******************************************************************************/
 /* this is for finding the ML path 
 instead of summing the likelihood across all possible innernodes
-choose the maximum likelihood across all possible innernodes */
+choose the maximum likelihood across all possible innernodes
+
+Works with logarithms of the likelihoods, which pcnode->likelihoods holds until the next
+computation, so that deep trees do not underflow. Of equally likely child sizes the smallest
+is taken. */
 void __cafe_tree_node_compute_viterbi(pTree ptree, pTreeNode ptnode, va_list ap1 )
 {
 	pCafeTree pcafe = (pCafeTree)ptree;
 	pCafeNode pcnode = (pCafeNode)ptnode;
-	//double lambda = pcafe->lambda;
-
-	double *tree_factors[2];
-	tree_factors[0] = memory_new(pcafe->size_of_factor, sizeof(double));
-	tree_factors[1] = memory_new(pcafe->size_of_factor, sizeof(double));
-	int size;
-	int s,c,i,j; 
+	int s,i,j;
 	int* rootfamilysizes;
 	int* familysizes;
 
 	if ( tree_is_leaf(ptnode) )
 	{
-		if ( tree_is_root(ptree, ptnode->parent) )
-		{
-			rootfamilysizes = pcafe->rootfamilysizes;
-		}
-		else
-		{
-			rootfamilysizes = pcafe->familysizes;
+		if (pcnode->familysize < 0) { 
+			// unknown size: every size is equally likely
+			for ( j = 0 ; j < pcafe->size_of_factor ; j++ )
+			{
+				pcnode->likelihoods[j] = 0;
+			}
 		}
-		double* factors = tree_factors[0];
-		memset( factors, 0, pcafe->size_of_factor*sizeof(double));
-		for ( s = rootfamilysizes[0], i = 0; s <= rootfamilysizes[1] ; s++, i++ )
-		{
-			if (pcnode->familysize < 0) { 
-				//fprintf(stderr, "family size not set\n");
-				pcnode->likelihoods[i] = 1;					
-				double tmp = 0;
-				for( c = pcafe->familysizes[0], j = 0 ; c <= pcafe->familysizes[1] ; c++, j++ )
-				{
-					tmp = square_matrix_get(pcnode->birthdeath_matrix, s, c);
-					if ( tmp > factors[i] )
-					{
-						factors[i] = tmp;
-						pcnode->viterbi[i] = j;
-					}
-				}
+		else if (pcnode->errormodel) {
+			for( j=0; j<pcafe->size_of_factor; j++) {
+				// conditional probability of measuring i=familysize when true count is j
+				double p = pcnode->errormodel->errormatrix[pcnode->familysize][j];
+				pcnode->likelihoods[j] = p > 0 ? log(p) : -HUGE_VAL;
 			}
-			else {
-                if (pcnode->errormodel) {
-                    memset((void*)pcnode->likelihoods, 0, pcafe->size_of_factor*sizeof(double));
-                    //int start = pcnode->familysize+pcnode->errormodel->fromdiff;
-                    //int end = pcnode->familysize+pcnode->errormodel->todiff;
-                    //if (start<0) {i=0;j=i-start;} else {i=start;j=0;}
-                    for( j=0; j<pcafe->size_of_factor; j++) {
-                        // conditional probability of measuring i=familysize when true count is j
-                        pcnode->likelihoods[j] = pcnode->errormodel->errormatrix[pcnode->familysize][j];
-                    }
-                }
-                else {
-                //pcnode->likelihoods[i] = pcnode->bd[s][pcnode->familysize];
-                memset((void*)pcnode->likelihoods, 0, pcafe->size_of_factor*sizeof(double));
-                pcnode->likelihoods[pcnode->familysize] = 1;	                    
-                }
+		}
+		else {
+			for ( j = 0 ; j < pcafe->size_of_factor ; j++ )
+			{
+				pcnode->likelihoods[j] = -HUGE_VAL;
 			}
+			pcnode->likelihoods[pcnode->familysize] = 0;
 		}
 	}
 	else
@@ -303,39 +278,35 @@ void __cafe_tree_node_compute_viterbi(pTree ptree, pTreeNode ptnode, va_list ap1
 			rootfamilysizes = familysizes = pcafe->familysizes;
 		}
 		int idx;
-		double *factors[2] = { NULL, NULL };
 		pCafeNode child[2] = { (pCafeNode)((pTreeNode)pcnode)->children->head->data, 
 							   (pCafeNode)((pTreeNode)pcnode)->children->tail->data };
 		for ( idx = 0 ; idx < 2 ; idx++ )
 		{
+			struct square_matrix* bd = child[idx]->birthdeath_matrix;
+			const double* log_bd = square_matrix_log_values(bd);
+			const double* lh = child[idx]->likelihoods;
+			int width = familysizes[1] - familysizes[0] + 1;
+			assert(rootfamilysizes[1] < bd->size && familysizes[1] < bd->size);
+			for( s = rootfamilysizes[0], i = 0 ; s <= rootfamilysizes[1] ; s++, i++ )
 			{
-				factors[idx] = tree_factors[idx];
-				memset( factors[idx], 0, pcafe->size_of_factor*sizeof(double));
-				for( s = rootfamilysizes[0], i = 0 ; s <= rootfamilysizes[1] ; s++, i++ )
+				const double* row = log_bd + s * bd->size + familysizes[0];
+				double best = -HUGE_VAL;
+				int arg = 0;
+				for( j = 0 ; j < width ; j++ )
 				{
-					double tmp = 0;
-					for( c = familysizes[0], j = 0 ; c <= familysizes[1] ; c++, j++ )
+					double tmp = row[j] + lh[j];
+					if ( tmp > best )
 					{
-						tmp = square_matrix_get(child[idx]->birthdeath_matrix, s, c) * child[idx]->likelihoods[j];
-						if ( tmp > factors[idx][i] )
-						{
-							factors[idx][i] = tmp;
-							child[idx]->viterbi[i] = j;
-						}
+						best = tmp;
+						arg = j;
 					}
 				}
+				child[idx]->viterbi[i] = arg;
+				// the node's likelihood is the product of the best factor from each child
+				pcnode->likelihoods[i] = idx == 0 ? best : pcnode->likelihoods[i] + best;
 			}
 		}
-		size = rootfamilysizes[1] - rootfamilysizes[0] + 1;
-		for ( i = 0 ; i < size ; i++ )
-		{
-			pcnode->likelihoods[i] = factors[0][i] * factors[1][i];
-		}
-//		printf("%s : %d, %d\n", pcnode->super.name, pcnode->super.branchlength, i );
 	}
-
-	memory_free(tree_factors[0]);
-	memory_free(tree_factors[1]);
 }
 
 void __cafe_tree_node_backtrack_viterbi(pTree ptree, pTreeNode ptnode, va_list ap1 )
@@ -426,7 +397,9 @@ void initialize_leaf_likelihoods(pTree ptree, pTreeNode ptnode)
 		// therefore the familysize must be less than this
 		assert(pcnode->familysize < pcafe->size_of_factor);
 		memset((void*)pcnode->likelihoods, 0, pcafe->size_of_factor*sizeof(double));
-		pcnode->likelihoods[pcnode->familysize] = 1;
+		// a leaf whose size was never set (-1) is left with zero likelihood
+		if (pcnode->familysize >= 0)
+			pcnode->likelihoods[pcnode->familysize] = 1;
 	}
 }
 
@@ -470,17 +443,6 @@ void __cafe_tree_node_compute_clustered_viterbi(pTree ptree, pTreeNode ptnode, v
 	int* rootfamilysizes;
 	int* familysizes;
 	
-	int maxFamilySize =  MAX( pcafe->rootfamilysizes[1], pcafe->familysizes[1]);
-	if ( !chooseln_is_init() ) 
-	{
-		chooseln_cache_init(maxFamilySize);
-	}
-	else if ( get_chooseln_cache_size() < maxFamilySize ) 
-	{
-		chooseln_cache_resize(maxFamilySize);
-	}
-	
-	
 	if ( tree_is_leaf(ptnode) )
 	{
 		if ( tree_is_root(ptree, ptnode->parent) )
@@ -528,6 +490,8 @@ void __cafe_tree_node_compute_clustered_viterbi(pTree ptree, pTreeNode ptnode, v
 			}
 		}
 	}
+	memory_free(tree_factors[0]);
+	memory_free(tree_factors[1]);
 }
 
 
@@ -560,6 +524,15 @@ void cafe_tree_viterbi(pCafeTree pcafe)
 
 void cafe_tree_clustered_viterbi(pCafeTree pcafe, int num_likelihoods)
 {
+	int maxFamilySize = MAX(pcafe->rootfamilysizes[1], pcafe->familysizes[1]);
+	if (!chooseln_is_init())
+	{
+		chooseln_cache_init(maxFamilySize);
+	}
+	else if (get_chooseln_cache_size() < maxFamilySize)
+	{
+		chooseln_cache_resize(maxFamilySize);
+	}
 	tree_traveral_postfix((pTree)pcafe, __cafe_tree_node_compute_clustered_viterbi, num_likelihoods);
 	tree_traveral_prefix((pTree)pcafe, __cafe_tree_node_backtrack_viterbi);
 }
@@ -582,7 +555,7 @@ void cafe_tree_viterbi_posterior(pCafeTree pcafe, pCafeParam param)
 				for(i = 0; i < param->pcafe->rfsize; i++)	// j: root family size
 				{
 					// likelihood and posterior both starts from 1 instead of 0 
-					root->likelihoods[i] = exp(log(root->likelihoods[i])+log(param->prior_rfsize[i]));	//prior_rfsize also starts from 1
+					root->likelihoods[i] += log(param->prior_rfsize[i]);	//prior_rfsize also starts from 1
 				}				
 			}
 		}
@@ -786,7 +759,7 @@ void __cafe_tree_node_compute_clustered_likelihood_using_cache(pTree ptree, pTre
 	int s,c,i,j,k; 
 	int* rootfamilysizes;
 	int* familysizes;
-	double** bd = NULL;
+	struct square_matrix* bd = NULL;
 	
 	int maxFamilySize =  MAX( pcafe->rootfamilysizes[1], pcafe->familysizes[1]);
 	if ( !chooseln_is_init() ) 
@@ -863,7 +836,7 @@ void __cafe_tree_node_compute_clustered_likelihood_using_cache(pTree ptree, pTre
 					{
 						for( c = familysizes[0], j = 0 ; c <= familysizes[1] ; c++, j++ )
 						{
-							factors[idx][i] += bd[s][c] * child[idx]->k_likelihoods[k][j];
+							factors[idx][i] += square_matrix_get(bd, s, c) * child[idx]->k_likelihoods[k][j];
 						}
 					}
 				}
@@ -1018,8 +991,12 @@ void node_set_birthdeath_matrix(pCafeNode pcnode, pBirthDeathCacheArray cache, i
 
 void do_node_set_birthdeath(pTree ptree, pTreeNode ptnode, va_list ap1)
 {
+	va_list ap;
+	va_copy(ap, ap1);
+	pBirthDeathCacheArray cache = va_arg(ap, pBirthDeathCacheArray);
+	va_end(ap);
 	pCafeTree pcafe = (pCafeTree)ptree;
-	node_set_birthdeath_matrix((pCafeNode)ptnode, probability_cache, pcafe->k);
+	node_set_birthdeath_matrix((pCafeNode)ptnode, cache, pcafe->k);
 }
 
 
@@ -1028,7 +1005,35 @@ void do_node_set_birthdeath(pTree ptree, pTreeNode ptnode, va_list ap1)
 **/
 void cafe_tree_set_birthdeath(pCafeTree pcafe)
 {
-	tree_traveral_prefix((pTree)pcafe, do_node_set_birthdeath);
+	cafe_tree_set_birthdeath_with_cache(pcafe, probability_cache);
+}
+
+/**
+*	Same as \ref cafe_tree_set_birthdeath but draws the matrices from the given cache
+*	rather than the global one, so that threads can each work with a private cache
+**/
+void cafe_tree_set_birthdeath_with_cache(pCafeTree pcafe, pBirthDeathCacheArray cache)
+{
+	tree_traveral_prefix((pTree)pcafe, do_node_set_birthdeath, cache);
+}
+
+/**
+*	Sets each node's birthdeath matrix from a cache shared between threads. Only a single
+*	lambda (and mu) per node is supported, i.e. trees without clusters
+**/
+void cafe_tree_set_shared_birthdeath(pCafeTree pcafe, pSharedBirthDeathCache pshared, int maxFamilysize, pBirthDeathCacheArray* overflow)
+{
+	pArrayList nlist = pcafe->super.nlist;
+	for (int i = 0; i < nlist->size; i++)
+	{
+		pCafeNode pcnode = (pCafeNode)nlist->array[i];
+		if (pcnode->super.branchlength <= 0)
+			continue;
+		struct probabilities* probs = &pcnode->birth_death_probabilities;
+		double lambda = probs->param_lambdas ? probs->param_lambdas[0] : probs->lambda;
+		double mu = probs->param_mus ? probs->param_mus[0] : probs->mu;
+		pcnode->birthdeath_matrix = shared_birthdeath_cache_get_matrix(pshared, maxFamilysize, overflow, pcnode->super.branchlength, lambda, mu);
+	}
 }
 
 void cafe_tree_node_copy(pTreeNode psrc, pTreeNode pdest)
@@ -1089,17 +1094,10 @@ void __cafe_tree_node_random_familysize(pTree ptree, pTreeNode pnode, va_list ap
 	if ( tree_is_root(ptree,pnode) ) return;
 
 	double rnd = unifrnd();					
-	double cumul = 0;
 	pCafeNode pcnode = (pCafeNode)pnode;
 	int maxFamilysize = probability_cache->maxFamilysize;
 	int s = ((pCafeNode)pnode->parent)->familysize;
-	int c = 0;
-	for (; c < maxFamilysize ; c++ )
-	{
-		cumul += square_matrix_get(pcnode->birthdeath_matrix, s, c);
-		if ( cumul >= rnd ) break;
-	}
-	pcnode->familysize = c;
+	pcnode->familysize = square_matrix_sample(pcnode->birthdeath_matrix, s, maxFamilysize, rnd);
 	if (*max < pcnode->familysize)
 	{
 		*max = pcnode->familysize;
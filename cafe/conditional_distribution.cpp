@@ -1,5 +1,14 @@
 #include <algorithm>
 #include <iterator>
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "conditional_distribution.h"
 
@@ -13,51 +22,257 @@ extern "C" {
 /**************************************************************************
 * Conditional Distribution
 **************************************************************************/
-/* get likelihood values conditioned on the rootFamilysize for a number of randomly generated families */
-std::vector<double> get_random_probabilities(pCafeTree pcafe, int rootFamilysize, int trials)
+/* families simulated and scored together by get_random_probabilities */
+const int RANDOM_PROBABILITY_BLOCK = 64;
+
+/* a block of simulated families sharing one upper bound on family size */
+struct random_family_block
+{
+	pCafeTree pcafe;
+	int width;
+	int family_start;
+	int family_end;
+	/* simulated size of each node in each family, indexed [node id][family] */
+	std::vector<std::vector<int> > sizes;
+};
+
+static std::vector<double> block_likelihoods(const random_family_block& block, pCafeNode node, int s_start, int s_end);
+
+/* leaf likelihoods under the error model, laid out [(c - family_start) * width + family] */
+static std::vector<double> block_leaf_likelihoods(const random_family_block& block, pCafeNode leaf)
+{
+	int width = block.width;
+	int size = MIN(block.family_end - block.family_start + 1, block.pcafe->size_of_factor);
+	const std::vector<int>& familysize = block.sizes[((pTreeNode)leaf)->id];
+	std::vector<double> lh((block.family_end - block.family_start + 1) * width, 0.0);
+	for (int j = 0; j < size; j++)
+	{
+		for (int b = 0; b < width; b++)
+		{
+			lh[j*width + b] = leaf->errormodel->errormatrix[familysize[b]][j];
+		}
+	}
+	return lh;
+}
+
+/* p(child subtree | parent = s) for each s in [s_start, s_end] and each family, laid out [(s - s_start) * width + family] */
+static std::vector<double> block_factors(const random_family_block& block, pCafeNode child, int s_start, int s_end)
 {
-	int old_rfsize = pcafe->rfsize;
-	int old_rfsizes[2] = { pcafe->rootfamilysizes[0], pcafe->rootfamilysizes[1] };
-	int old_fsizes[2] = { pcafe->familysizes[0], pcafe->familysizes[1] };
+	if (!child->birthdeath_matrix)
+		node_set_birthdeath_matrix(child, probability_cache, block.pcafe->k);
+	struct square_matrix* bd = child->birthdeath_matrix;
+
+	int width = block.width;
+	std::vector<double> factors((s_end - s_start + 1) * width, 0.0);
+	if (tree_is_leaf((pTreeNode)child) && !child->errormodel)
+	{
+		// a leaf's likelihood is 1 at its size and 0 elsewhere, so its factor is a single matrix entry
+		const std::vector<int>& familysize = block.sizes[((pTreeNode)child)->id];
+		for (int s = s_start, i = 0; s <= s_end; s++, i++)
+		{
+			for (int b = 0; b < width; b++)
+			{
+				int c = block.family_start + familysize[b];
+				if (c <= block.family_end)
+					factors[i*width + b] = square_matrix_get(bd, s, c);
+			}
+		}
+		return factors;
+	}
+
+	std::vector<double> lh = tree_is_leaf((pTreeNode)child) ?
+		block_leaf_likelihoods(block, child) :
+		block_likelihoods(block, child, block.family_start, block.family_end);
+	for (int s = s_start, i = 0; s <= s_end; s++, i++)
+	{
+		double* f = &factors[i*width];
+		for (int c = block.family_start, j = 0; c <= block.family_end; c++, j++)
+		{
+			double p = square_matrix_get(bd, s, c);
+			if (p == 0)
+				continue;
+			const double* l = &lh[j*width];
+			for (int b = 0; b < width; b++)
+			{
+				f[b] += p * l[b];
+			}
+		}
+	}
+	return factors;
+}
+
+/* likelihoods of an internal node for each s in [s_start, s_end] and each family, laid out as in block_factors */
+static std::vector<double> block_likelihoods(const random_family_block& block, pCafeNode node, int s_start, int s_end)
+{
+	pTreeNode ptnode = (pTreeNode)node;
+	std::vector<double> lh = block_factors(block, (pCafeNode)ptnode->children->head->data, s_start, s_end);
+	std::vector<double> right = block_factors(block, (pCafeNode)ptnode->children->tail->data, s_start, s_end);
+	for (size_t i = 0; i < lh.size(); i++)
+	{
+		lh[i] *= right[i];
+	}
+	return lh;
+}
 
-	pcafe->rfsize = 1;
-	pcafe->rootfamilysizes[0] = rootFamilysize;
-	pcafe->rootfamilysizes[1] = rootFamilysize;
+/**
+* \brief Simulates block.width families from rootFamilysize on sim and records the size of every node
+*
+* block.family_end is set to the largest simulated size in the block plus a margin, capped
+* at the upper family size of block.pcafe.
+*/
+static void simulate_random_block(pCafeTree sim, random_family_block& block, int rootFamilysize)
+{
+	pArrayList nlist = sim->super.nlist;
+	block.family_end = block.family_start;
+	block.sizes.resize(nlist->size);
+	for (int n = 0; n < nlist->size; n++)
+	{
+		block.sizes[n].resize(block.width);
+	}
+	for (int b = 0; b < block.width; b++)
+	{
+		int max = cafe_tree_random_familysize(sim, rootFamilysize);
+		block.family_end = MAX(block.family_end, max + MAX(50, max / 5));
+		for (int n = 0; n < nlist->size; n++)
+		{
+			block.sizes[n][b] = ((pCafeNode)nlist->array[n])->familysize;
+		}
+	}
+	block.family_end = MIN(block.family_end, block.pcafe->familysizes[1]);
+}
 
+/**
+* \brief get likelihood values conditioned on the rootFamilysize for a number of randomly generated families
+*
+* Families are simulated in blocks of RANDOM_PROBABILITY_BLOCK and each block is scored in a single
+* traversal of the tree, with the family sizes of every node bounded by the largest simulated size
+* in the block plus a margin.
+*/
+std::vector<double> get_random_probabilities(pCafeTree pcafe, int rootFamilysize, int trials)
+{
 	if (probability_cache == NULL) {
 		printf("error: pbdc_array NULL");
 	}
 
 	struct chooseln_cache cache;
-	int maxFamilySize = MAX(pcafe->rootfamilysizes[1], pcafe->familysizes[1]);
+	int maxFamilySize = MAX(rootFamilysize, pcafe->familysizes[1]);
 	chooseln_cache_init2(&cache, maxFamilySize);
 
 	std::vector<double> probs(trials);
 
-	for (int i = 0; i < trials; i++)
+	random_family_block block;
+	block.pcafe = pcafe;
+	block.family_start = pcafe->familysizes[0];
+	for (int first = 0; first < trials; first += RANDOM_PROBABILITY_BLOCK)
 	{
-		int max = cafe_tree_random_familysize(pcafe, rootFamilysize);
-		if (pcafe->super.nlist)
+		block.width = MIN(RANDOM_PROBABILITY_BLOCK, trials - first);
+		simulate_random_block(pcafe, block, rootFamilysize);
+
+		std::vector<double> lh = block_likelihoods(block, (pCafeNode)pcafe->super.root, rootFamilysize, rootFamilysize);
+		std::copy(lh.begin(), lh.end(), probs.begin() + first);
+	}
+
+	// ascending, the order pvalue() searches in
+	std::sort(probs.begin(), probs.end());
+
+	return probs;
+}
+
+/* whether birthdeath_likelihood_with_s_c gives a proper distribution for these rates; see its coefficient */
+static bool birthdeath_rates_valid(double branchlength, double lambda, double mu)
+{
+	if (mu < 0 || lambda == mu)
+		return lambda * branchlength < 1;
+	double numerator = exp((lambda - mu)*branchlength) - 1;
+	double denominator = lambda*exp((lambda - mu)*branchlength) - mu;
+	return 1 - (mu + lambda)*numerator / denominator > 0;
+}
+
+/**
+* \brief Copy of pcafe whose transition matrices are those of lambda and mu multiplied by lambda_factor
+*
+* The matrices come from the probability cache; a mu below zero, meaning mu equal to lambda, is kept.
+* Where the inflated rates would not give a proper distribution on a branch, the factor for that
+* branch is moved towards 1 until they do; weights are computed per branch, so this stays unbiased.
+*/
+pCafeTree cafe_tree_tilted_copy(pCafeTree pcafe, double lambda_factor)
+{
+	pCafeTree tilted = cafe_tree_copy(pcafe);
+	pArrayList nlist = pcafe->super.nlist;
+	for (int i = 0; i < nlist->size; i++)
+	{
+		pCafeNode node = (pCafeNode)nlist->array[i];
+		double branchlength = node->super.branchlength;
+		if (branchlength <= 0)
+			continue;
+		struct probabilities* probs = &node->birth_death_probabilities;
+		double lambda = probs->param_lambdas ? probs->param_lambdas[0] : probs->lambda;
+		double mu = probs->param_lambdas && probs->param_mus ? probs->param_mus[0] : probs->mu;
+		double factor = lambda_factor;
+		for (int tries = 0; factor != 1 && !birthdeath_rates_valid(branchlength, lambda * factor, mu < 0 ? mu : mu * factor); tries++)
 		{
-			pcafe->familysizes[1] = MIN(max + MAX(50, max / 5), pcafe->familysizes[1]);
+			factor = tries < 20 ? 1 + (factor - 1) / 2 : 1;
 		}
-		compute_tree_likelihoods(pcafe);
-		probs[i] = ((pCafeNode)pcafe->super.root)->likelihoods[0];
+		((pCafeNode)tilted->super.nlist->array[i])->birthdeath_matrix =
+			birthdeath_cache_get_matrix(probability_cache, branchlength, lambda * factor, mu < 0 ? mu : mu * factor);
+	}
+	return tilted;
+}
+
+/**
+* \brief Likelihoods under pcafe of families simulated on tilted, and the importance weight of each
+*
+* tilted is a copy of pcafe with different transition matrices, see cafe_tree_tilted_copy. The
+* weight of a family is the probability of its simulated node sizes under pcafe divided by their
+* probability under tilted. Values are returned in the order they were simulated.
+*/
+std::vector<double> get_weighted_random_probabilities(pCafeTree pcafe, pCafeTree tilted, int rootFamilysize, int trials, std::vector<double>& weights)
+{
+	std::vector<double> probs(trials);
+	weights.assign(trials, 0.0);
+	pArrayList nlist = pcafe->super.nlist;
+	for (int n = 0; n < nlist->size; n++)
+	{
+		pCafeNode node = (pCafeNode)nlist->array[n];
+		if (!node->birthdeath_matrix)
+			node_set_birthdeath_matrix(node, probability_cache, pcafe->k);
 	}
 
-	pcafe->rfsize = old_rfsize;
-	pcafe->rootfamilysizes[0] = old_rfsizes[0];
-	pcafe->rootfamilysizes[1] = old_rfsizes[1];
-	pcafe->familysizes[0] = old_fsizes[0];
-	pcafe->familysizes[1] = old_fsizes[1];
+	random_family_block block;
+	block.pcafe = pcafe;
+	block.family_start = pcafe->familysizes[0];
+	for (int first = 0; first < trials; first += RANDOM_PROBABILITY_BLOCK)
+	{
+		block.width = MIN(RANDOM_PROBABILITY_BLOCK, trials - first);
+		simulate_random_block(tilted, block, rootFamilysize);
 
-	std::sort(probs.begin(), probs.end());
-	std::reverse(probs.begin(), probs.end());
+		std::vector<double> lh = block_likelihoods(block, (pCafeNode)pcafe->super.root, rootFamilysize, rootFamilysize);
+		std::copy(lh.begin(), lh.end(), probs.begin() + first);
 
+		std::vector<double> log_weight(block.width, 0.0);
+		for (int n = 0; n < nlist->size; n++)
+		{
+			pTreeNode node = (pTreeNode)nlist->array[n];
+			if (node->parent == NULL) continue;
+			struct square_matrix* bd = ((pCafeNode)node)->birthdeath_matrix;
+			struct square_matrix* tilted_bd = ((pCafeNode)tilted->super.nlist->array[n])->birthdeath_matrix;
+			const std::vector<int>& parent = block.sizes[node->parent->id];
+			const std::vector<int>& child = block.sizes[n];
+			for (int b = 0; b < block.width; b++)
+			{
+				// a size drawn with no probability under tilted only comes from the end of a truncated row
+				double q = square_matrix_get(tilted_bd, parent[b], child[b]);
+				log_weight[b] += q > 0 ? log(square_matrix_get(bd, parent[b], child[b])) - log(q) : -HUGE_VAL;
+			}
+		}
+		for (int b = 0; b < block.width; b++)
+		{
+			weights[first + b] = exp(log_weight[b]);
+		}
+	}
 	return probs;
 }
 
-
 /* conditional distribution on a range or root sizes */
 std::vector<std::vector<double> > conditional_distribution(pCafeTree pcafe, int range_start, int range_end, int num_trials)
 {
@@ -75,61 +290,636 @@ std::vector<std::vector<double> > conditional_distribution(pCafeTree pcafe, int
 * Contidional Distribution
 **************************************************************************/
 
+struct CDQueue
+{
+	pthread_mutex_t lock;
+	std::vector<CDTask> tasks;
+	size_t next;
+	int root_min;
+	matrix* pCD;
+	/* when set, families are simulated on tilted and their importance weights go to pWeights */
+	pCafeTree tilted;
+	matrix* pWeights;
+	uint64_t seed;
+};
+
 typedef struct
 {
 	pCafeTree pTree;
-	int num_random_samples;
-	int range[2];
-	std::vector<std::vector<double> > pCD;
+	CDQueue* queue;
 }CDParam;
 typedef CDParam* pCDParam;
 
+static bool costlier_task(const CDTask& a, const CDTask& b)
+{
+	return a.root > b.root || (a.root == b.root && a.start < b.start);
+}
+
+/**
+* \brief Splits the samples for every root size into blocks, costliest first
+*
+* Simulating from a larger root gives larger families, so blocks are ordered by
+* decreasing root size; threads that run out of work take the next remaining block
+* and the small, cheap blocks are left to fill in at the end.
+*/
+std::vector<CDTask> conditional_distribution_tasks(int root_min, int root_max, int num_random_samples, int numthreads)
+{
+	std::vector<CDTask> tasks;
+	int num_roots = root_max - root_min + 1;
+	int blocks = MIN(num_random_samples, MAX(1, (4 * numthreads + num_roots - 1) / num_roots));
+	for (int s = root_min; s <= root_max; s++)
+	{
+		for (int b = 0; b < blocks; b++)
+		{
+			CDTask task;
+			task.root = s;
+			task.start = (int)((long)num_random_samples * b / blocks);
+			task.count = (int)((long)num_random_samples * (b + 1) / blocks) - task.start;
+			tasks.push_back(task);
+		}
+	}
+	std::sort(tasks.begin(), tasks.end(), costlier_task);
+	return tasks;
+}
 
 void* __cafe_conditional_distribution_thread_func(void* ptr)
 {
 	pCDParam param = (pCDParam)ptr;
+	CDQueue* queue = param->queue;
 	pCafeTree pcafe = cafe_tree_copy(param->pTree);
+	pCafeTree tilted = queue->tilted ? cafe_tree_copy(queue->tilted) : NULL;
+	while (true)
+	{
+		pthread_mutex_lock(&queue->lock);
+		size_t i = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (i >= queue->tasks.size()) break;
+
+		const CDTask& task = queue->tasks[i];
 #ifdef VERBOSE
-	printf("CD: %d ~ %d\n", param->range[0], param->range[1]);
+		printf("CD: %d [%d, %d)\n", task.root, task.start, task.start + task.count);
 #endif
-	param->pCD = conditional_distribution(pcafe, param->range[0], param->range[1], param->num_random_samples);
+		// each block has its own stream so the result does not depend on which thread ran it
+		RandomStream stream;
+		random_stream_init(&stream, queue->seed, i);
+		pRandomStream old = unifrnd_set_stream(&stream);
+		std::vector<double> p, w;
+		if (tilted)
+			p = get_weighted_random_probabilities(pcafe, tilted, task.root, task.count, w);
+		else
+			p = get_random_probabilities(pcafe, task.root, task.count);
+		unifrnd_set_stream(old);
+		// blocks write to disjoint parts of the row
+		std::copy(p.begin(), p.end(), (*queue->pCD)[task.root - queue->root_min].begin() + task.start);
+		if (tilted)
+			std::copy(w.begin(), w.end(), (*queue->pWeights)[task.root - queue->root_min].begin() + task.start);
+	}
+	if (tilted) cafe_tree_free(tilted);
 	cafe_tree_free(pcafe);
 	return (NULL);
 }
 
-matrix cafe_conditional_distribution(pCafeTree pTree, family_size_range *range, int numthreads, int num_random_samples)
+/**************************************************************************
+* On-disk cache of conditional distributions
+**************************************************************************/
+static std::string cd_cache_dir;
+
+/**
+* \brief Sets the directory conditional distributions are cached in; an empty string turns caching off
+*/
+void set_conditional_distribution_cache(const std::string& dir)
+{
+	cd_cache_dir = dir;
+}
+
+std::string get_conditional_distribution_cache()
+{
+	return cd_cache_dir;
+}
+
+/**
+* \brief Folds len bytes into the FNV-1a hash h
+*/
+void hash_bytes(uint64_t& h, const void* data, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= p[i];
+		h *= 0x100000001B3ULL;
+	}
+}
+
+static void hash_int(uint64_t& h, int value)
+{
+	hash_bytes(h, &value, sizeof(value));
+}
+
+static void hash_double(uint64_t& h, double value)
+{
+	hash_bytes(h, &value, sizeof(value));
+}
+
+/**
+* \brief Hash of everything the conditional distribution of pTree depends on
+*
+* Covers the tree topology, names and branch lengths, the birth and death rates
+* and error model of every node, the family size ranges and the number of samples.
+* With k clusters the rates of a node are its k param_lambdas and param_mus, since
+* lambda and mu are then left at -1.
+*/
+uint64_t conditional_distribution_key(pCafeTree pcafe, family_size_range *range, int num_random_samples)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+	hash_int(h, pcafe->k);
+	pString pstr = phylogeny_string((pTree)pcafe, NULL);
+	hash_bytes(h, pstr->buf, strlen(pstr->buf) + 1);
+	string_free(pstr);
+
+	pArrayList nlist = pcafe->super.nlist;
+	for (int i = 0; i < nlist->size; i++)
+	{
+		pCafeNode node = (pCafeNode)nlist->array[i];
+		hash_double(h, node->super.branchlength);
+		hash_double(h, node->birth_death_probabilities.lambda);
+		hash_double(h, node->birth_death_probabilities.mu);
+		struct probabilities* probs = &node->birth_death_probabilities;
+		if (pcafe->k > 0 && probs->param_lambdas)
+			hash_bytes(h, probs->param_lambdas, pcafe->k * sizeof(double));
+		if (pcafe->k > 0 && probs->param_mus)
+			hash_bytes(h, probs->param_mus, pcafe->k * sizeof(double));
+		pErrorStruct error = node->errormodel;
+		hash_int(h, error ? error->maxfamilysize : -1);
+		for (int j = 0; error && j <= error->maxfamilysize; j++)
+		{
+			hash_bytes(h, error->errormatrix[j], (error->maxfamilysize + 1) * sizeof(double));
+		}
+	}
+	hash_int(h, pcafe->familysizes[0]);
+	hash_int(h, pcafe->familysizes[1]);
+	hash_int(h, pcafe->rootfamilysizes[0]);
+	hash_int(h, pcafe->rootfamilysizes[1]);
+	hash_int(h, range->min);
+	hash_int(h, range->max);
+	hash_int(h, range->root_min);
+	hash_int(h, range->root_max);
+	hash_int(h, num_random_samples);
+	return h;
+}
+
+static const char CD_CACHE_MAGIC[8] = { 'C', 'A', 'F', 'E', 'C', 'D', 'C', '2' };
+
+static std::string cd_cache_file(uint64_t key)
+{
+	char name[32];
+	sprintf(name, "cd_%016llx.bin", (unsigned long long)key);
+	return cd_cache_dir + "/" + name;
+}
+
+/**
+* \brief Reads a cached distribution; returns false if the file is missing or does not match the key and size
+*/
+bool read_conditional_distribution_cache(const std::string& file, uint64_t key, int rows, int cols, matrix& cd)
 {
-	int threadstep = pTree->rfsize / numthreads;
-	if (threadstep == 0)
+	FILE* fp = fopen(file.c_str(), "rb");
+	if (fp == NULL) return false;
+
+	char magic[8];
+	uint64_t file_key;
+	int32_t dims[2];
+	bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, CD_CACHE_MAGIC, 8) == 0
+		&& fread(&file_key, sizeof(file_key), 1, fp) == 1 && file_key == key
+		&& fread(dims, sizeof(int32_t), 2, fp) == 2 && dims[0] == rows && dims[1] == cols;
+	if (ok)
 	{
-		numthreads = pTree->rfsize;
+		matrix result(rows, std::vector<double>(cols));
+		for (int i = 0; ok && i < rows; i++)
+		{
+			ok = fread(&result[i][0], sizeof(double), cols, fp) == (size_t)cols;
+		}
+		if (ok) cd.swap(result);
 	}
-	else
+	fclose(fp);
+	return ok;
+}
+
+/**
+* \brief Writes the distribution to a temporary file and renames it, so readers never see a partial file
+*/
+bool write_conditional_distribution_cache(const std::string& file, uint64_t key, const matrix& cd)
+{
+	std::string tmp = file + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (fp == NULL) return false;
+
+	int32_t dims[2] = { (int32_t)cd.size(), cd.empty() ? 0 : (int32_t)cd[0].size() };
+	bool ok = fwrite(CD_CACHE_MAGIC, 1, 8, fp) == 8
+		&& fwrite(&key, sizeof(key), 1, fp) == 1
+		&& fwrite(dims, sizeof(int32_t), 2, fp) == 2;
+	for (size_t i = 0; ok && i < cd.size(); i++)
 	{
-		threadstep--;
+		ok = fwrite(&cd[i][0], sizeof(double), dims[1], fp) == (size_t)dims[1];
 	}
+	ok = fclose(fp) == 0 && ok;
+	if (ok) ok = rename(tmp.c_str(), file.c_str()) == 0;
+	if (!ok) remove(tmp.c_str());
+	return ok;
+}
+
+/* magic, key and the two dimensions; the rows follow, 8-byte aligned */
+static const size_t CD_FILE_HEADER = 8 + sizeof(uint64_t) + 2 * sizeof(int32_t);
+
+/**
+* \brief Maps a distribution written by write_conditional_distribution_cache into memory
+*
+* The rows are used in place: row i starts at data + i * cols, in the ascending order
+* pvalue() expects. Returns false if the file cannot be opened, is not in the binary
+* format, or its size does not match its header.
+*/
+bool map_conditional_distribution(const std::string& file, mapped_conditional_distribution& m)
+{
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	char header[CD_FILE_HEADER];
+	bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= CD_FILE_HEADER
+		&& read(fd, header, CD_FILE_HEADER) == (ssize_t)CD_FILE_HEADER
+		&& memcmp(header, CD_CACHE_MAGIC, 8) == 0;
+	if (ok)
+	{
+		int32_t dims[2];
+		memcpy(&m.key, header + 8, sizeof(uint64_t));
+		memcpy(dims, header + 8 + sizeof(uint64_t), sizeof(dims));
+		m.rows = dims[0];
+		m.cols = dims[1];
+		m.length = st.st_size;
+		ok = m.rows >= 0 && m.cols >= 0 && m.length == CD_FILE_HEADER + (size_t)m.rows * m.cols * sizeof(double);
+	}
+	if (ok)
+	{
+		m.base = mmap(NULL, m.length, PROT_READ, MAP_SHARED, fd, 0);
+		ok = m.base != MAP_FAILED;
+	}
+	close(fd);
+	if (!ok)
+	{
+		m.base = NULL;
+		return false;
+	}
+	m.data = (const double*)((const char*)m.base + CD_FILE_HEADER);
+	return true;
+}
+
+void unmap_conditional_distribution(mapped_conditional_distribution& m)
+{
+	if (m.base)
+		munmap(m.base, m.length);
+	m.base = NULL;
+	m.data = NULL;
+	m.rows = m.cols = 0;
+}
+
+/**
+* \brief Simulates num_random_samples families for each root size in range, spread over numthreads threads
+*
+* Families are simulated on tilted when it is given, with their importance weights stored in weights
+* in the same layout as cdlist. Rows are left in the order the families were simulated.
+*/
+static void run_conditional_distribution(pCafeTree pTree, pCafeTree tilted, family_size_range *range, int numthreads, int num_random_samples, matrix& cdlist, matrix& weights)
+{
+	cdlist.assign(range->root_max - range->root_min + 1, std::vector<double>(num_random_samples));
+	if (tilted)
+		weights.assign(cdlist.size(), std::vector<double>(num_random_samples));
+
+	CDQueue queue;
+	pthread_mutex_init(&queue.lock, NULL);
+	queue.tasks = conditional_distribution_tasks(range->root_min, range->root_max, num_random_samples, numthreads);
+	queue.next = 0;
+	queue.root_min = range->root_min;
+	queue.pCD = &cdlist;
+	queue.tilted = tilted;
+	queue.pWeights = &weights;
+	queue.seed = unifrnd_split();
 
-	pCDParam ptparam = (pCDParam)memory_new(numthreads, sizeof(CDParam));
-	int i, r = range->root_min;
-	for (i = 0; i < numthreads; i++, r += threadstep + 1)
+	numthreads = MAX(1, MIN(numthreads, (int)queue.tasks.size()));
+	std::vector<CDParam> ptparam(numthreads);
+	for (int i = 0; i < numthreads; i++)
 	{
 		ptparam[i].pTree = pTree;
-		ptparam[i].num_random_samples = num_random_samples;
-		ptparam[i].range[0] = r;
-		ptparam[i].range[1] = r + threadstep;
+		ptparam[i].queue = &queue;
 	}
-	ptparam[numthreads - 1].range[1] = range->root_max;
-	thread_run(numthreads, __cafe_conditional_distribution_thread_func, ptparam, sizeof(CDParam));
-	matrix cdlist;
-	for (i = 0; i < numthreads; i++)
+	thread_run(numthreads, __cafe_conditional_distribution_thread_func, &ptparam[0], sizeof(CDParam));
+	pthread_mutex_destroy(&queue.lock);
+}
+
+/**
+* \brief Simulates the conditional distribution without looking at the cache
+*
+* Each row holds num_random_samples likelihoods in ascending order.
+*/
+matrix cafe_conditional_distribution_uncached(pCafeTree pTree, family_size_range *range, int numthreads, int num_random_samples)
+{
+	matrix cdlist, unused;
+	run_conditional_distribution(pTree, NULL, range, numthreads, num_random_samples, cdlist, unused);
+
+	for (size_t i = 0; i < cdlist.size(); i++)
+	{
+		std::sort(cdlist[i].begin(), cdlist[i].end());
+	}
+	return cdlist;
+}
+
+/**
+* \brief Importance-sampled conditional distribution, simulated with lambda multiplied by lambda_factor
+*
+* Each row of the result holds likelihoods in ascending order. The matching row of cumulative
+* holds, for each likelihood, the weights of it and of all smaller likelihoods summed and
+* divided by the total weight: the estimated probability of a family that is at most as likely.
+*/
+matrix cafe_weighted_conditional_distribution(pCafeTree pTree, family_size_range *range, int numthreads, int num_random_samples, double lambda_factor, matrix& cumulative)
+{
+	pCafeTree tilted = cafe_tree_tilted_copy(pTree, lambda_factor);
+	matrix cdlist, weights;
+	run_conditional_distribution(pTree, tilted, range, numthreads, num_random_samples, cdlist, weights);
+	cafe_tree_free(tilted);
+
+	cumulative.assign(cdlist.size(), std::vector<double>(num_random_samples));
+	std::vector<std::pair<double, double> > row(num_random_samples);
+	for (size_t i = 0; i < cdlist.size(); i++)
 	{
-		for (size_t j = 0; j < ptparam[i].pCD.size(); j++)
+		for (int j = 0; j < num_random_samples; j++)
+			row[j] = std::make_pair(cdlist[i][j], weights[i][j]);
+		std::sort(row.begin(), row.end());
+
+		double total = 0;
+		for (int j = 0; j < num_random_samples; j++)
 		{
-			cdlist.push_back(ptparam[i].pCD[j]);
+			total += row[j].second;
+			cdlist[i][j] = row[j].first;
+			cumulative[i][j] = total;
 		}
+		for (int j = 0; j < num_random_samples && total > 0; j++)
+			cumulative[i][j] /= total;
 	}
-	memory_free(ptparam);
-	ptparam = NULL;
 	return cdlist;
 }
 
+/**
+* \brief Estimated probability of a likelihood at most lh, from one row of cafe_weighted_conditional_distribution
+*
+* Likelihoods equal to lh count by half their weight, as in pvalue().
+*/
+double weighted_pvalue(double lh, const std::vector<double>& likelihoods, const std::vector<double>& cumulative)
+{
+	size_t below = std::lower_bound(likelihoods.begin(), likelihoods.end(), lh) - likelihoods.begin();
+	size_t upto = std::upper_bound(likelihoods.begin() + below, likelihoods.end(), lh) - likelihoods.begin();
+	double less = below == 0 ? 0 : cumulative[below - 1];
+	double equal = upto == below ? 0 : cumulative[upto - 1] - less;
+	return less + equal / 2;
+}
+
+/**
+* \brief Conditional distribution of the likelihood for each root size in range
+*
+* When a cache directory is set, a distribution computed earlier for the same tree,
+* rates, ranges and number of samples is loaded instead of being simulated again.
+*/
+matrix cafe_conditional_distribution(pCafeTree pTree, family_size_range *range, int numthreads, int num_random_samples)
+{
+	if (cd_cache_dir.empty())
+		return cafe_conditional_distribution_uncached(pTree, range, numthreads, num_random_samples);
+
+	uint64_t key = conditional_distribution_key(pTree, range, num_random_samples);
+	std::string file = cd_cache_file(key);
+	matrix cdlist;
+	if (read_conditional_distribution_cache(file, key, range->root_max - range->root_min + 1, num_random_samples, cdlist))
+		return cdlist;
+
+	cdlist = cafe_conditional_distribution_uncached(pTree, range, numthreads, num_random_samples);
+	if (!write_conditional_distribution_cache(file, key, cdlist))
+		fprintf(stderr, "WARNING: could not write conditional distribution cache %s\n", file.c_str());
+	return cdlist;
+}
+
+/**************************************************************************
+* Simulation pool
+**************************************************************************/
+struct PoolQueue
+{
+	pthread_mutex_t lock;
+	std::vector<CDTask> tasks;
+	size_t next;
+	simulation_pool* pool;
+	uint64_t seed;
+};
+
+typedef struct
+{
+	pCafeTree pTree;
+	PoolQueue* queue;
+}PoolParam;
+
+void* __simulation_pool_thread_func(void* ptr)
+{
+	PoolParam* param = (PoolParam*)ptr;
+	PoolQueue* queue = param->queue;
+	simulation_pool* pool = queue->pool;
+	pCafeTree pcafe = cafe_tree_copy(param->pTree);
+	pArrayList nlist = pcafe->super.nlist;
+	while (true)
+	{
+		pthread_mutex_lock(&queue->lock);
+		size_t i = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (i >= queue->tasks.size()) break;
+
+		const CDTask& task = queue->tasks[i];
+		RandomStream stream;
+		random_stream_init(&stream, queue->seed, i);
+		pRandomStream old = unifrnd_set_stream(&stream);
+		std::vector<int>& states = pool->states[task.root - pool->root_min];
+		for (int j = task.start; j < task.start + task.count; j++)
+		{
+			cafe_tree_random_familysize(pcafe, task.root);
+			for (int n = 0; n < nlist->size; n++)
+			{
+				states[(size_t)j * pool->num_nodes + n] = ((pCafeNode)nlist->array[n])->familysize;
+			}
+		}
+		unifrnd_set_stream(old);
+	}
+	cafe_tree_free(pcafe);
+	return (NULL);
+}
+
+/**
+* \brief Simulates num_samples families on the whole tree for each root size in range and keeps the size of every node
+*/
+simulation_pool cafe_simulation_pool(pCafeTree pcafe, family_size_range *range, int numthreads, int num_samples)
+{
+	simulation_pool pool;
+	pool.num_nodes = pcafe->super.nlist->size;
+	pool.root_id = pcafe->super.root->id;
+	pool.root_min = range->root_min;
+	pool.num_samples = num_samples;
+	pool.states.assign(range->root_max - range->root_min + 1, std::vector<int>((size_t)num_samples * pool.num_nodes));
+
+	PoolQueue queue;
+	pthread_mutex_init(&queue.lock, NULL);
+	queue.tasks = conditional_distribution_tasks(range->root_min, range->root_max, num_samples, numthreads);
+	queue.next = 0;
+	queue.pool = &pool;
+	queue.seed = unifrnd_split();
+
+	numthreads = MAX(1, MIN(numthreads, (int)queue.tasks.size()));
+	std::vector<PoolParam> ptparam(numthreads);
+	for (int i = 0; i < numthreads; i++)
+	{
+		ptparam[i].pTree = pcafe;
+		ptparam[i].queue = &queue;
+	}
+	thread_run(numthreads, __simulation_pool_thread_func, &ptparam[0], sizeof(PoolParam));
+	pthread_mutex_destroy(&queue.lock);
+	return pool;
+}
+
+/* a simulated family in the pool: root size index and sample */
+typedef std::pair<int, int> pool_sample;
+
+struct PooledQueue
+{
+	pthread_mutex_t lock;
+	int next;
+	int root_min;
+	int root_max;
+	int num_samples;
+	const simulation_pool* pool;
+	const std::vector<int>* node_ids;
+	/* families in the pool whose split root has each size, indexed by size - root_min */
+	std::vector<std::vector<pool_sample> > samples;
+	matrix* pCD;
+	uint64_t seed;
+};
+
+typedef struct
+{
+	pCafeTree split;
+	PooledQueue* queue;
+}PooledParam;
+
+void* __pooled_distribution_thread_func(void* ptr)
+{
+	PooledParam* param = (PooledParam*)ptr;
+	PooledQueue* queue = param->queue;
+	const simulation_pool* pool = queue->pool;
+	const std::vector<int>& node_ids = *queue->node_ids;
+	pCafeTree split = cafe_tree_copy(param->split);
+	pArrayList nlist = split->super.nlist;
+
+	random_family_block block;
+	block.pcafe = split;
+	block.family_start = split->familysizes[0];
+	block.sizes.assign(nlist->size, std::vector<int>(RANDOM_PROBABILITY_BLOCK));
+	while (true)
+	{
+		pthread_mutex_lock(&queue->lock);
+		int s = queue->root_min + queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (s > queue->root_max) break;
+
+		const std::vector<pool_sample>& samples = queue->samples[s - queue->root_min];
+		std::vector<double>& row = (*queue->pCD)[s - queue->root_min];
+		RandomStream stream;
+		random_stream_init(&stream, queue->seed, s - queue->root_min);
+		pRandomStream old = unifrnd_set_stream(&stream);
+		for (int first = 0; first < queue->num_samples; first += RANDOM_PROBABILITY_BLOCK)
+		{
+			block.width = MIN(RANDOM_PROBABILITY_BLOCK, queue->num_samples - first);
+			int taken = MIN(block.width, MAX(0, (int)samples.size() - first));
+			if (taken < block.width)
+			{
+				// not enough families in the pool had this size at the split root
+				simulate_random_block(split, block, s);
+			}
+			else
+			{
+				block.family_end = block.family_start;
+				for (int n = 0; n < nlist->size; n++)
+					block.sizes[n].resize(block.width);
+			}
+			for (int b = 0; b < taken; b++)
+			{
+				const pool_sample& sample = samples[first + b];
+				const int* states = &pool->states[sample.first][(size_t)sample.second * pool->num_nodes];
+				int max = 0;
+				for (int n = 0; n < nlist->size; n++)
+				{
+					int size = node_ids[n] >= 0 ? states[node_ids[n]] : 0;
+					block.sizes[n][b] = size;
+					max = MAX(max, size);
+				}
+				block.family_end = MAX(block.family_end, max + MAX(50, max / 5));
+			}
+			block.family_end = MIN(block.family_end, split->familysizes[1]);
+
+			std::vector<double> lh = block_likelihoods(block, (pCafeNode)split->super.root, s, s);
+			std::copy(lh.begin(), lh.end(), row.begin() + first);
+		}
+		unifrnd_set_stream(old);
+		std::sort(row.begin(), row.end());
+	}
+	cafe_tree_free(split);
+	return (NULL);
+}
+
+/**
+* \brief Conditional distribution of a tree split off the pooled tree, taken from the pooled families
+*
+* node_ids gives the pooled tree's id for each node of split, or -1 for none. Given the size of
+* its root, the families below a node do not depend on anything above it, so every pooled family
+* whose node at the split root has size s is a sample for root size s; the leaves outside split
+* are ignored. Sizes that too few pooled families reach are filled up by simulating on split.
+* A node removed by the split must have had the same rates as the child whose branch took over
+* its own, or the pooled families do not follow the rates of split.
+*/
+matrix pooled_conditional_distribution(const simulation_pool& pool, pCafeTree split, const std::vector<int>& node_ids, family_size_range *range, int numthreads, int num_samples)
+{
+	PooledQueue queue;
+	pthread_mutex_init(&queue.lock, NULL);
+	queue.next = 0;
+	queue.root_min = range->root_min;
+	queue.root_max = range->root_max;
+	queue.num_samples = num_samples;
+	queue.pool = &pool;
+	queue.node_ids = &node_ids;
+	queue.samples.resize(range->root_max - range->root_min + 1);
+	queue.seed = unifrnd_split();
+
+	int root = node_ids[split->super.root->id];
+	for (size_t r = 0; r < pool.states.size(); r++)
+	{
+		for (int i = 0; i < pool.num_samples; i++)
+		{
+			int s = pool.states[r][(size_t)i * pool.num_nodes + root];
+			if (s < range->root_min || s > range->root_max) continue;
+			std::vector<pool_sample>& samples = queue.samples[s - range->root_min];
+			if ((int)samples.size() < num_samples)
+				samples.push_back(pool_sample((int)r, i));
+		}
+	}
+
+	matrix cdlist(range->root_max - range->root_min + 1, std::vector<double>(num_samples));
+	queue.pCD = &cdlist;
+
+	numthreads = MAX(1, MIN(numthreads, (int)cdlist.size()));
+	std::vector<PooledParam> ptparam(numthreads);
+	for (int i = 0; i < numthreads; i++)
+	{
+		ptparam[i].split = split;
+		ptparam[i].queue = &queue;
+	}
+	thread_run(numthreads, __pooled_distribution_thread_func, &ptparam[0], sizeof(PooledParam));
+	pthread_mutex_destroy(&queue.lock);
+	return cdlist;
+}
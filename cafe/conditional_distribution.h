@@ -2,6 +2,7 @@
 #define CONDITIONAL_DISTRIBUTION_F12ED8EA_52AE_4508_A175_5DDCBE682A46
 
 #include <vector>
+#include <string>
 
 extern "C" {
 #include "cafe.h"
@@ -12,6 +13,61 @@ typedef std::vector<std::vector<double> > matrix;
 
 std::vector<double> get_random_probabilities(pCafeTree pcafe, int rootFamilysize, int trials);
 matrix conditional_distribution(pCafeTree pcafe, int range_start, int range_end, int num_trials);
+/* a block of samples drawn for one root size */
+struct CDTask
+{
+	int root;
+	int start;
+	int count;
+};
+
+std::vector<CDTask> conditional_distribution_tasks(int root_min, int root_max, int num_random_samples, int numthreads);
 matrix cafe_conditional_distribution(pCafeTree pTree, family_size_range *range, int numthreads, int num_random_samples);
+matrix cafe_conditional_distribution_uncached(pCafeTree pTree, family_size_range *range, int numthreads, int num_random_samples);
+
+pCafeTree cafe_tree_tilted_copy(pCafeTree pcafe, double lambda_factor);
+std::vector<double> get_weighted_random_probabilities(pCafeTree pcafe, pCafeTree tilted, int rootFamilysize, int trials, std::vector<double>& weights);
+matrix cafe_weighted_conditional_distribution(pCafeTree pTree, family_size_range *range, int numthreads, int num_random_samples, double lambda_factor, matrix& cumulative);
+double weighted_pvalue(double lh, const std::vector<double>& likelihoods, const std::vector<double>& cumulative);
+
+void set_conditional_distribution_cache(const std::string& dir);
+std::string get_conditional_distribution_cache();
+void hash_bytes(uint64_t& h, const void* data, size_t len);
+uint64_t conditional_distribution_key(pCafeTree pcafe, family_size_range *range, int num_random_samples);
+bool read_conditional_distribution_cache(const std::string& file, uint64_t key, int rows, int cols, matrix& cd);
+bool write_conditional_distribution_cache(const std::string& file, uint64_t key, const matrix& cd);
+
+/* a conditional distribution file mapped read-only into memory */
+struct mapped_conditional_distribution
+{
+	void* base;
+	size_t length;
+	uint64_t key;
+	int rows;
+	int cols;
+	const double* data;
+};
+
+bool map_conditional_distribution(const std::string& file, mapped_conditional_distribution& m);
+void unmap_conditional_distribution(mapped_conditional_distribution& m);
+
+/**
+* \brief Size of every node in families simulated on a whole tree, for each root size in a range
+*
+* Branch cutting takes the conditional distributions of both sides of every cut from one
+* pool; see pooled_conditional_distribution.
+*/
+struct simulation_pool
+{
+	int num_nodes;
+	int root_id;
+	int root_min;
+	int num_samples;
+	/* states[root size - root_min][sample * num_nodes + node id] */
+	std::vector<std::vector<int> > states;
+};
+
+simulation_pool cafe_simulation_pool(pCafeTree pcafe, family_size_range *range, int numthreads, int num_samples);
+matrix pooled_conditional_distribution(const simulation_pool& pool, pCafeTree split, const std::vector<int>& node_ids, family_size_range *range, int numthreads, int num_samples);
 
 #endif
@@ -18,6 +18,8 @@ extern "C" {
 #include "Globals.h"
 #include "log_buffer.h"
 
+#include <pthread.h>
+
 extern "C" {
 	extern pCafeParam cafe_param;
 	void cafe_shell_set_lambda(pCafeParam param, double* parameters);
@@ -116,6 +118,24 @@ lambda_args get_arguments(vector<Argument> pargs)
 		{
 			result.outfile = parg->argv[0];
 		}
+		else if (!strcmp(parg->opt, "-checkpoint"))
+		{
+			result.checkpoint = parg->argv[0];
+			if (parg->argc > 1)
+			{
+				sscanf(parg->argv[1], "%d", &result.checkpoint_interval);
+			}
+		}
+		else if (!strcmp(parg->opt, "-resume"))
+		{
+			result.checkpoint = parg->argv[0];
+			result.resume = true;
+		}
+		else if (!strcmp(parg->opt, "-trace"))
+		{
+			result.trace = parg->argv[0];
+			result.trace_binary = parg->argc > 1 && !strcmp(parg->argv[1], "bin");
+		}
 	}
 
 	return result;
@@ -134,72 +154,250 @@ void set_all_lambdas(pCafeParam param, double value)
 
 }
 
-pGMatrix cafe_lambda_distribution(pCafeParam param, const vector<lambda_range>& range)
+pGMatrix lambda_distribution_new(const vector<lambda_range>& range)
 {
-	int numrange = range.size();
-	int i, j;
-	int* size = (int*)memory_new(numrange, sizeof(int));
-	double* plambda = (double*)memory_new(numrange, sizeof(double));
-	int* idx = (int*)memory_new(numrange, sizeof(int));
-	for (i = 0; i < numrange; i++)
+	vector<int> size(range.size());
+	for (size_t i = 0; i < range.size(); i++)
 	{
 		size[i] = 1 + rint((range[i].end - range[i].start) / range[i].step);
 	}
-	pGMatrix pgm = gmatrix_double_new(numrange, size);
+	return gmatrix_double_new(range.size(), &size[0]);
+}
 
-	for (i = 0; i < pgm->num_elements; i++)
+static void lambda_distribution_point(pGMatrix pgm, const vector<lambda_range>& range, int i, double* plambda)
+{
+	vector<int> idx(range.size());
+	gmatrix_dim_index(pgm, i, &idx[0]);
+	for (size_t j = 0; j < range.size(); j++)
+	{
+		plambda[j] = range[j].step * idx[j] + range[j].start;
+	}
+}
+
+static void write_lambda_distribution_line(FILE* fp, const double* plambda, size_t num_lambdas, double score)
+{
+	fprintf(fp, "%lf", plambda[0]);
+	for (size_t k = 1; k < num_lambdas; k++)
+	{
+		fprintf(fp, "\t%lf", plambda[k]);
+	}
+	fprintf(fp, "\t%lf\n", score);
+}
+
+/**
+* \brief Reads grid points already written by an earlier, possibly interrupted, scan
+*
+* Each complete line holds the lambdas of one grid point followed by its score. Lines
+* that do not match a point of the current range, and a trailing line without a
+* newline, are ignored. Returns the number of points marked as done.
+*/
+int read_lambda_distribution(FILE* fp, const vector<lambda_range>& range, pGMatrix pgm, vector<bool>& done)
+{
+	int count = 0;
+	char line[STRING_BUF_SIZE];
+	done.resize(pgm->num_elements, false);
+	while (fgets(line, sizeof(line), fp))
 	{
-		gmatrix_dim_index(pgm, i, idx);
-		for (j = 0; j < numrange; j++)
+		if (strchr(line, '\n') == NULL)
+			break;
+		istringstream ist(line);
+		vector<double> values;
+		double d;
+		while (ist >> d)
+			values.push_back(d);
+		if (values.size() != range.size() + 1)
+			continue;
+
+		int i = 0;
+		bool valid = true;
+		for (size_t j = 0; j < range.size(); j++)
 		{
-			plambda[j] = range[j].step * idx[j] + range[j].start;
+			int idx = rint((values[j] - range[j].start) / range[j].step);
+			if (idx < 0 || idx >= pgm->size[j])
+			{
+				valid = false;
+				break;
+			}
+			i += idx * pgm->cumsize[j];
 		}
-		double v = -__cafe_best_lambda_search(plambda, (void*)param);
-		gmatrix_double_set_with_index(pgm, v, i);
+		if (!valid)
+			continue;
+		gmatrix_double_set_with_index(pgm, values[range.size()], i);
+		if (!done[i])
+			count++;
+		done[i] = true;
+	}
+	return count;
+}
+
+struct LambdaDistributionParam
+{
+	pCafeParam param;
+	const vector<lambda_range>* range;
+	pGMatrix pgm;
+	const vector<int>* pending;
+	size_t* next;
+	bool* failed;
+	FILE* fp;
+};
+
+pthread_mutex_t mutex_lambda_distribution = PTHREAD_MUTEX_INITIALIZER;
+
+void* __cafe_lambda_distribution_thread_func(void* ptr)
+{
+	LambdaDistributionParam* pld = (LambdaDistributionParam*)ptr;
+	pCafeParam param = pld->param;
+	const vector<lambda_range>& range = *pld->range;
+	vector<double> plambda(range.size());
+	while (true)
+	{
+		pthread_mutex_lock(&mutex_lambda_distribution);
+		size_t n = (*pld->next)++;
+		pthread_mutex_unlock(&mutex_lambda_distribution);
+		if (n >= pld->pending->size())
+			break;
+
+		int i = (*pld->pending)[n];
+		lambda_distribution_point(pld->pgm, range, i, &plambda[0]);
+		double v = cafe_get_posterior_for_lambdas(param, &plambda[0]);
+
+		pthread_mutex_lock(&mutex_lambda_distribution);
+		gmatrix_double_set_with_index(pld->pgm, v, i);
 		if (-v > 1e300)
+			*pld->failed = true;
+		if (pld->fp)
 		{
-			for (j = 0; j < param->pfamily->flist->size; j++)
-			{
-				pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[j];
-				pitem->maxlh = -1;
-			}
+			write_lambda_distribution_line(pld->fp, &plambda[0], range.size(), v);
+			fflush(pld->fp);
+		}
+		char buf[STRING_STEP_SIZE];
+		buf[0] = '\0';
+		string_pchar_join_double(buf, (char*)",", range.size(), &plambda[0]);
+		cafe_log(param, "Lambda : %s & Score: %f\n", buf, v);
+		pthread_mutex_unlock(&mutex_lambda_distribution);
+	}
+	return NULL;
+}
+
+/**
+* \brief Sets the maxlh of every family that has none, from its likelihoods at plambda
+*
+* Unlike \ref cafe_get_posterior this does not stop at the first family with a zero
+* likelihood, so no family is left without one.
+*/
+static void fill_family_maxlh(pCafeParam param, double* plambda)
+{
+	param->param_set_func(param, plambda);
+	pBirthDeathCacheArray cache = birthdeath_cache_init(MAX(param->family_size.max, param->family_size.root_max));
+	cafe_tree_set_birthdeath_with_cache(param->pcafe, cache);
+	pCafeFamily pfamily = param->pfamily;
+	for (int i = 0; i < pfamily->flist->size; i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)pfamily->flist->array[i];
+		if ((pitem->ref < 0 || pitem->ref == i) && pitem->maxlh < 0)
+		{
+			cafe_family_set_size(pfamily, i, param->pcafe);
+			compute_tree_likelihoods(param->pcafe);
+			pitem->maxlh = __maxidx(get_likelihoods(param->pcafe), param->pcafe->rfsize);
 		}
 	}
+	birthdeath_cache_array_free(cache);
+}
 
-	memory_free(idx);
-	idx = NULL;
-	memory_free(size);
-	size = NULL;
-	memory_free(plambda);
-	plambda = NULL;
+/**
+* \brief Scores every point of the lambda grid that is not yet marked as done
+*
+* Points are handed out one at a time to param->num_threads workers, each of which
+* scores with its own copy of the tree and its own birthdeath cache. Each result is
+* appended to fp as soon as it is known, so an interrupted scan can be picked up
+* again with \ref read_lambda_distribution. The maxlh of each family is set from the
+* first pending point before the workers start, and if any point scores zero all of
+* them are reset once the scan is over.
+*/
+void fill_lambda_distribution(pCafeParam param, const vector<lambda_range>& range, pGMatrix pgm, vector<bool>& done, FILE* fp)
+{
+	done.resize(pgm->num_elements, false);
+	vector<int> pending;
+	for (int i = 0; i < pgm->num_elements; i++)
+	{
+		if (!done[i])
+			pending.push_back(i);
+	}
+	if (pending.empty())
+		return;
+
+	chooseln_cache_reserve(MAX(param->family_size.max, param->family_size.root_max));
+
+	int num_threads = MAX(1, MIN(param->num_threads, (int)pending.size()));
+	size_t next = 0;
+	bool failed = false;
+	vector<LambdaDistributionParam> ptparam(num_threads);
+	for (int i = 0; i < num_threads; i++)
+	{
+		ptparam[i].param = cafe_thread_copy_parameters(param);
+		ptparam[i].param->num_lambdas = range.size();
+		ptparam[i].range = &range;
+		ptparam[i].pgm = pgm;
+		ptparam[i].pending = &pending;
+		ptparam[i].next = &next;
+		ptparam[i].failed = &failed;
+		ptparam[i].fp = fp;
+	}
+
+	// the workers share param->pfamily, so every maxlh is set here and only read by them
+	vector<double> plambda(range.size());
+	lambda_distribution_point(pgm, range, pending[0], &plambda[0]);
+	fill_family_maxlh(ptparam[0].param, &plambda[0]);
+
+	thread_run(num_threads, __cafe_lambda_distribution_thread_func, &ptparam[0], sizeof(LambdaDistributionParam));
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		cafe_thread_free_parameters(ptparam[i].param);
+	}
+
+	if (failed)
+	{
+		cafe_family_reset_maxlh(param->pfamily);
+	}
+	for (size_t n = 0; n < pending.size(); n++)
+	{
+		done[pending[n]] = true;
+	}
+}
+
+pGMatrix cafe_lambda_distribution(pCafeParam param, const vector<lambda_range>& range)
+{
+	pGMatrix pgm = lambda_distribution_new(range);
+	vector<bool> done;
+	fill_lambda_distribution(param, range, pgm, done, NULL);
 	return pgm;
 }
 
-void write_lambda_distribution(pCafeParam param, const std::vector<lambda_range>& range, FILE* fp)
+/**
+* \brief Opens the output file of a lambda scan for appending
+*
+* Points already present in the file are read into pgm and marked in done, so that
+* rerunning an interrupted scan only scores what is missing. Returns NULL if the
+* file cannot be opened.
+*/
+FILE* resume_lambda_distribution(const char* file, const vector<lambda_range>& range, pGMatrix pgm, vector<bool>& done, int* num_done)
 {
-	param->num_lambdas = range.size();
-	pGMatrix pgm = cafe_lambda_distribution(param, range);
+	bool needs_newline = false;
+	*num_done = 0;
+	FILE* fp = fopen(file, "r");
 	if (fp)
 	{
-		int* idx = (int*)memory_new(range.size(), sizeof(int));
-		for (int j = 0; j < pgm->num_elements; j++)
-		{
-			gmatrix_dim_index(pgm, j, idx);
-			fprintf(fp, "%lf", idx[0] * range[0].step + range[0].start);
-			for (size_t k = 1; k < range.size(); k++)
-			{
-				fprintf(fp, "\t%lf", idx[k] * range[k].step + range[k].start);
-			}
-			fprintf(fp, "\t%lf\n", gmatrix_double_get_with_index(pgm, j));
-		}
+		*num_done = read_lambda_distribution(fp, range, pgm, done);
+		needs_newline = fseek(fp, -1, SEEK_END) == 0 && fgetc(fp) != '\n';
 		fclose(fp);
-		memory_free(idx);
-		idx = NULL;
 	}
-	gmatrix_free(pgm);
+	fp = fopen(file, "a");
+	if (fp && needs_newline)
+		fputc('\n', fp);
+	return fp;
 }
 
-
 void validate_lambda_count(int expected, int actual, pTree pTree, int k_value)
 {
 	// check if the numbers of lambdas and proportions put in matches the number of parameters
@@ -324,7 +522,37 @@ void lambda_search(pCafeParam param, lambda_args& params)
 	}
 	else
 	{
-		cafe_best_lambda_by_fminsearch(param, param->num_lambdas, param->parameterized_k_value);
+		if (!params.trace.empty())
+		{
+			param->trace = cafe_trace_new(params.trace.c_str(), params.trace_binary, param->num_params);
+			if (param->trace == NULL)
+			{
+				throw std::runtime_error("ERROR(lambda): Cannot open trace file " + params.trace + "\n");
+			}
+		}
+		double* result;
+		if (!params.checkpoint.empty())
+		{
+			if (params.resume)
+			{
+				cafe_log(param, "Resuming search from %s\n", params.checkpoint.c_str());
+			}
+			result = cafe_best_lambda_by_fminsearch_checkpoint(param, param->num_lambdas, param->parameterized_k_value,
+				params.checkpoint.c_str(), params.checkpoint_interval, params.resume);
+		}
+		else
+		{
+			result = cafe_best_lambda_by_fminsearch(param, param->num_lambdas, param->parameterized_k_value);
+		}
+		if (param->trace)
+		{
+			cafe_trace_free(param->trace);
+			param->trace = NULL;
+		}
+		if (result == NULL)
+		{
+			throw std::runtime_error("ERROR(lambda): Cannot resume from checkpoint " + params.checkpoint + "\n");
+		}
 	}
 
 }
@@ -339,6 +567,11 @@ void lambda_search(pCafeParam param, lambda_args& params)
 * -t takes the same Newick tree structure as in the tree
 * command, excluding branch lengths and subsituting integer
 * values from 1 to N taxon names.
+* -checkpoint file [interval] saves the state of the -s search to file
+* every interval iterations, and -resume file continues a search from
+* such a file, checkpointing to it as it goes.
+* -trace file [tsv|bin] writes the parameters, score, timings and cache
+* counts of every evaluation made by the -s search to file.
 * etc.
 */
 int cafe_cmd_lambda(Globals& globals, vector<string> tokens)
@@ -363,11 +596,23 @@ int cafe_cmd_lambda(Globals& globals, vector<string> tokens)
 	}
 	if (!params.range.empty())
 	{
+		param->num_lambdas = params.range.size();
+		pGMatrix pgm = lambda_distribution_new(params.range);
+		vector<bool> done;
 		FILE* fp = NULL;
-		if(!params.outfile.empty() && (fp = fopen(params.outfile.c_str(),"w") ) == NULL )
+		if (!params.outfile.empty())
 		{
-			fprintf(stderr, "ERROR(lambda): Cannot open file: %s\n", params.outfile.c_str());
-			return -1;
+			int num_done = 0;
+			if ((fp = resume_lambda_distribution(params.outfile.c_str(), params.range, pgm, done, &num_done)) == NULL)
+			{
+				gmatrix_free(pgm);
+				fprintf(stderr, "ERROR(lambda): Cannot open file: %s\n", params.outfile.c_str());
+				return -1;
+			}
+			if (num_done > 0)
+			{
+				cafe_log(param, "Resuming: %d of %d points already in %s\n", num_done, pgm->num_elements, params.outfile.c_str());
+			}
 		}
 		param->posterior = 1;
 		// set rootsize prior based on leaf size
@@ -383,9 +628,12 @@ int cafe_cmd_lambda(Globals& globals, vector<string> tokens)
 		{
 			ost << j + 1 << "st Distribution: " << params.range[j].start << " : " << params.range[j].step << " : " << params.range[j].end << "\n";
 		}
-		write_lambda_distribution(&globals.param, params.range, fp);
+		ost.flush();
+		fill_lambda_distribution(&globals.param, params.range, pgm, done, fp);
+		gmatrix_free(pgm);
 		params.bdone = 1;
-		fclose(fp);
+		if (fp)
+			fclose(fp);
 	}
 
 	if (params.bdone )
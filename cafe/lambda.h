@@ -21,6 +21,8 @@ struct lambda_range
 	double end;
 };
 
+const int DEFAULT_CHECKPOINT_INTERVAL = 5;
+
 struct lambda_args
 {
 	bool search;
@@ -38,9 +40,15 @@ struct lambda_args
 	bool checkconv;
 	int num_params;
 	int fixcluster0;
+	std::string checkpoint;
+	int checkpoint_interval;
+	bool resume;
+	std::string trace;
+	bool trace_binary;
 
 	lambda_args() : search(false), lambda_type(UNDEFINED_LAMBDA), vlambda(0.0), bdone(0), each(false),
-		write_files(false), lambda_tree(NULL), checkconv(false), num_params(0), fixcluster0(0)
+		write_files(false), lambda_tree(NULL), checkconv(false), num_params(0), fixcluster0(0),
+		checkpoint_interval(DEFAULT_CHECKPOINT_INTERVAL), resume(false), trace_binary(false)
 	{
 	}
 
@@ -49,7 +57,11 @@ struct lambda_args
 lambda_args get_arguments(std::vector<Argument> pargs);
 int cafe_cmd_lambda(Globals& globals, std::vector<std::string> tokens);
 void set_all_lambdas(pCafeParam param, double value);
+pGMatrix lambda_distribution_new(const std::vector<lambda_range>& range);
 pGMatrix cafe_lambda_distribution(pCafeParam param, const std::vector<lambda_range>& range);
+void fill_lambda_distribution(pCafeParam param, const std::vector<lambda_range>& range, pGMatrix pgm, std::vector<bool>& done, FILE* fp);
+int read_lambda_distribution(FILE* fp, const std::vector<lambda_range>& range, pGMatrix pgm, std::vector<bool>& done);
+FILE* resume_lambda_distribution(const char* file, const std::vector<lambda_range>& range, pGMatrix pgm, std::vector<bool>& done, int* num_done);
 
 const int INIT_PARAMS = 1;
 const int INIT_KWEIGHTS = 2;
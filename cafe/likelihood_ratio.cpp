@@ -1,12 +1,11 @@
 #include <vector>
+#include <pthread.h>
 
 #include "likelihood_ratio.h"
 
 extern "C" {
 #include "cafe.h"
 #include <family.h>
-
-	extern pBirthDeathCacheArray probability_cache;
 }
 
 const double bl_augment = 0.5;
@@ -16,18 +15,6 @@ const double bl_augment = 0.5;
 * Likelihood ratio test with more than one lambda
 **************************************************************************/
 
-struct LRT2LParam
-{
-	pCafeParam cafeparam;
-	std::vector<int>& lambda;
-	std::vector<double> & pvalues;
-	param_func lfunc;
-	pTree lambda_tree;
-	int    num_lambdas;
-	std::vector<double*> &lambda_cache;
-	pBirthDeathCacheArray* PBDC;
-};
-
 void likelihood_ratio_report(pCafeFamily pfamily, 
 	pCafeTree pcafe, 
 	const std::vector<double> &pvalues, 
@@ -73,106 +60,337 @@ void update_branchlength(pCafeTree pcafe, pTree lambda_tree, double bl_augment,
 }
 
 
-double __cafe_lhr_get_likelihood_for_diff_lambdas(pCafeParam param, int idx, int t, std::vector<double*> &lambda_cache, std::vector<pBirthDeathCacheArray>& PBDC)
+/**
+* \brief Context for the parameters as they are, with the branch lengths of the tree
+*/
+LikelihoodContext::LikelihoodContext(pCafeParam source) : cache(NULL)
 {
-	update_branchlength(param->pcafe, param->lambda_tree, bl_augment, param->old_branchlength, &t);
-	if (lambda_cache[t] == NULL)
-	{
-		param->lambda = NULL;
-		cafe_best_lambda_by_fminsearch(param, param->num_lambdas, 0);
-		lambda_cache[t] = param->lambda;
-		reset_birthdeath_cache(param->pcafe, 0, &param->family_size);
-		PBDC[t] = probability_cache;
-	}
-	else
+	param = cafe_thread_copy_parameters(source);
+	param->param_set_func(param, param->parameters);
+	set_birthdeath();
+}
+
+/**
+* \brief Context for hypothesis t: the branches marked in lambda_tree lengthened by t * bl_augment
+*
+* Its num_lambdas lambdas are not known until \ref fit is called.
+*/
+LikelihoodContext::LikelihoodContext(pCafeParam source, pTree lambda_tree, int num_lambdas, param_func lfunc, int t) : cache(NULL)
+{
+	param = cafe_thread_copy_parameters(source);
+	memory_free(param->parameters);
+	param->parameters = (double*)memory_new(num_lambdas, sizeof(double));
+	param->lambda = param->parameters;
+	param->num_lambdas = num_lambdas;
+	param->num_params = num_lambdas;
+	param->lambda_tree = lambda_tree;
+	param->param_set_func = lfunc;
+
+	std::vector<int> old_branchlength(param->pcafe->super.nlist->size);
+	update_branchlength(param->pcafe, lambda_tree, bl_augment, &old_branchlength[0], &t);
+}
+
+LikelihoodContext::~LikelihoodContext()
+{
+	cafe_thread_free_parameters(param);
+	if (cache)
+		birthdeath_cache_array_free(cache);
+}
+
+void LikelihoodContext::set_birthdeath()
+{
+	cache = birthdeath_cache_init(MAX(param->family_size.max, param->family_size.root_max));
+	cafe_tree_set_birthdeath_with_cache(param->pcafe, cache);
+}
+
+static double __cafe_lhr_lambda_search(double* plambda, void* args)
+{
+	return -cafe_get_posterior_for_lambdas((pCafeParam)args, plambda);
+}
+
+/**
+* \brief Searches for the lambdas of the hypothesis on all families
+*
+* Runs the restarted simplex search of \ref cafe_best_lambda_by_fminsearch without clusters,
+* but scores each point with a birthdeath cache of its own, so contexts may be fitted on
+* several threads at once. Starting points are drawn from stream, and every family must
+* already have its maxlh set.
+*/
+void LikelihoodContext::fit(pRandomStream stream)
+{
+	int max_runs = 10;
+	std::vector<double> scores(max_runs);
+	RestartSearch rs;
+	memset(&rs, 0, sizeof(RestartSearch));
+	rs.eq = __cafe_lhr_lambda_search;
+	rs.eq_args = param;
+	rs.N = param->num_lambdas;
+	rs.tol = 1e-6;
+	rs.lambda_len = param->num_lambdas;
+	rs.stream = stream;
+	rs.max_runs = max_runs;
+	rs.scores = &scores[0];
+	int runs;
+	cafe_restart_search(param, &rs, &runs);
+
+	param->param_set_func(param, param->parameters);
+	set_birthdeath();
+}
+
+/**
+* \brief Posterior of all families in the context, setting the maxlh of families that have none
+*/
+double LikelihoodContext::posterior()
+{
+	return cafe_get_posterior(param->pfamily, param->pcafe, &param->family_size, param->ML, param->MAP, param->prior_rfsize, param->quiet);
+}
+
+/**
+* \brief A tree to score families on, sharing the matrices of the context
+*/
+pCafeTree LikelihoodContext::scratch() const
+{
+	return cafe_tree_copy(param->pcafe);
+}
+
+double LikelihoodContext::max_likelihood(pCafeFamily pfamily, int idx, pCafeTree scratch) const
+{
+	cafe_family_set_size(pfamily, idx, scratch);
+	compute_tree_likelihoods(scratch);
+	return __max(get_likelihoods(scratch), scratch->rfsize);
+}
+
+/* families handed to a likelihood ratio test thread at once */
+const int LRT_FAMILY_CHUNK = 16;
+
+/* most hypotheses tried for a family */
+const int LRT_MAX_HYPOTHESES = 100;
+
+struct LRTFitQueue
+{
+	pthread_mutex_t lock;
+	size_t next;
+	const std::vector<LikelihoodContext*>* contexts;
+	int first;
+	uint64_t seed;
+};
+
+typedef struct
+{
+	LRTFitQueue* queue;
+}LRTFitParam;
+
+void* __cafe_lhr_fit_thread_func(void* ptr)
+{
+	LRTFitQueue* queue = ((LRTFitParam*)ptr)->queue;
+	while (true)
 	{
-		memcpy(param->lambda, lambda_cache[t], sizeof(double)*param->num_lambdas);
-		param->param_set_func(param, param->lambda);
-		probability_cache = PBDC[t];
-		cafe_tree_set_birthdeath(param->pcafe);
+		pthread_mutex_lock(&queue->lock);
+		size_t c = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (c >= queue->contexts->size()) break;
+
+		// hypothesis t draws its starting points from stream t whichever thread fits it
+		RandomStream stream;
+		random_stream_init(&stream, queue->seed, queue->first + c);
+		(*queue->contexts)[c]->fit(&stream);
 	}
-	int i;
-	cafe_family_set_size(param->pfamily, idx, param->pcafe);
-	compute_tree_likelihoods(param->pcafe);
-	double mlh = __max(get_likelihoods(param->pcafe), param->pcafe->rfsize);
-	pTree ptree = (pTree)param->pcafe;
-	pArrayList nlist = ptree->nlist;
-	for (i = 0; i < nlist->size; i++)
+	return (NULL);
+}
+
+/* fits contexts, which hold hypotheses first, first + 1, ..., on num_threads threads */
+static void fit_contexts(const std::vector<LikelihoodContext*>& contexts, int first, uint64_t seed, int num_threads)
+{
+	LRTFitQueue queue;
+	pthread_mutex_init(&queue.lock, NULL);
+	queue.next = 0;
+	queue.contexts = &contexts;
+	queue.first = first;
+	queue.seed = seed;
+
+	num_threads = MAX(1, MIN(num_threads, (int)contexts.size()));
+	std::vector<LRTFitParam> ptparam(num_threads);
+	for (int i = 0; i < num_threads; i++)
 	{
-		pPhylogenyNode pnode = (pPhylogenyNode)nlist->array[i];
-		pnode->branchlength = param->old_branchlength[i];
+		ptparam[i].queue = &queue;
 	}
-	return mlh;
+	thread_run(num_threads, __cafe_lhr_fit_thread_func, &ptparam[0], sizeof(LRTFitParam));
+	pthread_mutex_destroy(&queue.lock);
 }
 
-
-void* __cafe_lhr_for_diff_lambdas_i(pCafeParam param,
-	std::vector<int>& lambda,
-	std::vector<double> & pvalues,
-	param_func lfunc,
-	pTree lambda_tree,
-	int    num_lambdas,
-	std::vector<double*> &lambda_cache,
-	std::vector<pBirthDeathCacheArray> &PBDC
-)
+struct LRTQueue
 {
-	int i, j;
-	pCafeTree pcafe = cafe_tree_copy(param->pcafe);
+	pthread_mutex_t lock;
+	size_t next;
+	size_t chunks;
+	const std::vector<LikelihoodContext*>* contexts;
+	pCafeFamily pfamily;
+	const std::vector<int>* families;
+	std::vector<std::vector<double> >* likelihoods;
+};
 
-	pCafeParam cpy_param = cafe_copy_parameters(param);
-	cpy_param->num_lambdas = num_lambdas;
-	cpy_param->lambda_tree = lambda_tree;
-	cpy_param->param_set_func = lfunc;
+typedef struct
+{
+	LRTQueue* queue;
+}LRTParam;
 
-	int fsize = param->pfamily->flist->size;
-	for (i = 0; i < fsize; i += 1)
+void* __cafe_lhr_thread_func(void* ptr)
+{
+	LRTQueue* queue = ((LRTParam*)ptr)->queue;
+	const std::vector<int>& families = *queue->families;
+	const std::vector<LikelihoodContext*>& contexts = *queue->contexts;
+	std::vector<pCafeTree> scratch(contexts.size(), (pCafeTree)NULL);
+	while (true)
 	{
-		pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[i];
-		if (pitem->ref >= 0 && pitem->ref != i) continue;
-		cafe_family_set_size(param->pfamily, i, pcafe);
-		compute_tree_likelihoods(pcafe);
-		double maxlh1 = __max(get_likelihoods(pcafe), pcafe->rfsize);
-		double prev = -1;
-		double next = __cafe_lhr_get_likelihood_for_diff_lambdas(cpy_param, i, 0, lambda_cache, PBDC);
-		for (j = 1; prev < next; j++)
+		pthread_mutex_lock(&queue->lock);
+		size_t n = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (n >= contexts.size() * queue->chunks) break;
+
+		size_t c = n / queue->chunks;
+		size_t from = (n % queue->chunks) * LRT_FAMILY_CHUNK;
+		size_t to = MIN(from + LRT_FAMILY_CHUNK, families.size());
+		if (scratch[c] == NULL)
+			scratch[c] = contexts[c]->scratch();
+		for (size_t f = from; f < to; f++)
 		{
-			prev = next;
-			next = __cafe_lhr_get_likelihood_for_diff_lambdas(cpy_param, i, j, lambda_cache, PBDC);
+			(*queue->likelihoods)[c][f] = contexts[c]->max_likelihood(queue->pfamily, families[f], scratch[c]);
 		}
-		pvalues[i] = (prev == maxlh1) ? 1 : 2 * (log(prev) - log(maxlh1));
-		lambda[i] = j - 2;
 	}
-	cafe_free_copy_parameters(cpy_param);
-	cafe_tree_free(pcafe);
+	for (size_t c = 0; c < scratch.size(); c++)
+	{
+		if (scratch[c])
+			cafe_tree_free(scratch[c]);
+	}
 	return (NULL);
 }
 
+/**
+* \brief Maximum likelihood of each of families in each of contexts
+*
+* Every chunk of families under every context is one task, and the tasks are
+* shared out among num_threads threads in a single pass.
+*/
+static std::vector<std::vector<double> > max_likelihoods(const std::vector<LikelihoodContext*>& contexts, pCafeFamily pfamily, const std::vector<int>& families, int num_threads)
+{
+	std::vector<std::vector<double> > likelihoods(contexts.size(), std::vector<double>(families.size()));
+	LRTQueue queue;
+	pthread_mutex_init(&queue.lock, NULL);
+	queue.next = 0;
+	queue.chunks = (families.size() + LRT_FAMILY_CHUNK - 1) / LRT_FAMILY_CHUNK;
+	queue.contexts = &contexts;
+	queue.pfamily = pfamily;
+	queue.families = &families;
+	queue.likelihoods = &likelihoods;
 
+	int tasks = contexts.size() * queue.chunks;
+	num_threads = MAX(1, MIN(num_threads, tasks));
+	std::vector<LRTParam> ptparam(num_threads);
+	for (int i = 0; i < num_threads; i++)
+	{
+		ptparam[i].queue = &queue;
+	}
+	thread_run(num_threads, __cafe_lhr_thread_func, &ptparam[0], sizeof(LRTParam));
+	pthread_mutex_destroy(&queue.lock);
+	return likelihoods;
+}
+
+/**
+* \brief Likelihood ratio test of longer branches where lambda_tree2 marks them
+*
+* Hypothesis t lengthens the marked branches by t * bl_augment and searches for num_lambdas
+* lambdas on all families. Each family takes hypotheses in turn for as long as its likelihood
+* keeps growing. Hypotheses are taken in waves of one per thread: the searches of a wave run
+* at once, then every family still growing is scored under every hypothesis of the wave in
+* one parallel pass.
+*/
 void cafe_lhr_for_diff_lambdas(pCafeParam param, pTree lambda_tree2, int num_lambdas, param_func lfunc)
 {
-	std::vector<double *> lambda_cache(100);
-
 	cafe_log(param, "Running Likelihood Ratio Test 2....\n");
 	int i;
 
-	std::vector<pBirthDeathCacheArray> PBDC(100);
-	for (i = 0; i < 100; i++)
-	{
-		lambda_cache[i] = NULL;
-		PBDC[i] = NULL;
-	}
-
 	int nrows = param->pfamily->flist->size;
 	std::vector<double> pvalues(nrows);
 	std::vector<int> plambda(nrows);
 
-	param_func old_func = param->param_set_func;
-	param->param_set_func = cafe_lambda_set_default;
-	__cafe_lhr_for_diff_lambdas_i(param, plambda, pvalues, lfunc, lambda_tree2, num_lambdas, lambda_cache, PBDC);
-	param->param_set_func = old_func;
+	std::vector<int> families;
+	for (i = 0; i < nrows; i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[i];
+		if (pitem->ref < 0 || pitem->ref == i)
+			families.push_back(i);
+	}
+
+	chooseln_cache_reserve(MAX(param->family_size.max, param->family_size.root_max));
 
-	int fsize = param->pfamily->flist->size;
-	for (i = 0; i < fsize; i++)
+	std::vector<double> maxlh1;
+	{
+		std::vector<LikelihoodContext*> null(1, new LikelihoodContext(param));
+		// the searches below only read maxlh, so any family without one gets it here
+		null[0]->posterior();
+		maxlh1 = max_likelihoods(null, param->pfamily, families, param->num_threads)[0];
+		delete null[0];
+	}
+
+	uint64_t seed = unifrnd_split();
+	int width = MAX(1, param->num_threads);
+	std::vector<LikelihoodContext*> contexts;
+	std::vector<double> best(families.size(), -1);
+	std::vector<int> growing(families.size());
+	for (size_t f = 0; f < families.size(); f++)
+		growing[f] = f;
+	while (!growing.empty() && (int)contexts.size() < LRT_MAX_HYPOTHESES)
+	{
+		int first = contexts.size();
+		std::vector<LikelihoodContext*> wave;
+		for (int t = first; t < MIN(first + width, LRT_MAX_HYPOTHESES); t++)
+			wave.push_back(new LikelihoodContext(param, lambda_tree2, num_lambdas, lfunc, t));
+		fit_contexts(wave, first, seed, param->num_threads);
+		for (size_t w = 0; w < wave.size(); w++)
+		{
+			char buf[STRING_STEP_SIZE];
+			buf[0] = '\0';
+			string_pchar_join_double(buf, (char*)",", num_lambdas, (double*)wave[w]->lambdas());
+			cafe_log(param, "Hypothesis %d: Lambda : %s\n", first + (int)w, buf);
+		}
+		contexts.insert(contexts.end(), wave.begin(), wave.end());
+
+		std::vector<int> rows(growing.size());
+		for (size_t g = 0; g < growing.size(); g++)
+			rows[g] = families[growing[g]];
+		std::vector<std::vector<double> > lh = max_likelihoods(wave, param->pfamily, rows, param->num_threads);
+
+		// positions in growing of the families that kept growing through the wave so far
+		std::vector<size_t> alive(growing.size());
+		for (size_t g = 0; g < growing.size(); g++)
+			alive[g] = g;
+		for (size_t w = 0; w < wave.size() && !alive.empty(); w++)
+		{
+			std::vector<size_t> still_alive;
+			for (size_t a = 0; a < alive.size(); a++)
+			{
+				int f = growing[alive[a]];
+				if (best[f] < lh[w][alive[a]])
+				{
+					best[f] = lh[w][alive[a]];
+					plambda[families[f]] = first + w;
+					still_alive.push_back(alive[a]);
+				}
+			}
+			alive.swap(still_alive);
+		}
+		std::vector<int> still_growing(alive.size());
+		for (size_t a = 0; a < alive.size(); a++)
+			still_growing[a] = growing[alive[a]];
+		growing.swap(still_growing);
+	}
+
+	for (size_t f = 0; f < families.size(); f++)
+	{
+		i = families[f];
+		pvalues[i] = (best[f] == maxlh1[f]) ? 1 : 2 * (log(best[f]) - log(maxlh1[f]));
+	}
+	for (i = 0; i < nrows; i++)
 	{
 		pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[i];
 		if (pitem->ref < 0 || pitem->ref == i) continue;
@@ -180,16 +398,11 @@ void cafe_lhr_for_diff_lambdas(pCafeParam param, pTree lambda_tree2, int num_lam
 		plambda[i] = plambda[pitem->ref];
 	}
 
+	std::vector<double*> lambda_cache(contexts.size());
+	for (size_t t = 0; t < contexts.size(); t++)
+		lambda_cache[t] = (double*)contexts[t]->lambdas();
 	likelihood_ratio_report(param->pfamily, param->pcafe, pvalues, plambda, lambda_cache, param->fout);
 
-	for (i = 0; i < 100; i++)
-	{
-		if (lambda_cache[i])
-		{
-			memory_free(lambda_cache[i]);
-			lambda_cache[i] = NULL;
-			birthdeath_cache_array_free(PBDC[i]);
-		}
-	}
+	for (size_t t = 0; t < contexts.size(); t++)
+		delete contexts[t];
 }
-
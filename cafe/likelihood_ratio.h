@@ -6,6 +6,37 @@
 extern "C" {
 #include <family.h>
 }
+
+/**
+* \brief One hypothesis of the likelihood ratio test with more than one lambda
+*
+* Bundles a copy of the parameters and tree, with the branch lengths and lambdas of the
+* hypothesis, and a birthdeath cache of its own that the tree's matrices come from, so
+* fitting or scoring never touches the global probability_cache. Contexts may be fitted on
+* several threads at once; once fitted a context is only read, and threads may score
+* families in it at once, each on its own scratch tree.
+*/
+class LikelihoodContext
+{
+	pCafeParam param;
+	pBirthDeathCacheArray cache;
+
+	void set_birthdeath();
+	LikelihoodContext(const LikelihoodContext&);
+	LikelihoodContext& operator=(const LikelihoodContext&);
+public:
+	LikelihoodContext(pCafeParam source);
+	LikelihoodContext(pCafeParam source, pTree lambda_tree, int num_lambdas, param_func lfunc, int t);
+	~LikelihoodContext();
+
+	void fit(pRandomStream stream);
+	double posterior();
+
+	const double* lambdas() const { return param->lambda; }
+	pCafeTree scratch() const;
+	double max_likelihood(pCafeFamily pfamily, int idx, pCafeTree scratch) const;
+};
+
 void cafe_lhr_for_diff_lambdas(pCafeParam param, pTree lambda_tree2, int num_lambdas, param_func lfunc);
 void update_branchlength(pCafeTree pcafe, pTree lambda_tree, double bl_augment, int *old_branchlength, int* t);
 
@@ -9,7 +9,7 @@ extern "C" {
 
 using namespace std;
 
-log_buffer::log_buffer(pCafeParam param, size_t buff_sz) : param_(param), buffer_(buff_sz + 1)
+log_buffer::log_buffer(pCafeParam param, size_t buff_sz, int level) : param_(param), level_(level), buffer_(buff_sz + 1)
 {
 	char *base = &buffer_.front();
 	setp(base, base + buffer_.size() - 1); // -1 to make overflow() easier
@@ -21,7 +21,7 @@ int log_buffer::sync()
 	ostringstream ost;
 	ost.write(pbase(), n);
 	pbump(-n);
-	cafe_log(param_, ost.str().c_str());
+	cafe_log_level(param_, level_, "%s", ost.str().c_str());
 	return 0;
 }
 
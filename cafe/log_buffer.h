@@ -11,7 +11,7 @@ extern "C" {
 class log_buffer : public std::streambuf
 {
 public:
-	explicit log_buffer(pCafeParam param, std::size_t buff_sz = 256);
+	explicit log_buffer(pCafeParam param, std::size_t buff_sz = 256, int level = CAFE_LOG_INFO);
 	virtual ~log_buffer()
 	{
 		sync();
@@ -27,6 +27,7 @@ private:
 
 private:
 	pCafeParam param_;
+	int level_;
 	std::vector<char> buffer_;
 };
 
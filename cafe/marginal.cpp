@@ -0,0 +1,402 @@
+#include <algorithm>
+#include <cmath>
+
+#include "marginal.h"
+
+extern "C" {
+#include "cafe.h"
+#include <pthread.h>
+}
+
+/**************************************************************************
+* Marginal ancestral reconstruction
+**************************************************************************/
+expected_change& expected_change::operator+=(const expected_change& other)
+{
+	gain += other.gain;
+	loss += other.loss;
+	expand += other.expand;
+	remain += other.remain;
+	decrease += other.decrease;
+	return *this;
+}
+
+/* likelihood of each size c of a leaf, at c - familysizes[0] */
+static void leaf_likelihoods(pCafeTree pcafe, pCafeNode pcnode, std::vector<double>& lh)
+{
+	int start = pcafe->familysizes[0];
+	int width = pcafe->familysizes[1] - start + 1;
+	// unknown size: every size is equally likely
+	lh.assign(width, pcnode->familysize < 0 ? 1 : 0);
+	if (pcnode->familysize < 0)
+		return;
+	for (int j = 0; j < width; j++)
+	{
+		int c = start + j;
+		if (pcnode->errormodel)
+		{
+			// conditional probability of measuring familysize when true count is c
+			pErrorStruct errormodel = pcnode->errormodel;
+			lh[j] = pcnode->familysize <= errormodel->maxfamilysize && c <= errormodel->maxfamilysize ? errormodel->errormatrix[pcnode->familysize][c] : 0;
+		}
+		else if (c == pcnode->familysize)
+		{
+			lh[j] = 1;
+		}
+	}
+}
+
+/* divides values by their largest, so that products over deep trees do not underflow */
+static void rescale(std::vector<double>& values)
+{
+	double largest = *std::max_element(values.begin(), values.end());
+	if (largest > 0)
+	{
+		for (size_t i = 0; i < values.size(); i++)
+			values[i] /= largest;
+	}
+}
+
+/**
+* \brief Posterior distribution of the size of every node and expected change along every branch
+*
+* One upward pass computes the likelihood of the data below each node for each of its sizes,
+* keeping the factor each child contributes to its parent. One downward pass then computes
+* the likelihood of the data outside each subtree, and with it the posterior of each node
+* and, in the same loop over parent and child sizes, the expectations along the branch.
+* This is about twice the work of \ref compute_tree_likelihoods.
+*
+* Sizes range over pcafe->rootfamilysizes at the root and pcafe->familysizes elsewhere, and
+* posteriors[n] holds the distribution of node n from the first size of its range. prior is
+* the prior of the root sizes, uniform if NULL. changes are numbered by branch as in
+* \ref marginal_parameters. Returns the log likelihood of the family, up to the prior.
+*/
+double cafe_tree_marginals(pCafeTree pcafe, const double* prior, std::vector<std::vector<double> >& posteriors, std::vector<expected_change>& changes)
+{
+	pTree ptree = (pTree)pcafe;
+	int nnodes = ptree->nlist->size;
+	int start = pcafe->familysizes[0];
+	int width = pcafe->familysizes[1] - start + 1;
+	int root_start = pcafe->rootfamilysizes[0];
+	// an empty root range, as for a family absent from every species, is taken as its first size
+	int rfsize = MAX(1, pcafe->rootfamilysizes[1] - root_start + 1);
+
+	// inside[n]: likelihood below node n, rescaled; factor[n]: what node n contributes to its parent
+	std::vector<std::vector<double> > inside(nnodes), factor(nnodes), outside(nnodes);
+	double log_scale = 0;
+	pArrayList postfix = ptree->postfix;
+	for (int i = 0; i < postfix->size; i++)
+	{
+		pTreeNode ptnode = (pTreeNode)postfix->array[i];
+		pCafeNode pcnode = (pCafeNode)ptnode;
+		if (tree_is_leaf(ptnode))
+		{
+			leaf_likelihoods(pcafe, pcnode, inside[ptnode->id]);
+			continue;
+		}
+		bool root = tree_is_root(ptree, ptnode);
+		int parent_start = root ? root_start : start;
+		int parent_width = root ? rfsize : width;
+		std::vector<double>& lh = inside[ptnode->id];
+		lh.assign(parent_width, 1);
+		for (int k = 0; k < 2; k++)
+		{
+			pCafeNode child = (pCafeNode)tree_get_child(ptnode, k);
+			struct square_matrix* bd = child->birthdeath_matrix;
+			assert(parent_start + parent_width <= bd->size && start + width <= bd->size);
+			const std::vector<double>& child_lh = inside[((pTreeNode)child)->id];
+			std::vector<double>& f = factor[((pTreeNode)child)->id];
+			f.assign(parent_width, 0);
+			for (int s = 0; s < parent_width; s++)
+			{
+				const double* row = bd->values + (parent_start + s) * bd->size + start;
+				double sum = 0;
+				for (int j = 0; j < width; j++)
+					sum += row[j] * child_lh[j];
+				f[s] = sum;
+				lh[s] *= sum;
+			}
+		}
+		double largest = *std::max_element(lh.begin(), lh.end());
+		if (largest > 0)
+		{
+			log_scale += log(largest);
+			rescale(lh);
+		}
+	}
+
+	pTreeNode proot = ptree->root;
+	std::vector<double>& root_out = outside[proot->id];
+	root_out.assign(rfsize, 1);
+	if (prior)
+		root_out.assign(prior, prior + rfsize);
+	double likelihood = 0;
+	for (int s = 0; s < rfsize; s++)
+		likelihood += root_out[s] * inside[proot->id][s];
+
+	posteriors.assign(nnodes, std::vector<double>());
+	changes.assign(nnodes - 1, expected_change());
+	pArrayList prefix = ptree->prefix;
+	for (int i = 0; i < prefix->size; i++)
+	{
+		pTreeNode ptnode = (pTreeNode)prefix->array[i];
+		int n = ptnode->id;
+
+		std::vector<double>& post = posteriors[n];
+		post.resize(inside[n].size());
+		double total = 0;
+		for (size_t s = 0; s < post.size(); s++)
+		{
+			post[s] = inside[n][s] * outside[n][s];
+			total += post[s];
+		}
+		for (size_t s = 0; s < post.size() && total > 0; s++)
+			post[s] /= total;
+
+		if (tree_is_leaf(ptnode))
+			continue;
+		bool root = tree_is_root(ptree, ptnode);
+		int parent_start = root ? root_start : start;
+		int parent_width = root ? rfsize : width;
+		for (int k = 0; k < 2; k++)
+		{
+			pTreeNode child = (pTreeNode)tree_get_child(ptnode, k);
+			int c = child->id;
+			struct square_matrix* bd = ((pCafeNode)child)->birthdeath_matrix;
+			const std::vector<double>& sibling = factor[((pTreeNode)tree_get_child(ptnode, 1 - k))->id];
+			const std::vector<double>& child_lh = inside[c];
+			std::vector<double>& out = outside[c];
+			out.assign(width, 0);
+			expected_change e;
+			double z = 0;
+			for (int s = 0; s < parent_width; s++)
+			{
+				// everything but the child's subtree, given the parent has this size
+				double rest = outside[n][s] * sibling[s];
+				if (rest == 0)
+					continue;
+				const double* row = bd->values + (parent_start + s) * bd->size + start;
+				for (int j = 0; j < width; j++)
+				{
+					double t = rest * row[j];
+					out[j] += t;
+					double w = t * child_lh[j];
+					if (w == 0)
+						continue;
+					int diff = start + j - parent_start - s;
+					z += w;
+					if (diff > 0)
+					{
+						e.gain += w * diff;
+						e.expand += w;
+					}
+					else if (diff < 0)
+					{
+						e.loss -= w * diff;
+						e.decrease += w;
+					}
+					else
+					{
+						e.remain += w;
+					}
+				}
+			}
+			rescale(out);
+			if (z > 0)
+			{
+				e.gain /= z;
+				e.loss /= z;
+				e.expand /= z;
+				e.remain /= z;
+				e.decrease /= z;
+			}
+			int parent_index = (n - 1) / 2;
+			changes[2 * parent_index + k] = e;
+		}
+	}
+	return log(likelihood) + log_scale;
+}
+
+/* number of families a marginal reconstruction thread takes at once */
+const int MARGINAL_FAMILY_CHUNK = 16;
+
+typedef struct
+{
+	pCafeFamily pfamily;
+	pCafeTree pcafe;
+	marginal_parameters* marginals;
+
+	/* families are handed out MARGINAL_FAMILY_CHUNK at a time from next_family */
+	pthread_mutex_t* lock;
+	int* next_family;
+
+	/* expected changes summed over each chunk of families, added up in order once all threads are done */
+	std::vector<std::vector<expected_change> >* chunk_changes;
+}MarginalParam;
+
+void* __cafe_marginal_thread_func(void* ptr)
+{
+	MarginalParam* pm = (MarginalParam*)ptr;
+	pCafeTree pcafe = cafe_tree_copy(pm->pcafe);
+	int fsize = pm->pfamily->flist->size;
+	std::vector<std::vector<double> > posteriors;
+	std::vector<expected_change> changes;
+	while (true)
+	{
+		pthread_mutex_lock(pm->lock);
+		int from = *pm->next_family;
+		*pm->next_family += MARGINAL_FAMILY_CHUNK;
+		pthread_mutex_unlock(pm->lock);
+		if (from >= fsize) break;
+
+		int to = MIN(from + MARGINAL_FAMILY_CHUNK, fsize);
+		std::vector<expected_change>& sums = (*pm->chunk_changes)[from / MARGINAL_FAMILY_CHUNK];
+		for (int i = from; i < to; i++)
+		{
+			// the same sizes as the Viterbi reconstruction
+			cafe_family_set_size_with_family_forced(pm->pfamily, i, pcafe);
+			cafe_tree_marginals(pcafe, NULL, posteriors, changes);
+			pTree ptree = (pTree)pcafe;
+			for (int n = 0; n < ptree->nlist->size; n++)
+			{
+				int first = tree_is_root(ptree, (pTreeNode)ptree->nlist->array[n]) ? pcafe->rootfamilysizes[0] : pcafe->familysizes[0];
+				double mean = 0;
+				for (size_t s = 0; s < posteriors[n].size(); s++)
+					mean += posteriors[n][s] * (first + s);
+				pm->marginals->expectedNodeFamilysizes[n][i] = mean;
+			}
+			for (size_t m = 0; m < changes.size(); m++)
+				sums[m] += changes[m];
+		}
+	}
+	cafe_tree_free(pcafe);
+	return (NULL);
+}
+
+/**
+* \brief Marginal ancestral reconstruction of every family, as an alternative to \ref cafe_viterbi
+*
+* Each family gets the posterior mean size of every node and the expected change along
+* every branch, with a uniform prior on the root size over the same sizes the Viterbi
+* reconstruction considers. Families are shared out among param->num_threads threads.
+*/
+void cafe_marginals(pCafeParam param, marginal_parameters& marginals)
+{
+	cafe_log(param, "Running marginal reconstruction....\n");
+
+	pTree ptree = (pTree)param->pcafe;
+	int nrows = param->pfamily->flist->size;
+	int nnodes = ptree->nlist->size;
+	marginals.expectedNodeFamilysizes.assign(nnodes, std::vector<double>(nrows));
+	marginals.expectedChanges.assign(nnodes - 1, expected_change());
+	marginals.averageExpansion.assign(nnodes - 1, 0);
+
+	pthread_mutex_t lock;
+	pthread_mutex_init(&lock, NULL);
+	int next_family = 0;
+	int chunks = (nrows + MARGINAL_FAMILY_CHUNK - 1) / MARGINAL_FAMILY_CHUNK;
+	std::vector<std::vector<expected_change> > chunk_changes(chunks, std::vector<expected_change>(nnodes - 1));
+
+	int num_threads = MAX(1, MIN(param->num_threads, chunks));
+	std::vector<MarginalParam> ptparam(num_threads);
+	for (int i = 0; i < num_threads; i++)
+	{
+		ptparam[i].pfamily = param->pfamily;
+		ptparam[i].pcafe = param->pcafe;
+		ptparam[i].marginals = &marginals;
+		ptparam[i].lock = &lock;
+		ptparam[i].next_family = &next_family;
+		ptparam[i].chunk_changes = &chunk_changes;
+	}
+	if (nrows > 0)
+		thread_run(num_threads, __cafe_marginal_thread_func, &ptparam[0], sizeof(MarginalParam));
+	pthread_mutex_destroy(&lock);
+
+	for (int c = 0; c < chunks; c++)
+	{
+		for (int m = 0; m < nnodes - 1; m++)
+			marginals.expectedChanges[m] += chunk_changes[c][m];
+	}
+	for (int m = 0; m < nnodes - 1 && nrows > 0; m++)
+	{
+		marginals.averageExpansion[m] = (marginals.expectedChanges[m].gain - marginals.expectedChanges[m].loss) / nrows;
+	}
+}
+
+/* branch above a node that is not the root, numbered as in marginal_parameters */
+static int branch_index(pTreeNode ptnode)
+{
+	pTreeNode parent = ptnode->parent;
+	return 2 * ((parent->id - 1) / 2) + (tree_get_child(parent, 0) == ptnode ? 0 : 1);
+}
+
+/**
+* \brief Writes a node as write_family_gainloss does, with posterior expectations
+*
+* For a family i each node gets its mean size and the expected change above it; for i < 0
+* each node gets the expected gains, losses and change above it summed over families.
+*/
+static void write_marginal_node(std::ostream& ost, pTreeNode ptnode, const marginal_parameters& marginals, int i)
+{
+	pPhylogenyNode pnode = (pPhylogenyNode)ptnode;
+	if (!tree_is_leaf(ptnode))
+	{
+		ost << "(";
+		write_marginal_node(ost, (pTreeNode)tree_get_child(ptnode, 0), marginals, i);
+		ost << ",";
+		write_marginal_node(ost, (pTreeNode)tree_get_child(ptnode, 1), marginals, i);
+		ost << ")";
+	}
+	if (pnode->name)
+		ost << pnode->name;
+	if (i >= 0)
+	{
+		const std::vector<std::vector<double> >& sizes = marginals.expectedNodeFamilysizes;
+		ost << "_" << sizes[ptnode->id][i];
+		if (ptnode->parent)
+			ost << "<" << sizes[ptnode->id][i] - sizes[ptnode->parent->id][i] << ">";
+	}
+	else if (ptnode->parent)
+	{
+		const expected_change& e = marginals.expectedChanges[branch_index(ptnode)];
+		ost << "<" << e.gain << "/" << -e.loss << "/" << e.gain - e.loss << ">";
+	}
+	else
+	{
+		ost << "<0/0/0>";
+	}
+	if (pnode->branchlength >= 0)
+		ost << ":" << pnode->branchlength;
+}
+
+/**
+* \brief Writes the gains and losses of every family in the format of the gainloss command
+*
+* Each family's line has its expected net change and the tree with the posterior mean
+* size of each node; the last line has the expected gains, losses and net change along
+* each branch summed over families.
+*/
+void write_marginal_gainloss(std::ostream& ost, pCafeParam param, const marginal_parameters& marginals)
+{
+	pTree ptree = (pTree)param->pcafe;
+	pTreeNode proot = ptree->root;
+	double total = 0;
+	for (int i = 0; i < param->pfamily->flist->size; i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[i];
+		double sum = 0;
+		for (int n = 0; n < ptree->nlist->size; n++)
+		{
+			pTreeNode ptnode = (pTreeNode)ptree->nlist->array[n];
+			if (ptnode != proot)
+				sum += marginals.expectedNodeFamilysizes[n][i] - marginals.expectedNodeFamilysizes[ptnode->parent->id][i];
+		}
+		total += sum;
+		ost << pitem->id << "\t" << sum << "\t";
+		write_marginal_node(ost, proot, marginals, i);
+		ost << "\n";
+	}
+	ost << "SUM\t" << total << "\t";
+	write_marginal_node(ost, proot, marginals, -1);
+	ost << "\n";
+}
@@ -0,0 +1,57 @@
+#ifndef MARGINAL_H_5E0C2B1D_7F4A_4C8E_9B36_2D1A6F83C7E4
+#define MARGINAL_H_5E0C2B1D_7F4A_4C8E_9B36_2D1A6F83C7E4
+
+#include <vector>
+#include <ostream>
+
+extern "C"
+{
+#include <family.h>
+}
+
+/**
+* \brief Posterior expectations of the change along a branch, from the parent size to the child size
+*
+* gain and loss are the expected number of genes gained and lost; expand, remain and
+* decrease are the probabilities that the child is larger than, the same as or smaller
+* than the parent. Summed over families they take the place of the Viterbi counts.
+*/
+struct expected_change
+{
+	double gain;
+	double loss;
+	double expand;
+	double remain;
+	double decrease;
+
+	expected_change() : gain(0), loss(0), expand(0), remain(0), decrease(0)
+	{
+
+	}
+	expected_change& operator+=(const expected_change& other);
+};
+
+/**
+* \brief Marginal ancestral reconstruction of every family
+*
+* Branches are numbered as in \ref viterbi_parameters: 2 * j + k is the branch to child k
+* of the internal node nlist[2 * j + 1].
+*/
+class marginal_parameters
+{
+public:
+	/** Posterior mean size of each node of the tree, by node ID, for each family */
+	std::vector<std::vector<double> > expectedNodeFamilysizes;
+
+	/** Expected change along each branch summed over families */
+	std::vector<expected_change> expectedChanges;
+
+	/** Expected change of size along each branch averaged over families */
+	std::vector<double> averageExpansion;
+};
+
+double cafe_tree_marginals(pCafeTree pcafe, const double* prior, std::vector<std::vector<double> >& posteriors, std::vector<expected_change>& changes);
+void cafe_marginals(pCafeParam param, marginal_parameters& marginals);
+void write_marginal_gainloss(std::ostream& ost, pCafeParam param, const marginal_parameters& marginals);
+
+#endif
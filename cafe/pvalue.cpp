@@ -16,6 +16,8 @@ extern "C" {
 }
 
 std::vector<std::vector<double> > ConditionalDistribution::matrix;
+uint64_t ConditionalDistribution::key = 0;
+mapped_conditional_distribution ConditionalDistribution::mapped = { NULL, 0, 0, 0, 0, NULL };
 //pArrayList ConditionalDistribution::cafe_pCD;
 
 void check_cache_and_compute_likelihoods(pCafeTree pTree, int max)
@@ -65,26 +67,25 @@ void print_pvalues(std::ostream& ost, pCafeTree pcafe, int max, int num_random_s
 	string_free(pstr);
 }
 
-void write_pvalues(std::ostream& ost, pArrayList values, int count)
+/* text export of a distribution; 17 significant digits read back to the same doubles */
+void write_pvalues(std::ostream& ost, const matrix& values)
 {
-	ost << std::setw(10) << std::setprecision(9);
-	for (int i = 0; i < values->size; i++)
+	ost << std::setprecision(17);
+	for (size_t i = 0; i < values.size(); i++)
 	{
-		double* data = (double*)values->array[i];
-		ost << data[0];
-		for (int j = 1; j < count; j++)
+		for (size_t j = 0; j < values[i].size(); j++)
 		{
-			ost << "\t" << data[j];
+			if (j > 0) ost << "\t";
+			ost << values[i][j];
 		}
 		ost << "\n";
 	}
-
 }
 
 
 void read_pvalues(std::istream& ist, int count)
 {
-	ConditionalDistribution::matrix.clear();
+	ConditionalDistribution::clear();
 
 	std::string str;
 	while (std::getline(ist, str))
@@ -93,13 +94,15 @@ void read_pvalues(std::istream& ist, int count)
 		std::istringstream iss(str);
 		for (int i = 0; i < count; ++i)
 			iss >> data[i];
+		// files from older versions were written in descending order
+		std::sort(data.begin(), data.end());
 		ConditionalDistribution::matrix.push_back(data);
 	}
 }
 
 void pvalues_for_family(pCafeTree pTree, pCafeFamily family, family_size_range *range, int numthreads, int num_random_samples, int index)
 {
-	if (ConditionalDistribution::matrix.empty())
+	if (ConditionalDistribution::empty())
 	{
 		ConditionalDistribution::reset(pTree, range, numthreads, num_random_samples);
 	}
@@ -114,7 +117,7 @@ void pvalues_for_family(pCafeTree pTree, pCafeFamily family, family_size_range *
 
 	for (int s = 0; s < pTree->rfsize; s++)
 	{
-		pvalues[s] = pvalue(lh[s], &ConditionalDistribution::matrix[s][0], num_random_samples);
+		pvalues[s] = pvalue(lh[s], ConditionalDistribution::row(s), num_random_samples);
 	}
 
 	for (int i = 0; i < pTree->rfsize; i++)
@@ -123,15 +126,302 @@ void pvalues_for_family(pCafeTree pTree, pCafeFamily family, family_size_range *
 	}
 }
 
+typedef struct
+{
+	pCafeTree pcafe;
+	pCafeFamily pfamily;
+	int num_random_samples;
+	int from;
+	int num_threads;
+	std::vector<family_pvalue>* values;
+}FamilyPvalueParam;
+
+void* __pvalues_for_all_families_thread_func(void* ptr)
+{
+	FamilyPvalueParam* param = (FamilyPvalueParam*)ptr;
+	pCafeTree pcafe = cafe_tree_copy(param->pcafe);
+	pCafeFamily pfamily = param->pfamily;
+	int rows = ConditionalDistribution::rows();
+	for (int i = param->from; i < pfamily->flist->size; i += param->num_threads)
+	{
+		// families with the same sizes as an earlier one are copied afterwards
+		pCafeFamilyItem pitem = (pCafeFamilyItem)pfamily->flist->array[i];
+		if (pitem->ref >= 0 && pitem->ref != i) continue;
+
+		cafe_family_set_size_with_family_forced(pfamily, i, pcafe);
+		compute_tree_likelihoods(pcafe);
+		double* lh = get_likelihoods(pcafe);
+		int rfsize = MIN(pcafe->rfsize, rows);
+
+		family_pvalue& result = (*param->values)[i];
+		result.root_size = __maxidx(lh, pcafe->rfsize) + pcafe->rootfamilysizes[0];
+		result.max_pvalue = 0;
+		for (int s = 0; s < rfsize; s++)
+		{
+			result.max_pvalue = MAX(result.max_pvalue, pvalue(lh[s], ConditionalDistribution::row(s), param->num_random_samples));
+		}
+	}
+	cafe_tree_free(pcafe);
+	return (NULL);
+}
+
+/**
+* \brief P-values of every family against the current conditional distribution
+*
+* Families are split over numthreads threads, and families whose sizes repeat an
+* earlier one (see CafeFamilyItem::ref) take that family's result instead of being
+* computed again.
+*/
+std::vector<family_pvalue> pvalues_for_all_families(pCafeTree pcafe, pCafeFamily pfamily, int numthreads, int num_random_samples)
+{
+	int nrows = pfamily->flist->size;
+	std::vector<family_pvalue> values(nrows);
+
+	numthreads = MAX(1, MIN(numthreads, nrows));
+	std::vector<FamilyPvalueParam> ptparam(numthreads);
+	for (int i = 0; i < numthreads; i++)
+	{
+		ptparam[i].pcafe = pcafe;
+		ptparam[i].pfamily = pfamily;
+		ptparam[i].num_random_samples = num_random_samples;
+		ptparam[i].from = i;
+		ptparam[i].num_threads = numthreads;
+		ptparam[i].values = &values;
+	}
+	if (nrows > 0)
+		thread_run(numthreads, __pvalues_for_all_families_thread_func, &ptparam[0], sizeof(FamilyPvalueParam));
+
+	for (int i = 0; i < nrows; i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)pfamily->flist->array[i];
+		if (pitem->ref >= 0 && pitem->ref != i)
+			values[i] = values[pitem->ref];
+	}
+	return values;
+}
+
+void write_family_pvalues(std::ostream& ost, pCafeFamily pfamily, const std::vector<family_pvalue>& values)
+{
+	ost << "Family ID\tRoot size\tMax p-value\n";
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)pfamily->flist->array[i];
+		ost << pitem->id << "\t" << values[i].root_size << "\t" << values[i].max_pvalue << "\n";
+	}
+}
+
+bool ConditionalDistribution::empty()
+{
+	return rows() == 0;
+}
+
+int ConditionalDistribution::rows()
+{
+	return mapped.data ? mapped.rows : (int)matrix.size();
+}
+
+const double* ConditionalDistribution::row(int s)
+{
+	return mapped.data ? mapped.data + (size_t)s * mapped.cols : &matrix[s][0];
+}
+
+/**
+* \brief True if the rows were simulated for the given tree, rates, range and number of samples
+*
+* Text files carry no key, so a distribution read from one never matches.
+*/
+bool ConditionalDistribution::simulated_for(pCafeTree pTree, family_size_range *range, int num_random_samples)
+{
+	return !empty() && key != 0 && key == conditional_distribution_key(pTree, range, num_random_samples);
+}
+
+void ConditionalDistribution::clear()
+{
+	unmap_conditional_distribution(mapped);
+	matrix.clear();
+	key = 0;
+}
+
+/**
+* \brief Uses the rows of a binary p-value file in place; returns false if file is not one
+*/
+bool ConditionalDistribution::map(const std::string& file)
+{
+	mapped_conditional_distribution m;
+	if (!map_conditional_distribution(file, m))
+		return false;
+	clear();
+	mapped = m;
+	key = m.key;
+	return true;
+}
+
 void ConditionalDistribution::reset(pCafeTree pTree, family_size_range * range, int numthreads, int num_random_samples)
 {
+	clear();
 	matrix = cafe_conditional_distribution(pTree, range, numthreads, num_random_samples);
+	key = conditional_distribution_key(pTree, range, num_random_samples);
 }
 
 pArrayList ConditionalDistribution::to_arraylist()
 {
 	pArrayList result = arraylist_new(1000);
-	for (size_t i = 0; i < matrix.size(); ++i)
-		arraylist_add(result, &matrix[i][0]);
+	for (int i = 0; i < rows(); ++i)
+		arraylist_add(result, (void*)row(i));
 	return result;
-}
\ No newline at end of file
+}
+/**************************************************************************
+* Sequential p-values
+**************************************************************************/
+sequential_distribution::sequential_distribution(pCafeTree pcafe, family_size_range *range, int num_threads, int max_samples)
+	: pcafe(pcafe), range(*range), num_threads(num_threads)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_mutex_init(&build_lock, NULL);
+	random_stream_init(&stream, unifrnd_split(), 0);
+	for (int n = SEQUENTIAL_PVALUE_BLOCK; ; n *= 2)
+	{
+		sizes.push_back(MIN(n, max_samples));
+		if (n >= max_samples) break;
+	}
+	// references handed out by level() must stay valid as levels are added
+	levels.reserve(sizes.size());
+}
+
+sequential_distribution::~sequential_distribution()
+{
+	pthread_mutex_destroy(&lock);
+	pthread_mutex_destroy(&build_lock);
+}
+
+size_t sequential_distribution::levels_built()
+{
+	pthread_mutex_lock(&lock);
+	size_t result = levels.size();
+	pthread_mutex_unlock(&lock);
+	return result;
+}
+
+/**
+* \brief Samples of level k, simulating it and any level below it that is still missing
+*
+* Only one thread simulates at a time, and it does not hold lock while doing so, so
+* threads asking for levels that already exist get them at once.
+*/
+const std::vector<std::vector<double> >& sequential_distribution::level(int k)
+{
+	if ((int)levels_built() <= k)
+	{
+		pthread_mutex_lock(&build_lock);
+		build_levels(k);
+		pthread_mutex_unlock(&build_lock);
+	}
+	pthread_mutex_lock(&lock);
+	const matrix& result = levels[k];
+	pthread_mutex_unlock(&lock);
+	return result;
+}
+
+/* simulates the levels up to k that another thread has not built already; called with build_lock held */
+void sequential_distribution::build_levels(int k)
+{
+	for (size_t prev = levels_built(); (int)prev <= k; prev++)
+	{
+		int count = sizes[prev] - (prev ? sizes[prev - 1] : 0);
+		// draw from our own stream so the samples do not depend on which thread asked first
+		pRandomStream old = unifrnd_set_stream(&stream);
+		matrix more = cafe_conditional_distribution_uncached(pcafe, &range, num_threads, count);
+		unifrnd_set_stream(old);
+		if (prev > 0)
+		{
+			for (size_t s = 0; s < more.size(); s++)
+			{
+				std::vector<double> merged(sizes[prev]);
+				std::merge(levels[prev - 1][s].begin(), levels[prev - 1][s].end(), more[s].begin(), more[s].end(), merged.begin());
+				more[s].swap(merged);
+			}
+		}
+		pthread_mutex_lock(&lock);
+		levels.push_back(matrix());
+		levels.back().swap(more);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/**
+* \brief Wilson score interval for a proportion p observed in n trials
+*/
+void wilson_interval(double p, int n, double z, double* lower, double* upper)
+{
+	double z2 = z * z;
+	double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+	double half = z * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n)) / (1 + z2 / n);
+	*lower = MAX(0, center - half);
+	*upper = MIN(1, center + half);
+}
+
+/**
+* \brief Estimates the p-value of every root size with as few samples as it takes to place it against threshold
+*
+* All root sizes start with the first block of samples. Those whose confidence bound
+* still straddles threshold move on to the next, larger level until it lies entirely
+* above or below, or all samples are used. Once any root size is clearly above
+* threshold the family is not significant and the others keep their current estimate.
+* Returns the family-wide (largest) p-value with its Monte Carlo error and the most
+* samples used for any root size. The error is the distance from the estimate to the
+* far end of its Wilson interval, so a p-value of 0 still reports the upper bound.
+*/
+sequential_pvalue sequential_pvalues(sequential_distribution& distribution, const double* lh, int rfsize, double threshold, double* pvalues)
+{
+	std::vector<int> samples(rfsize);
+	std::vector<double> errors(rfsize);
+	std::vector<bool> open(rfsize, true);
+	bool above = false;
+	for (int k = 0, remaining = rfsize; k < distribution.num_levels() && remaining > 0 && !above; k++)
+	{
+		const matrix& cd = distribution.level(k);
+		for (int s = 0; s < rfsize; s++)
+		{
+			if (!open[s]) continue;
+			int n = cd[s].size();
+			pvalues[s] = pvalue(lh[s], &cd[s][0], n);
+			samples[s] = n;
+			double lower, upper;
+			wilson_interval(pvalues[s], n, SEQUENTIAL_PVALUE_Z, &lower, &upper);
+			errors[s] = MAX(upper - pvalues[s], pvalues[s] - lower);
+			if (upper < threshold || lower > threshold)
+			{
+				open[s] = false;
+				remaining--;
+			}
+			above = above || lower > threshold;
+		}
+	}
+
+	sequential_pvalue result;
+	result.max_pvalue = 0;
+	result.error = 0;
+	result.samples = 0;
+	for (int s = 0; s < rfsize; s++)
+	{
+		if (s == 0 || pvalues[s] > result.max_pvalue)
+		{
+			result.max_pvalue = pvalues[s];
+			result.error = errors[s];
+		}
+		result.samples = MAX(result.samples, samples[s]);
+	}
+	return result;
+}
+
+importance_distribution::importance_distribution(pCafeTree pcafe, family_size_range *range, int num_threads, int num_samples, double lambda_factor)
+{
+	likelihoods = cafe_weighted_conditional_distribution(pcafe, range, num_threads, num_samples, lambda_factor, cumulative);
+}
+
+double importance_distribution::pvalue(int s, double lh) const
+{
+	if (s < 0 || s >= (int)likelihoods.size())
+		return 0;
+	return weighted_pvalue(lh, likelihoods[s], cumulative[s]);
+}
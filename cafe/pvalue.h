@@ -3,23 +3,116 @@
 
 #include <iosfwd>
 #include <vector>
+#include <string>
+#include <pthread.h>
 
 extern "C" {
 #include <family.h>
+#include <mathfunc.h>
 }
 
+#include "conditional_distribution.h"
+
 void check_cache_and_compute_likelihoods(pCafeTree pTree, int max);
 void print_pvalues(std::ostream& ost, pCafeTree pcafe, int max, int num_random_samples);
 void read_pvalues(std::istream& ist, int count);
-void write_pvalues(std::ostream& ost, pArrayList values, int count);
+void write_pvalues(std::ostream& ost, const matrix& values);
 void pvalues_for_family(pCafeTree pTree, pCafeFamily family, family_size_range *range, int numthreads, int num_random_samples, int index);
 
+/* p-value of one family against the conditional distribution */
+struct family_pvalue
+{
+	int root_size;		/* root size with the maximum likelihood */
+	double max_pvalue;	/* largest p-value over the root sizes, as in the report */
+};
+
+std::vector<family_pvalue> pvalues_for_all_families(pCafeTree pcafe, pCafeFamily pfamily, int numthreads, int num_random_samples);
+void write_family_pvalues(std::ostream& ost, pCafeFamily pfamily, const std::vector<family_pvalue>& values);
+
 class ConditionalDistribution
 {
 public:
 	static std::vector<std::vector<double> > matrix;
+	/* rows of a binary p-value file, used in place of matrix while mapped */
+	static mapped_conditional_distribution mapped;
+	/* conditional_distribution_key of the parameters the rows were simulated under, 0 if unknown */
+	static uint64_t key;
+	static bool empty();
+	static bool simulated_for(pCafeTree pTree, family_size_range *range, int num_random_samples);
+	static int rows();
+	static const double* row(int s);
+	static void clear();
+	static bool map(const std::string& file);
 	static void reset(pCafeTree pTree, family_size_range *range, int numthreads, int num_random_samples);
 	static pArrayList to_arraylist();
 };
 
+/* samples in the first block of a sequential p-value, doubled for each further block */
+const int SEQUENTIAL_PVALUE_BLOCK = 100;
+/* a sequential p-value uses at most this many times num_random_samples */
+const int SEQUENTIAL_PVALUE_MAX_FACTOR = 10;
+/* z score of the confidence bound that decides when to stop, 99% two-sided */
+const double SEQUENTIAL_PVALUE_Z = 2.576;
+
+/**
+* \brief Conditional distributions that are extended in blocks as more precise p-values are asked for
+*
+* Level k holds SEQUENTIAL_PVALUE_BLOCK << k samples for each root size, sorted in
+* ascending order, capped at max_samples. Levels are simulated the first time they
+* are needed and are safe to request from several threads.
+*/
+class sequential_distribution
+{
+	pCafeTree pcafe;
+	family_size_range range;
+	int num_threads;
+	RandomStream stream;
+	/* guards the size of levels */
+	pthread_mutex_t lock;
+	/* held while a level is simulated, so readers of existing levels are not held up */
+	pthread_mutex_t build_lock;
+	std::vector<int> sizes;
+	std::vector<std::vector<std::vector<double> > > levels;
+
+	size_t levels_built();
+	void build_levels(int k);
+public:
+	sequential_distribution(pCafeTree pcafe, family_size_range *range, int num_threads, int max_samples);
+	~sequential_distribution();
+
+	int num_levels() const { return sizes.size(); }
+	const std::vector<std::vector<double> >& level(int k);
+};
+
+/* lambda and mu are multiplied by this to simulate families for importance-sampled p-values */
+const double IMPORTANCE_LAMBDA_FACTOR = 2.0;
+
+/**
+* \brief Conditional distributions simulated with inflated birth and death rates and reweighted
+*
+* Families simulated with higher rates vary more, so many more of them land in the lower tail
+* of the likelihood; weighting each by its likelihood ratio keeps the estimate unbiased while
+* resolving p-values far smaller than 1/num_samples.
+*/
+class importance_distribution
+{
+	matrix likelihoods;
+	matrix cumulative;
+public:
+	importance_distribution(pCafeTree pcafe, family_size_range *range, int num_threads, int num_samples, double lambda_factor);
+
+	/* p-value of lh at the s'th root size of the range; root sizes outside it count as 0 */
+	double pvalue(int s, double lh) const;
+};
+
+struct sequential_pvalue
+{
+	double max_pvalue;
+	double error;
+	int samples;
+};
+
+void wilson_interval(double p, int n, double z, double* lower, double* upper);
+sequential_pvalue sequential_pvalues(sequential_distribution& distribution, const double* lh, int rfsize, double threshold, double* pvalues);
+
 #endif
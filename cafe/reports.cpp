@@ -83,15 +83,58 @@ void write_viterbi(ostream& ost, const Report& viterbi)
 		ost << "\t(" << viterbi.changes[2 * b].decrease << "," << viterbi.changes[2 * b + 1].decrease << ")";
 	}
 	ost << "\n";
+
+	if (viterbi.expectedChanges.empty())
+		return;
+
+	ost << "Expected Average Expansion:";
+	for (size_t b = 0; b < viterbi.expectedExpansion.size() / 2; b++)
+	{
+		ost << "\t(" << viterbi.expectedExpansion[2 * b] << "," << viterbi.expectedExpansion[2 * b + 1] << ")";
+	}
+	ost << "\n";
+	const vector<expected_change>& e = viterbi.expectedChanges;
+	ost << "Expected Expansion :";
+	for (size_t b = 0; b < e.size() / 2; b++)
+	{
+		ost << "\t(" << e[2 * b].expand << "," << e[2 * b + 1].expand << ")";
+	}
+	ost << "\n";
+	ost << "Expected nRemain :";
+	for (size_t b = 0; b < e.size() / 2; b++)
+	{
+		ost << "\t(" << e[2 * b].remain << "," << e[2 * b + 1].remain << ")";
+	}
+	ost << "\n";
+	ost << "Expected nDecrease :";
+	for (size_t b = 0; b < e.size() / 2; b++)
+	{
+		ost << "\t(" << e[2 * b].decrease << "," << e[2 * b + 1].decrease << ")";
+	}
+	ost << "\n";
+	ost << "Expected Gains :";
+	for (size_t b = 0; b < e.size() / 2; b++)
+	{
+		ost << "\t(" << e[2 * b].gain << "," << e[2 * b + 1].gain << ")";
+	}
+	ost << "\n";
+	ost << "Expected Losses :";
+	for (size_t b = 0; b < e.size() / 2; b++)
+	{
+		ost << "\t(" << e[2 * b].loss << "," << e[2 * b + 1].loss << ")";
+	}
+	ost << "\n";
 }
 
-void write_families_header(ostream& ost, bool cutPvalues, bool likelihoodRatios)
+void write_families_header(ostream& ost, bool cutPvalues, bool likelihoodRatios, bool errors)
 {
 	ost << "'ID'\t'Newick'\t'Family-wide P-value'\t'Viterbi P-values'";
 	if (cutPvalues)
 		ost << "\t'cut P-value'";
 	if (likelihoodRatios)
 		ost << "\t'Likelihood Ratio'";
+	if (errors)
+		ost << "\t'Monte Carlo error'\t'Samples'";
 	ost << "\n";
 }
 
@@ -125,6 +168,8 @@ family_line_item::family_line_item(pCafeFamily family, pCafeTree pcafe, double**
 	tree = pstr->buf;
 	string_free(pstr);
 	max_p_value = viterbi.maximumPvalues[i];
+	max_p_value_error = viterbi.maximumPvalueErrors.empty() ? 0.0 : viterbi.maximumPvalueErrors[i];
+	samples = viterbi.pvalueSamples.empty() ? -1 : viterbi.pvalueSamples[i];
 	for (int b = 0; b < viterbi.num_nodes / 2; b++)
 	{
 		pvalues.push_back(std::pair<double, double>(viterbi.viterbiPvalues[2 * b][i], viterbi.viterbiPvalues[2 * b + 1][i]));
@@ -179,6 +224,13 @@ std::ostream& operator<<(std::ostream& ost, const family_line_item& item)
 	if (!item.likelihood_ratios.empty())
 	{
 		write_doubles(ost, item.likelihood_ratios);
+		if (item.samples >= 0)
+			ost << "\t";
+	}
+
+	if (item.samples >= 0)
+	{
+		ost << item.max_p_value_error << "\t" << item.samples;
 	}
 
 	return ost;
@@ -293,6 +345,9 @@ std::ostream& operator<<(ostream& ost, const HtmlReport& report)
 		ost << "<th>cut P-value</th>";
 	if (has_likelihoods)
 		ost << "<th>Likelihood Ratio</th>";
+	bool has_errors = !r.family_line_items.empty() && r.family_line_items[0].samples >= 0;
+	if (has_errors)
+		ost << "<th>Monte Carlo error</th><th>Samples</th>";
 	ost << "</tr>";
 
 	for (size_t i = 0; i < r.family_line_items.size(); ++i)
@@ -328,6 +383,10 @@ std::ostream& operator<<(ostream& ost, const HtmlReport& report)
 			write_doubles(ost, item.likelihood_ratios);
 			ost << "</td>";
 		}
+		if (item.samples >= 0)
+		{
+			ost << "<td>" << item.max_p_value_error << "</td><td>" << item.samples << "</td>";
+		}
 		ost << "</tr>";
 	}
 	ost << "</table>";
@@ -377,7 +436,8 @@ std::ostream& operator<<(ostream& ost, const Report& report)
 
 	bool has_pvalues = !report.family_line_items.empty() && report.family_line_items[0].cut_pvalues.empty();
 	bool has_likelihoods = !report.family_line_items.empty() && report.family_line_items[0].likelihood_ratios.empty();
-	write_families_header(ost, has_pvalues, has_likelihoods);
+	bool has_errors = !report.family_line_items.empty() && report.family_line_items[0].samples >= 0;
+	write_families_header(ost, has_pvalues, has_likelihoods, has_errors);
 
 	copy(report.family_line_items.begin(), report.family_line_items.end(), ostream_iterator<family_line_item>(ost, "\n"));
 
@@ -393,12 +453,19 @@ report_parameters get_report_parameters(std::vector<std::string> tokens)
 	params.likelihood = false;
 	params.lh2 = false;
 	params.just_save = false;
+	params.html = false;
+	params.sequential = false;
+	params.importance = false;
+	params.marginal = false;
 	for (size_t i = 2; i < tokens.size(); i++)
 	{
 		if (strcasecmp(tokens[i].c_str(), "html") == 0) params.html = true;
 		if (strcasecmp(tokens[i].c_str(), "branchcutting") == 0) params.branchcutting = true;
 		if (strcasecmp(tokens[i].c_str(), "likelihood") == 0) params.likelihood = true;
 		if (strcasecmp(tokens[i].c_str(), "lh2") == 0) params.lh2 = true;
+		if (strcasecmp(tokens[i].c_str(), "sequential") == 0) params.sequential = true;
+		if (strcasecmp(tokens[i].c_str(), "importance") == 0) params.importance = true;
+		if (strcasecmp(tokens[i].c_str(), "marginal") == 0) params.marginal = true;
 		if (strcasecmp(tokens[i].c_str(), "save") == 0)
 		{
 			params.branchcutting = false;
@@ -413,6 +480,27 @@ report_parameters get_report_parameters(std::vector<std::string> tokens)
 }
 
 
+static void report_viterbi(pCafeParam param, viterbi_parameters& viterbi, sequential_distribution* sequential, importance_distribution* importance)
+{
+	if (sequential || importance)
+	{
+		cafe_viterbi(param, viterbi, NULL, sequential, importance);
+		return;
+	}
+	pArrayList cd = ConditionalDistribution::to_arraylist();
+	cafe_viterbi(param, viterbi, cd);
+	arraylist_free(cd, NULL);
+}
+
+/* adds the posterior expectations of the marginal reconstruction to the report */
+static void report_marginals(pCafeParam param, Report& r)
+{
+	marginal_parameters marginals;
+	cafe_marginals(param, marginals);
+	r.expectedExpansion = marginals.averageExpansion;
+	r.expectedChanges = marginals.expectedChanges;
+}
+
 void cafe_do_report(pCafeParam param, viterbi_parameters& viterbi, report_parameters* params)
 {
 	if (!params->just_save)
@@ -430,7 +518,45 @@ void cafe_do_report(pCafeParam param, viterbi_parameters& viterbi, report_parame
 		throw std::runtime_error(string("ERROR(report) : Cannot open ") + params->name + " in write mode.\n");
 	}
 
-	if (ConditionalDistribution::matrix.empty())
+	int method = params->sequential ? VITERBI_PVALUES_SEQUENTIAL : params->importance ? VITERBI_PVALUES_IMPORTANCE : VITERBI_PVALUES_FIXED;
+	bool stored = false;
+	// stored results are keyed on the parameters, so they only stand for a distribution simulated under them
+	bool use_store = false;
+	if (!params->just_save && !params->lh2)
+	{
+		param->param_set_func(param, param->parameters);
+		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
+		use_store = method != VITERBI_PVALUES_FIXED || ConditionalDistribution::empty() ||
+			ConditionalDistribution::simulated_for(param->pcafe, &param->family_size, param->num_random_samples);
+		if (use_store)
+			stored = load_viterbi_results(param, method, viterbi);
+		// cut p-values saved by an earlier branch cutting report are not part of this one
+		if (stored && !params->branchcutting && viterbi.cutPvalues)
+		{
+			memory_free_2dim((void**)viterbi.cutPvalues, viterbi.num_nodes + 1, 0, NULL);
+			viterbi.cutPvalues = NULL;
+		}
+	}
+
+	sequential_distribution* sequential = NULL;
+	importance_distribution* importance = NULL;
+	if (stored)
+	{
+		// nothing to simulate
+	}
+	else if (params->sequential && !params->just_save)
+	{
+		param->param_set_func(param, param->parameters);
+		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
+		sequential = new sequential_distribution(param->pcafe, &param->family_size, param->num_threads, param->num_random_samples * SEQUENTIAL_PVALUE_MAX_FACTOR);
+	}
+	else if (params->importance && !params->just_save)
+	{
+		param->param_set_func(param, param->parameters);
+		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
+		importance = new importance_distribution(param->pcafe, &param->family_size, param->num_threads, param->num_random_samples, IMPORTANCE_LAMBDA_FACTOR);
+	}
+	else if (ConditionalDistribution::empty())
 	{
 		param->param_set_func(param, param->parameters);
 		reset_birthdeath_cache(param->pcafe, param->parameterized_k_value, &param->family_size);
@@ -439,18 +565,24 @@ void cafe_do_report(pCafeParam param, viterbi_parameters& viterbi, report_parame
 
 	if (params->branchcutting || params->likelihood)
 	{
-		pArrayList cd = ConditionalDistribution::to_arraylist();
-		cafe_viterbi(param, viterbi, cd);
-		arraylist_free(cd, NULL);
+		if (!stored)
+			report_viterbi(param, viterbi, sequential, importance);
 		
-		if (params->branchcutting) 
+		if (params->branchcutting && viterbi.cutPvalues == NULL)
+		{
 			cafe_branch_cutting(param, viterbi);
+			stored = false;
+		}
+		if (use_store && !stored)
+			save_viterbi_results(param, method, viterbi);
 		
 		if (params->likelihood) 
 			cafe_likelihood_ratio_test(param, viterbi.maximumPvalues);
 		
 		cafe_log(param, "Building Text report: %s\n", params->name.c_str());
 		Report r(param, viterbi);
+		if (params->marginal)
+			report_marginals(param, r);
 		if (params->html)
 		{
 			HtmlReport hr(r);
@@ -467,13 +599,15 @@ void cafe_do_report(pCafeParam param, viterbi_parameters& viterbi, report_parame
 	}
 	else
 	{
-		if (!params->just_save)
+		if (!params->just_save && !stored)
 		{
-			pArrayList cd = ConditionalDistribution::to_arraylist();
-			cafe_viterbi(param, viterbi, cd);
-			arraylist_free(cd, NULL);
+			report_viterbi(param, viterbi, sequential, importance);
+			if (use_store)
+				save_viterbi_results(param, method, viterbi);
 		}
 		Report r(param, viterbi);
+		if (params->marginal && !params->just_save)
+			report_marginals(param, r);
 		if (params->html)
 		{
 			HtmlReport hr(r);
@@ -501,6 +635,8 @@ void cafe_do_report(pCafeParam param, viterbi_parameters& viterbi, report_parame
 	fprintf(fhttp, "</table>\n</body>\n</html>\n");
 	fclose(fhttp);
 #endif
+	delete sequential;
+	delete importance;
 	cafe_log(param, "Report Done\n");
 
 }
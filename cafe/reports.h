@@ -10,6 +10,7 @@ extern "C" {
 }
 
 #include "viterbi.h"
+#include "marginal.h"
 
 struct report_parameters
 {
@@ -18,6 +19,9 @@ struct report_parameters
 	bool lh2; 
 	bool just_save;
 	bool html;
+	bool sequential;
+	bool importance;
+	bool marginal;
 	std::string name;
 };
 
@@ -32,9 +36,12 @@ struct family_line_item
 	std::vector<std::pair<double, double> > pvalues;
 	std::vector<double> cut_pvalues;
 	std::vector<double> likelihood_ratios;
+	/* Monte Carlo error of max_p_value and the samples it used; samples is -1 for fixed-size p-values */
+	double max_p_value_error;
+	int samples;
 
 	family_line_item(pCafeFamily family, pCafeTree pcafe, double** likelihoodRatios, viterbi_parameters& viterbi, int i, std::string node_id);
-	family_line_item() : max_p_value(0.0) {}
+	family_line_item() : max_p_value(0.0), max_p_value_error(0.0), samples(-1) {}
 };
 
 struct Report
@@ -45,6 +52,9 @@ struct Report
 	std::vector<double> lambdas;
 	std::vector<double> averageExpansion;
 	std::vector<change> changes;
+	/** posterior expectations from \ref cafe_marginals, empty unless asked for */
+	std::vector<double> expectedExpansion;
+	std::vector<expected_change> expectedChanges;
 	std::vector<std::pair<int, int> > node_pairs;
 	std::vector<family_line_item> family_line_items;
 	std::vector<int> branch_cutting_output_format;
@@ -65,7 +75,7 @@ struct HtmlReport
 report_parameters get_report_parameters(std::vector<std::string> tokens);
 int cafe_cmd_report(Globals& globals, std::vector<std::string> tokens);
 void write_viterbi(std::ostream& ost, const Report& viterbi);
-void write_families_header(std::ostream& ost, bool cutPvalues, bool likelihoodRatios);
+void write_families_header(std::ostream& ost, bool cutPvalues, bool likelihoodRatios, bool errors = false);
 void cafe_do_report(pCafeParam param, viterbi_parameters& viterbi, report_parameters* params);
 int cafe_report_retrieve_data(const char* file, pCafeParam param, viterbi_parameters& viterbi);
 
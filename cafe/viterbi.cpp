@@ -1,4 +1,10 @@
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+
 #include "viterbi.h"
+#include "pvalue.h"
+#include "conditional_distribution.h"
 
 extern "C" {
 #include <family.h>
@@ -17,6 +23,8 @@ void viterbi_parameters_init(viterbi_parameters *viterbi, int nnodes, int nrows)
 	viterbi->viterbiPvalues = (double**)memory_new_2dim(nnodes, nrows, sizeof(double));
 	viterbi->viterbiNodeFamilysizes = (int**)memory_new_2dim(nnodes, nrows, sizeof(int));
 	viterbi->maximumPvalues = (double*)memory_new(nrows, sizeof(double));
+	viterbi->maximumPvalueErrors.clear();
+	viterbi->pvalueSamples.clear();
 	viterbi->averageExpansion.clear();
 	viterbi->expandRemainDecrease.clear();
 	viterbi->averageExpansion.resize(nnodes);
@@ -46,6 +54,8 @@ void viterbi_parameters_clear(viterbi_parameters* viterbi, int nnodes)
 	viterbi->viterbiNodeFamilysizes = NULL;
 	viterbi->cutPvalues = NULL;
 	viterbi->maximumPvalues = NULL;
+	viterbi->maximumPvalueErrors.clear();
+	viterbi->pvalueSamples.clear();
 	viterbi->expandRemainDecrease.clear();
 }
 
@@ -56,32 +66,186 @@ void viterbi_set_max_pvalue(viterbi_parameters* viterbi, int index, double val)
 }
 
 
+bool branch_pvalue_tables::key::operator<(const key& other) const
+{
+	if (matrix != other.matrix) return matrix < other.matrix;
+	if (parent != other.parent) return parent < other.parent;
+	return limit < other.limit;
+}
+
+branch_pvalue_tables::branch_pvalue_tables()
+{
+	pthread_rwlock_init(&lock, NULL);
+}
+
+branch_pvalue_tables::~branch_pvalue_tables()
+{
+	pthread_rwlock_destroy(&lock);
+}
+
+/* orders child sizes by their probability in one row of a matrix */
+struct by_probability
+{
+	const double* row;
+	by_probability(const double* r) : row(r) {}
+	bool operator()(int a, int b) const { return row[a] < row[b]; }
+};
+
+/* p-value of a change to each child size in [0, limit] from parent, for branch_pvalue_tables */
+static std::vector<double> branch_pvalue_table(struct square_matrix* matrix, int parent, int limit)
+{
+	const double* row = &matrix->values[parent * matrix->size];
+	std::vector<int> order(limit + 1);
+	for (int m = 0; m <= limit; m++)
+		order[m] = m;
+	std::sort(order.begin(), order.end(), by_probability(row));
+
+	std::vector<double> table(limit + 1);
+	double less = 0;
+	for (size_t i = 0; i < order.size(); )
+	{
+		size_t j = i;
+		double equal = 0;
+		for (; j < order.size() && row[order[j]] == row[order[i]]; j++)
+			equal += row[order[j]];
+		for (size_t k = i; k < j; k++)
+			table[order[k]] = less + equal / 2.0;
+		less += equal;
+		i = j;
+	}
+	return table;
+}
+
+double branch_pvalue_tables::pvalue(struct square_matrix* matrix, int parent, int child, int limit)
+{
+	assert(limit < matrix->size);
+	if (child > limit)
+	{
+		// not in the table; sum the row directly
+		double p = square_matrix_get(matrix, parent, child);
+		double result = 0;
+		for (int m = 0; m <= limit; m++)
+		{
+			double q = square_matrix_get(matrix, parent, m);
+			if (q == p) result += q / 2.0;
+			else if (q < p) result += q;
+		}
+		return result;
+	}
+
+	key k;
+	k.matrix = matrix;
+	k.parent = parent;
+	k.limit = limit;
+	pthread_rwlock_rdlock(&lock);
+	std::map<key, std::vector<double> >::const_iterator it = tables.find(k);
+	if (it != tables.end())
+	{
+		double result = it->second[child];
+		pthread_rwlock_unlock(&lock);
+		return result;
+	}
+	pthread_rwlock_unlock(&lock);
+
+	std::vector<double> table = branch_pvalue_table(matrix, parent, limit);
+	double result = table[child];
+	pthread_rwlock_wrlock(&lock);
+	if (tables.find(k) == tables.end())
+		tables[k].swap(table);
+	pthread_rwlock_unlock(&lock);
+	return result;
+}
+
 typedef struct
 {
 	pCafeFamily pfamily;
 	pCafeTree pcafe;
-	int num_threads;
 	viterbi_parameters *viterbi;
 	int num_random_samples;
 	double pvalue;
 
 	pArrayList pCD;
-	int from;
+	sequential_distribution* sequential;
+	importance_distribution* importance;
+
+	/* families are handed out VITERBI_FAMILY_CHUNK at a time from next_family */
+	pthread_mutex_t* lock;
+	int* next_family;
+
+	/* this thread's counts, added into viterbi once all threads are done */
+	std::vector<change>* changes;
+	std::vector<double>* expansion;
+
+	branch_pvalue_tables* tables;
 }ViterbiParam;
 
 typedef ViterbiParam*  pViterbiParam;
 
-pthread_mutex_t mutex_cafe_viterbi = PTHREAD_MUTEX_INITIALIZER;
+/* number of families a Viterbi thread takes at once */
+const int VITERBI_FAMILY_CHUNK = 16;
+
+/**
+* \brief Copies the reconstructed sizes of the internal nodes of ptree into row i of viterbi
+*
+* The change along each branch is counted in changes and expansion.
+*/
+static void record_viterbi_sizes(pTree ptree, viterbi_parameters *viterbi, int i, std::vector<change>& changes, std::vector<double>& expansion)
+{
+	int nnodes = (ptree->nlist->size - 1) / 2;
+	for (int j = 0; j < nnodes; j++)
+	{
+		pCafeNode pcnode = (pCafeNode)ptree->nlist->array[2 * j + 1];
+		viterbi->viterbiNodeFamilysizes[j][i] = pcnode->familysize;
+		pCafeNode child[2] = { (pCafeNode)((pTreeNode)pcnode)->children->head->data,
+			(pCafeNode)((pTreeNode)pcnode)->children->tail->data };
+		for (int k = 0; k < 2; k++)
+		{
+			int m = j * 2 + k;
+			if (child[k]->familysize > pcnode->familysize) changes[m].expand++;
+			else if (child[k]->familysize == pcnode->familysize) changes[m].remain++;
+			else changes[m].decrease++;
+
+			expansion[m] += child[k]->familysize - pcnode->familysize;
+		}
+	}
+}
 
-void viterbi_section(pCafeFamily pcf, double pvalue, int num_random_samples, viterbi_parameters *viterbi, int i, pCafeTree pcafe, double *cP, pArrayList pCD)
+/**
+* \brief Computes the p-values and ancestral sizes of family i
+*
+* The changes along each branch are added into changes and expansion rather than into
+* viterbi, so that threads can count without sharing them.
+*/
+void viterbi_section(pCafeFamily pcf, double pvalue, int num_random_samples, viterbi_parameters *viterbi, int i, pCafeTree pcafe, double *cP, pArrayList pCD, sequential_distribution* sequential, importance_distribution* importance, std::vector<change>& changes, std::vector<double>& expansion, branch_pvalue_tables& tables)
 {
 	pTree ptree = (pTree)pcafe;
 	int nnodes = (ptree->nlist->size - 1) / 2;
 
 	cafe_family_set_size_with_family_forced(pcf, i, pcafe);
 
-	cafe_tree_p_values(pcafe, cP, pCD, num_random_samples);
-	viterbi_set_max_pvalue(viterbi, i, __max(cP, pcafe->rfsize));
+	if (sequential)
+	{
+		compute_tree_likelihoods(pcafe);
+		sequential_pvalue result = sequential_pvalues(*sequential, get_likelihoods(pcafe), pcafe->rfsize, pvalue, cP);
+		viterbi_set_max_pvalue(viterbi, i, result.max_pvalue);
+		viterbi->maximumPvalueErrors[i] = result.error;
+		viterbi->pvalueSamples[i] = result.samples;
+	}
+	else if (importance)
+	{
+		compute_tree_likelihoods(pcafe);
+		double* lh = get_likelihoods(pcafe);
+		for (int s = 0; s < pcafe->rfsize; s++)
+		{
+			cP[s] = importance->pvalue(s, lh[s]);
+		}
+		viterbi_set_max_pvalue(viterbi, i, __max(cP, pcafe->rfsize));
+	}
+	else
+	{
+		cafe_tree_p_values(pcafe, cP, pCD, num_random_samples);
+		viterbi_set_max_pvalue(viterbi, i, __max(cP, pcafe->rfsize));
+	}
 	cafe_tree_viterbi(pcafe);
 	/* check family size for all nodes first */
 	for (int j = 0; j < nnodes; j++)
@@ -94,24 +258,7 @@ void viterbi_section(pCafeFamily pcf, double pvalue, int num_random_samples, vit
 	}
 	/* end check family size for all nodes first */
 
-	for (int j = 0; j < nnodes; j++)
-	{
-		pCafeNode pcnode = (pCafeNode)ptree->nlist->array[2 * j + 1];
-		viterbi->viterbiNodeFamilysizes[j][i] = pcnode->familysize;
-		pCafeNode child[2] = { (pCafeNode)((pTreeNode)pcnode)->children->head->data,
-			(pCafeNode)((pTreeNode)pcnode)->children->tail->data };
-		for (int k = 0; k < 2; k++)
-		{
-			int m = j * 2 + k;
-			if (child[k]->familysize > pcnode->familysize) viterbi->expandRemainDecrease[m].expand++;
-			else if (child[k]->familysize == pcnode->familysize) viterbi->expandRemainDecrease[m].remain++;
-			else viterbi->expandRemainDecrease[m].decrease++;
-
-			pthread_mutex_lock(&mutex_cafe_viterbi);
-			viterbi->averageExpansion[m] += child[k]->familysize - pcnode->familysize;
-			pthread_mutex_unlock(&mutex_cafe_viterbi);
-		}
-	}
+	record_viterbi_sizes(ptree, viterbi, i, changes, expansion);
 
 	if (viterbi->maximumPvalues[i] > pvalue)
 	{
@@ -129,19 +276,8 @@ void viterbi_section(pCafeFamily pcf, double pvalue, int num_random_samples, vit
 			(pCafeNode)((pTreeNode)pcnode)->children->tail->data };
 		for (int k = 0; k < 2; k++)
 		{
-			double p = square_matrix_get(child[k]->birthdeath_matrix, pcnode->familysize, child[k]->familysize);
 			int n = 2 * j + k;
-			for (int m = 0; m <= pcafe->familysizes[1]; m++)
-			{
-				if (square_matrix_get(child[k]->birthdeath_matrix, pcnode->familysize, m) == p)
-				{
-					viterbi->viterbiPvalues[n][i] += square_matrix_get(child[k]->birthdeath_matrix, pcnode->familysize, m) / 2.0;
-				}
-				else if (square_matrix_get(child[k]->birthdeath_matrix, pcnode->familysize, m) < p)
-				{
-					viterbi->viterbiPvalues[n][i] += square_matrix_get(child[k]->birthdeath_matrix, pcnode->familysize, m);
-				}
-			}
+			viterbi->viterbiPvalues[n][i] += tables.pvalue(child[k]->birthdeath_matrix, pcnode->familysize, child[k]->familysize, pcafe->familysizes[1]);
 		}
 	}
 }
@@ -155,12 +291,21 @@ void* __cafe_viterbi_thread_func(void* ptr)
 	pCafeTree pcafe = cafe_tree_copy(pv->pcafe);
 	int fsize = pv->pfamily->flist->size;
 	double* cP = (double*)memory_new(pcafe->rfsize, sizeof(double));
+	while (true)
+	{
+		pthread_mutex_lock(pv->lock);
+		int from = *pv->next_family;
+		*pv->next_family += VITERBI_FAMILY_CHUNK;
+		pthread_mutex_unlock(pv->lock);
+		if (from >= fsize) break;
 #ifdef VERBOSE
-	printf("VITERBI: from %d\n", pv->from);
+		printf("VITERBI: from %d\n", from);
 #endif
-	for (int i = pv->from; i < fsize; i += pv->num_threads)
-	{
-		viterbi_section(pv->pfamily, pv->pvalue, pv->num_random_samples, pv->viterbi, i, pcafe, cP, pCD);
+		int to = MIN(from + VITERBI_FAMILY_CHUNK, fsize);
+		for (int i = from; i < to; i++)
+		{
+			viterbi_section(pv->pfamily, pv->pvalue, pv->num_random_samples, pv->viterbi, i, pcafe, cP, pCD, pv->sequential, pv->importance, *pv->changes, *pv->expansion, *pv->tables);
+		}
 	}
 	memory_free(cP);
 	cP = NULL;
@@ -168,7 +313,14 @@ void* __cafe_viterbi_thread_func(void* ptr)
 	return (NULL);
 }
 
-pArrayList cafe_viterbi(pCafeParam param, viterbi_parameters& viterbi, pArrayList pCD)
+/**
+* \brief Computes p-values and the most likely ancestral sizes of every family
+*
+* P-values come from the fixed conditional distributions in pCD, or, when sequential
+* is given, are estimated with as many samples as each family needs, or, when importance
+* is given, from families simulated with inflated rates and reweighted.
+*/
+pArrayList cafe_viterbi(pCafeParam param, viterbi_parameters& viterbi, pArrayList pCD, sequential_distribution* sequential, importance_distribution* importance)
 {
 	cafe_log(param, "Running Viterbi algorithm....\n");
 
@@ -179,21 +331,50 @@ pArrayList cafe_viterbi(pCafeParam param, viterbi_parameters& viterbi, pArrayLis
 	int nnodes = ptree->nlist->size - 1;
 
 	viterbi_parameters_init(&viterbi, nnodes, nrows);
+	if (sequential)
+	{
+		viterbi.maximumPvalueErrors.resize(nrows);
+		viterbi.pvalueSamples.resize(nrows);
+	}
+
+	pthread_mutex_t lock;
+	pthread_mutex_init(&lock, NULL);
+	int next_family = 0;
+	branch_pvalue_tables tables;
+	std::vector<std::vector<change> > changes(param->num_threads, std::vector<change>(nnodes));
+	std::vector<std::vector<double> > expansion(param->num_threads, std::vector<double>(nnodes));
 
 	int i;
 	for (i = 0; i < param->num_threads; i++)
 	{
 		ptparam[i].pfamily = param->pfamily;
 		ptparam[i].pcafe = param->pcafe;
-		ptparam[i].num_threads = param->num_threads;
 
 		ptparam[i].num_random_samples = param->num_random_samples;
 		ptparam[i].viterbi = &viterbi;
 		ptparam[i].pvalue = param->pvalue;
-		ptparam[i].from = i;
 		ptparam[i].pCD = pCD;
+		ptparam[i].sequential = sequential;
+		ptparam[i].importance = importance;
+		ptparam[i].lock = &lock;
+		ptparam[i].next_family = &next_family;
+		ptparam[i].changes = &changes[i];
+		ptparam[i].expansion = &expansion[i];
+		ptparam[i].tables = &tables;
 	}
 	thread_run(param->num_threads, __cafe_viterbi_thread_func, ptparam, sizeof(ViterbiParam));
+	pthread_mutex_destroy(&lock);
+
+	for (int t = 0; t < param->num_threads; t++)
+	{
+		for (i = 0; i < nnodes; i++)
+		{
+			viterbi.expandRemainDecrease[i].expand += changes[t][i].expand;
+			viterbi.expandRemainDecrease[i].remain += changes[t][i].remain;
+			viterbi.expandRemainDecrease[i].decrease += changes[t][i].decrease;
+			viterbi.averageExpansion[i] += expansion[t][i];
+		}
+	}
 
 	for (i = 0; i < ptree->nlist->size - 1; i++)
 	{
@@ -205,6 +386,155 @@ pArrayList cafe_viterbi(pCafeParam param, viterbi_parameters& viterbi, pArrayLis
 	return pCD;
 }
 
+/* a run of families assigned to the same cluster, as positions in ClusteredViterbiQueue::order */
+struct ClusteredViterbiTask
+{
+	int cluster;
+	int start;
+	int end;
+};
+
+struct ClusteredViterbiQueue
+{
+	pthread_mutex_t lock;
+	std::vector<int> order;
+	std::vector<ClusteredViterbiTask> tasks;
+	size_t next;
+};
+
+typedef struct
+{
+	pCafeParam param;
+	viterbi_parameters *viterbi;
+	ClusteredViterbiQueue* queue;
+
+	/* this thread's counts, added into viterbi once all threads are done */
+	std::vector<change>* changes;
+	std::vector<double>* expansion;
+}ClusteredViterbiParam;
+
+/**
+* \brief Points each node of pcafe at the matrix of cluster k held by the matching node of src
+*/
+static void cafe_tree_use_cluster(pCafeTree pcafe, pCafeTree src, int k)
+{
+	pArrayList nlist = pcafe->super.nlist;
+	for (int n = 0; n < nlist->size; n++)
+	{
+		pCafeNode from = (pCafeNode)src->super.nlist->array[n];
+		pCafeNode to = (pCafeNode)nlist->array[n];
+		to->errormodel = from->errormodel;
+		if (from->k_bd && k < from->k_bd->size)
+			to->birthdeath_matrix = (struct square_matrix*)from->k_bd->array[k];
+	}
+}
+
+void* __cafe_clustered_viterbi_thread_func(void* ptr)
+{
+	ClusteredViterbiParam* pv = (ClusteredViterbiParam*)ptr;
+	ClusteredViterbiQueue* queue = pv->queue;
+	pCafeParam param = pv->param;
+	pCafeTree pcafe = cafe_tree_copy(param->pcafe);
+	int cluster = -1;
+	while (true)
+	{
+		pthread_mutex_lock(&queue->lock);
+		if (queue->next >= queue->tasks.size())
+		{
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+		ClusteredViterbiTask task = queue->tasks[queue->next++];
+		pthread_mutex_unlock(&queue->lock);
+
+		if (task.cluster != cluster)
+		{
+			cafe_tree_use_cluster(pcafe, param->pcafe, task.cluster);
+			cluster = task.cluster;
+		}
+		for (int t = task.start; t < task.end; t++)
+		{
+			int i = queue->order[t];
+			cafe_family_set_size(param->pfamily, i, pcafe);
+			cafe_tree_viterbi(pcafe);
+			record_viterbi_sizes((pTree)pcafe, pv->viterbi, i, *pv->changes, *pv->expansion);
+		}
+	}
+	cafe_tree_free(pcafe);
+	return (NULL);
+}
+
+/**
+* \brief Most likely ancestral sizes of every family under a model with clusters
+*
+* Each family is reconstructed with the rates of its most probable cluster in
+* p_z_membership, or of the heaviest cluster when memberships have not been
+* estimated. Families are grouped by cluster and handed out VITERBI_FAMILY_CHUNK
+* at a time, so a thread moves its tree to another cluster's matrices only when
+* its chunks run into the next cluster. No p-values are computed.
+*/
+void cafe_clustered_viterbi(pCafeParam param, viterbi_parameters& viterbi)
+{
+	cafe_log(param, "Running clustered Viterbi algorithm....\n");
+
+	pTree ptree = (pTree)param->pcafe;
+	int nrows = param->pfamily->flist->size;
+	int nnodes = ptree->nlist->size - 1;
+	int nclusters = param->parameterized_k_value;
+	viterbi_parameters_init(&viterbi, nnodes, nrows);
+
+	std::vector<std::vector<int> > members(nclusters);
+	for (int i = 0; i < nrows; i++)
+	{
+		double* weights = param->p_z_membership ? param->p_z_membership[i] : param->k_weights;
+		members[__maxidx(weights, nclusters)].push_back(i);
+	}
+
+	ClusteredViterbiQueue queue;
+	pthread_mutex_init(&queue.lock, NULL);
+	queue.next = 0;
+	for (int k = 0; k < nclusters; k++)
+	{
+		int start = queue.order.size();
+		queue.order.insert(queue.order.end(), members[k].begin(), members[k].end());
+		for (int from = start; from < (int)queue.order.size(); from += VITERBI_FAMILY_CHUNK)
+		{
+			ClusteredViterbiTask task = { k, from, MIN(from + VITERBI_FAMILY_CHUNK, (int)queue.order.size()) };
+			queue.tasks.push_back(task);
+		}
+	}
+
+	int numthreads = MAX(1, MIN(param->num_threads, (int)queue.tasks.size()));
+	std::vector<std::vector<change> > changes(numthreads, std::vector<change>(nnodes));
+	std::vector<std::vector<double> > expansion(numthreads, std::vector<double>(nnodes));
+	std::vector<ClusteredViterbiParam> ptparam(numthreads);
+	for (int t = 0; t < numthreads; t++)
+	{
+		ptparam[t].param = param;
+		ptparam[t].viterbi = &viterbi;
+		ptparam[t].queue = &queue;
+		ptparam[t].changes = &changes[t];
+		ptparam[t].expansion = &expansion[t];
+	}
+	thread_run(numthreads, __cafe_clustered_viterbi_thread_func, &ptparam[0], sizeof(ClusteredViterbiParam));
+	pthread_mutex_destroy(&queue.lock);
+
+	for (int t = 0; t < numthreads; t++)
+	{
+		for (int i = 0; i < nnodes; i++)
+		{
+			viterbi.expandRemainDecrease[i].expand += changes[t][i].expand;
+			viterbi.expandRemainDecrease[i].remain += changes[t][i].remain;
+			viterbi.expandRemainDecrease[i].decrease += changes[t][i].decrease;
+			viterbi.averageExpansion[i] += expansion[t][i];
+		}
+	}
+	for (int i = 0; i < nnodes; i++)
+	{
+		viterbi.averageExpansion[i] /= MAX(1, nrows);
+	}
+}
+
 void cafe_viterbi_print(pCafeParam param, viterbi_parameters& viterbi)
 {
 	int i, j;
@@ -222,3 +552,190 @@ void cafe_viterbi_print(pCafeParam param, viterbi_parameters& viterbi)
 		cafe_tree_string_print(pcafe);
 	}
 }
+
+/**************************************************************************
+* Stored Viterbi results
+**************************************************************************/
+static const char VITERBI_STORE_MAGIC[8] = { 'C', 'A', 'F', 'E', 'V', 'T', 'R', '1' };
+
+/**
+* \brief Hash of everything the Viterbi results of param depend on
+*
+* Extends the key of the conditional distribution with the way p-values are computed,
+* the p-value threshold, the rates, and the species and counts of every family.
+*/
+uint64_t viterbi_results_key(pCafeParam param, int method)
+{
+	uint64_t h = conditional_distribution_key(param->pcafe, &param->family_size, param->num_random_samples);
+	hash_bytes(h, &method, sizeof(method));
+	hash_bytes(h, &param->pvalue, sizeof(param->pvalue));
+	hash_bytes(h, &param->num_params, sizeof(param->num_params));
+	if (param->parameters)
+		hash_bytes(h, param->parameters, param->num_params * sizeof(double));
+
+	pCafeFamily pfamily = param->pfamily;
+	for (int s = 0; s < pfamily->num_species; s++)
+	{
+		hash_bytes(h, pfamily->species[s], strlen(pfamily->species[s]) + 1);
+	}
+	for (int i = 0; i < pfamily->flist->size; i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)pfamily->flist->array[i];
+		hash_bytes(h, pitem->id, strlen(pitem->id) + 1);
+		hash_bytes(h, pitem->count, pfamily->num_species * sizeof(int));
+	}
+	return h;
+}
+
+template <typename T> static bool read_values(FILE* fp, T* values, int n)
+{
+	return n == 0 || fread(values, sizeof(T), n, fp) == (size_t)n;
+}
+
+template <typename T> static bool write_values(FILE* fp, const T* values, int n)
+{
+	return n == 0 || fwrite(values, sizeof(T), n, fp) == (size_t)n;
+}
+
+/**
+* \brief Reads results written by write_viterbi_results into an empty viterbi
+*
+* Returns false, leaving viterbi empty, if the file is missing, does not match the key or is cut short.
+*/
+bool read_viterbi_results(const std::string& file, uint64_t key, viterbi_parameters& viterbi)
+{
+	FILE* fp = fopen(file.c_str(), "rb");
+	if (fp == NULL) return false;
+
+	/* nodes below the root, families, whether p-value errors and cut p-values follow */
+	char magic[8];
+	uint64_t file_key;
+	int32_t dims[4];
+	bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, VITERBI_STORE_MAGIC, 8) == 0
+		&& fread(&file_key, sizeof(file_key), 1, fp) == 1 && file_key == key
+		&& fread(dims, sizeof(int32_t), 4, fp) == 4 && dims[0] > 0 && dims[0] % 2 == 0 && dims[1] >= 0;
+	if (!ok)
+	{
+		fclose(fp);
+		return false;
+	}
+
+	int nnodes = dims[0];
+	int nrows = dims[1];
+	viterbi_parameters_init(&viterbi, nnodes, nrows);
+	viterbi.cutPvalues = NULL;
+	for (int j = 0; ok && j < nnodes / 2; j++)
+		ok = read_values(fp, viterbi.viterbiNodeFamilysizes[j], nrows);
+	for (int j = 0; ok && j < nnodes; j++)
+		ok = read_values(fp, viterbi.viterbiPvalues[j], nrows);
+	ok = ok && read_values(fp, viterbi.maximumPvalues, nrows);
+	if (ok && dims[2])
+	{
+		viterbi.maximumPvalueErrors.resize(nrows);
+		viterbi.pvalueSamples.resize(nrows);
+		ok = read_values(fp, &viterbi.maximumPvalueErrors.front(), nrows)
+			&& read_values(fp, &viterbi.pvalueSamples.front(), nrows);
+	}
+	ok = ok && read_values(fp, &viterbi.averageExpansion[0], nnodes);
+	std::vector<int> counts(3 * nnodes);
+	ok = ok && read_values(fp, &counts[0], 3 * nnodes);
+	for (int j = 0; ok && j < nnodes; j++)
+	{
+		viterbi.expandRemainDecrease[j] = change(counts[3 * j], counts[3 * j + 1], counts[3 * j + 2]);
+	}
+	if (ok && dims[3])
+	{
+		viterbi.cutPvalues = (double**)memory_new_2dim(nnodes + 1, nrows, sizeof(double));
+		for (int j = 0; ok && j <= nnodes; j++)
+			ok = read_values(fp, viterbi.cutPvalues[j], nrows);
+	}
+	ok = ok && fgetc(fp) == EOF;
+	fclose(fp);
+
+	if (!ok)
+		viterbi_parameters_clear(&viterbi, nnodes + 1);
+	return ok;
+}
+
+/**
+* \brief Writes the node sizes, p-values and counts of viterbi in binary, through a temporary file
+*/
+bool write_viterbi_results(const std::string& file, uint64_t key, const viterbi_parameters& viterbi)
+{
+	std::string tmp = file + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (fp == NULL) return false;
+
+	int nnodes = viterbi.num_nodes;
+	int nrows = viterbi.num_rows;
+	bool errors = !viterbi.maximumPvalueErrors.empty();
+	int32_t dims[4] = { nnodes, nrows, errors, viterbi.cutPvalues != NULL };
+	bool ok = fwrite(VITERBI_STORE_MAGIC, 1, 8, fp) == 8
+		&& fwrite(&key, sizeof(key), 1, fp) == 1
+		&& fwrite(dims, sizeof(int32_t), 4, fp) == 4;
+	for (int j = 0; ok && j < nnodes / 2; j++)
+		ok = write_values(fp, viterbi.viterbiNodeFamilysizes[j], nrows);
+	for (int j = 0; ok && j < nnodes; j++)
+		ok = write_values(fp, viterbi.viterbiPvalues[j], nrows);
+	ok = ok && write_values(fp, viterbi.maximumPvalues, nrows);
+	if (ok && errors)
+	{
+		ok = write_values(fp, &viterbi.maximumPvalueErrors.front(), nrows)
+			&& write_values(fp, &viterbi.pvalueSamples.front(), nrows);
+	}
+	ok = ok && write_values(fp, &viterbi.averageExpansion[0], nnodes);
+	std::vector<int> counts;
+	for (int j = 0; j < nnodes; j++)
+	{
+		counts.push_back(viterbi.expandRemainDecrease[j].expand);
+		counts.push_back(viterbi.expandRemainDecrease[j].remain);
+		counts.push_back(viterbi.expandRemainDecrease[j].decrease);
+	}
+	ok = ok && write_values(fp, &counts[0], 3 * nnodes);
+	for (int j = 0; ok && viterbi.cutPvalues && j <= nnodes; j++)
+		ok = write_values(fp, viterbi.cutPvalues[j], nrows);
+
+	ok = fclose(fp) == 0 && ok;
+	if (ok) ok = rename(tmp.c_str(), file.c_str()) == 0;
+	if (!ok) remove(tmp.c_str());
+	return ok;
+}
+
+static std::string viterbi_results_file(uint64_t key)
+{
+	char name[32];
+	sprintf(name, "viterbi_%016llx.bin", (unsigned long long)key);
+	return get_conditional_distribution_cache() + "/" + name;
+}
+
+/**
+* \brief Loads the Viterbi results of param saved in the cache directory
+*
+* Returns false, leaving viterbi empty, when no cache directory is set or nothing
+* was saved for the same tree, rates, families and p-value method.
+*/
+bool load_viterbi_results(pCafeParam param, int method, viterbi_parameters& viterbi)
+{
+	if (get_conditional_distribution_cache().empty())
+		return false;
+
+	uint64_t key = viterbi_results_key(param, method);
+	if (!read_viterbi_results(viterbi_results_file(key), key, viterbi))
+		return false;
+	cafe_log(param, "Loaded Viterbi results from cache\n");
+	return true;
+}
+
+/**
+* \brief Saves the Viterbi results of param in the cache directory, if one is set
+*/
+void save_viterbi_results(pCafeParam param, int method, const viterbi_parameters& viterbi)
+{
+	if (get_conditional_distribution_cache().empty())
+		return;
+
+	uint64_t key = viterbi_results_key(param, method);
+	std::string file = viterbi_results_file(key);
+	if (!write_viterbi_results(file, key, viterbi))
+		fprintf(stderr, "WARNING: could not write Viterbi results %s\n", file.c_str());
+}
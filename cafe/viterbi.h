@@ -2,6 +2,10 @@
 #define VITERBI_H_A08989A1_B4B4_461C_B863_A1AE2FE9BD98
 
 #include <vector>
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
 
 extern "C"
 {
@@ -41,15 +45,64 @@ public:
 
 	int** viterbiNodeFamilysizes;
 	double* maximumPvalues;
+	/** Monte Carlo standard error of maximumPvalues and the samples used, filled only by sequential p-values */
+	std::vector<double> maximumPvalueErrors;
+	std::vector<int> pvalueSamples;
 	std::vector<double> averageExpansion;
 	double** cutPvalues;
 } ;
 
+/**
+* \brief Per-branch Viterbi p-values tabulated by child size, for each row of a transition matrix
+*
+* The p-value of a branch is the probability of a change from the parent size at most as likely
+* as the one seen, counting changes exactly as likely by half, over child sizes up to limit.
+* It depends only on the matrix, the parent size and limit, so each such row is tabulated the
+* first time it is asked for and shared between threads.
+*/
+class branch_pvalue_tables
+{
+	struct key
+	{
+		const struct square_matrix* matrix;
+		int parent;
+		int limit;
+		bool operator<(const key& other) const;
+	};
+	pthread_rwlock_t lock;
+	std::map<key, std::vector<double> > tables;
+
+	branch_pvalue_tables(const branch_pvalue_tables&);
+	branch_pvalue_tables& operator=(const branch_pvalue_tables&);
+public:
+	branch_pvalue_tables();
+	~branch_pvalue_tables();
+
+	double pvalue(struct square_matrix* matrix, int parent, int child, int limit);
+};
+
 void viterbi_parameters_init(viterbi_parameters *viterbi, int nnodes, int nrows);
 
 void viterbi_set_max_pvalue(viterbi_parameters* viterbi, int index, double val);
 void viterbi_parameters_clear(viterbi_parameters* viterbi, int nnodes);
-pArrayList cafe_viterbi(pCafeParam param, viterbi_parameters& viterbi, pArrayList pCD);
+class sequential_distribution;
+class importance_distribution;
+pArrayList cafe_viterbi(pCafeParam param, viterbi_parameters& viterbi, pArrayList pCD, sequential_distribution* sequential = NULL, importance_distribution* importance = NULL);
+void cafe_clustered_viterbi(pCafeParam param, viterbi_parameters& viterbi);
+
+/** How the p-values of a stored Viterbi result were computed; part of its key */
+enum viterbi_pvalue_method
+{
+	VITERBI_PVALUES_FIXED,
+	VITERBI_PVALUES_SEQUENTIAL,
+	VITERBI_PVALUES_IMPORTANCE
+};
+
+uint64_t viterbi_results_key(pCafeParam param, int method);
+bool read_viterbi_results(const std::string& file, uint64_t key, viterbi_parameters& viterbi);
+bool write_viterbi_results(const std::string& file, uint64_t key, const viterbi_parameters& viterbi);
+bool load_viterbi_results(pCafeParam param, int method, viterbi_parameters& viterbi);
+void save_viterbi_results(pCafeParam param, int method, const viterbi_parameters& viterbi);
 
 
 #endif
@@ -14,6 +14,9 @@ pFMinSearch fminsearch_new()
 	pfm->zero_delta = 0.00025;
 	pfm->maxiters = 10000;
 	pfm->args = NULL;
+	pfm->checkpoint = NULL;
+	pfm->checkpoint_args = NULL;
+	pfm->checkpoint_interval = 1;
 	return pfm;
 }
 
@@ -147,6 +150,7 @@ int __fminsearch_checkF(pFMinSearch pfm)
 void __fminsearch_min_init(pFMinSearch pfm, double* X0)
 {
 	int i,j;
+	pfm->op = FMINSEARCH_INIT;
 	for ( i = 0 ; i < pfm->N1 ; i++ )
 	{
 		for ( j = 0 ; j < pfm->N ; j++ )
@@ -194,6 +198,7 @@ void __fminsearch_x_mean(pFMinSearch pfm)
 double __fminsearch_x_reflection(pFMinSearch pfm)
 {
 	int i;
+	pfm->op = FMINSEARCH_REFLECT;
 	for ( i = 0 ; i < pfm->N ; i++ )
 	{
 		pfm->x_r[i] = pfm->x_mean[i] + pfm->rho * ( pfm->x_mean[i] - pfm->v[pfm->N][i] );
@@ -205,6 +210,7 @@ double __fminsearch_x_reflection(pFMinSearch pfm)
 double __fminsearch_x_expansion(pFMinSearch pfm)
 {
 	int i;
+	pfm->op = FMINSEARCH_EXPAND;
 	for ( i = 0 ; i < pfm->N ; i++ )
 	{
 		pfm->x_tmp[i] = pfm->x_mean[i] + pfm->chi * ( pfm->x_r[i] - pfm->x_mean[i] );
@@ -215,6 +221,7 @@ double __fminsearch_x_expansion(pFMinSearch pfm)
 double __fminsearch_x_contract_outside(pFMinSearch pfm)
 {
 	int i;
+	pfm->op = FMINSEARCH_CONTRACT_OUTSIDE;
 	for ( i = 0 ; i < pfm->N; i++ )
 	{
 		pfm->x_tmp[i] = pfm->x_mean[i] + pfm->psi * ( pfm->x_r[i] - pfm->x_mean[i] );
@@ -225,6 +232,7 @@ double __fminsearch_x_contract_outside(pFMinSearch pfm)
 double __fminsearch_x_contract_inside(pFMinSearch pfm)
 {
 	int i;
+	pfm->op = FMINSEARCH_CONTRACT_INSIDE;
 	for ( i = 0 ; i < pfm->N ; i++ )
 	{
 		pfm->x_tmp[i] = pfm->x_mean[i] + pfm->psi * ( pfm->x_mean[i] - pfm->v[pfm->N][i] );
@@ -235,6 +243,7 @@ double __fminsearch_x_contract_inside(pFMinSearch pfm)
 void __fminsearch_x_shrink(pFMinSearch pfm)
 {
 	int i, j;
+	pfm->op = FMINSEARCH_SHRINK;
 	for ( i = 1 ; i < pfm->N1 ; i++ )
 	{
 		for ( j = 0 ; j < pfm->N ; j++ )
@@ -257,12 +266,23 @@ void __fminsearch_set_last_element(pFMinSearch pfm, double* x, double f)
 	__fminsearch_sort(pfm);
 }
 
-int fminsearch_min(pFMinSearch pfm, double* X0)
+void fminsearch_set_checkpoint(pFMinSearch pfm, fminsearch_callback checkpoint, int interval, void* args)
+{
+	pfm->checkpoint = checkpoint;
+	pfm->checkpoint_interval = interval > 0 ? interval : 1;
+	pfm->checkpoint_args = args;
+}
+
+int __fminsearch_min_loop(pFMinSearch pfm, int start)
 {
 	int i;
-	__fminsearch_min_init(pfm, X0);
-	for ( i = 0 ; i < pfm->maxiters; i++ )
+	for ( i = start ; i < pfm->maxiters; i++ )
 	{
+		pfm->iters = i;
+		if ( pfm->checkpoint && i % pfm->checkpoint_interval == 0 )
+		{
+			pfm->checkpoint(pfm, pfm->checkpoint_args);
+		}
 		if ( __fminsearch_checkV(pfm) && __fminsearch_checkF(pfm) ) break;
         __fminsearch_x_mean(pfm);
 		double fv_r = __fminsearch_x_reflection(pfm);
@@ -297,6 +317,28 @@ int fminsearch_min(pFMinSearch pfm, double* X0)
 	return pfm->bymax;
 }
 
+int fminsearch_min(pFMinSearch pfm, double* X0)
+{
+	__fminsearch_min_init(pfm, X0);
+	return __fminsearch_min_loop(pfm, 0);
+}
+
+/**
+* \brief Continues a search from the simplex already in v and fv, starting at iteration iters
+*
+* Used to pick up a search whose state was saved by a checkpoint callback.
+*/
+int fminsearch_min_resume(pFMinSearch pfm)
+{
+	return __fminsearch_min_loop(pfm, pfm->iters);
+}
+
+const char* fminsearch_op_name(int op)
+{
+	static const char* names[] = { "init", "reflect", "expand", "contract_outside", "contract_inside", "shrink" };
+	return op >= FMINSEARCH_INIT && op <= FMINSEARCH_SHRINK ? names[op] : "none";
+}
+
 double* fminsearch_get_minX(pFMinSearch pfm)
 {
 	return pfm->v[0];
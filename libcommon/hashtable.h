@@ -4,8 +4,8 @@
  * @brief a simple hash table implementation
  * @author Ankur Shrivastava
  */
-#ifndef _HASHTABLE_H
-#define _HASHTABLE_H
+#ifndef _CAFE_HASHTABLE_H
+#define _CAFE_HASHTABLE_H
 
 #include<sys/types.h>
 #include<stdint.h>
@@ -88,9 +88,119 @@ double __Qs[] = { 1.000000000190015, 76.18009172947146, -86.50532032941677,
 		    	  24.01409824083091, -1.231739572450155, 1.208650973866179e-3, 
 				  -5.395239384953e-6};
 
+/**
+* \brief SplitMix64 finalizer, used as the hash of the counter-based streams
+*/
+static uint64_t __mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/**
+* \brief Sets up stream number id of the given seed
+*
+* Streams with different ids are independent, so work that is split among threads
+* or tasks can give each piece its own stream and get the same numbers no matter
+* which thread runs it.
+*/
+void random_stream_init(pRandomStream stream, uint64_t seed, uint64_t id)
+{
+	stream->key = __mix64(__mix64(seed) ^ (id * 0xD1B54A32D192ED03ULL + 0x9E3779B97F4A7C15ULL));
+	stream->counter = 0;
+}
+
+uint64_t random_stream_next64(pRandomStream stream)
+{
+	stream->counter++;
+	return __mix64(stream->key + stream->counter * 0x9E3779B97F4A7C15ULL);
+}
+
+/**
+* \brief Uniform random number in [0, 1) with 53 random bits
+*/
+double random_stream_next(pRandomStream stream)
+{
+	return (random_stream_next64(stream) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned int unifrnd_seed_value = 1;
+static RandomStream unifrnd_main_stream = { 0, 0 };
+static int unifrnd_main_ready = 0;
+static __thread pRandomStream unifrnd_stream = NULL;
+
+static pRandomStream __unifrnd_current()
+{
+	if (unifrnd_stream) return unifrnd_stream;
+	if (!unifrnd_main_ready)
+	{
+		random_stream_init(&unifrnd_main_stream, unifrnd_seed_value, 0);
+		unifrnd_main_ready = 1;
+	}
+	return &unifrnd_main_stream;
+}
+
+/**
+* \brief Uniform random number in [0, 1) from the calling thread's stream
+*
+* Threads that have not been given a stream with \ref unifrnd_set_stream
+* draw from the main stream set up by \ref unifrnd_seed.
+*/
 double unifrnd()
 {
-	return rand()/(RAND_MAX+1.0);
+	return random_stream_next(__unifrnd_current());
+}
+
+/**
+* \brief Makes unifrnd in the calling thread draw from stream; NULL goes back to the main stream
+*
+* Returns the stream that was in use before.
+*/
+pRandomStream unifrnd_set_stream(pRandomStream stream)
+{
+	pRandomStream old = unifrnd_stream;
+	unifrnd_stream = stream;
+	return old;
+}
+
+/**
+* \brief Draws a seed for a family of child streams from the calling thread's stream
+*/
+uint64_t unifrnd_split()
+{
+	return random_stream_next64(__unifrnd_current());
+}
+
+void unifrnd_seed(unsigned int seed)
+{
+	unifrnd_seed_value = seed;
+	random_stream_init(&unifrnd_main_stream, seed, 0);
+	unifrnd_main_ready = 1;
+}
+
+unsigned int unifrnd_get_seed()
+{
+	return unifrnd_seed_value;
+}
+
+/**
+* \brief Current position of the main stream as the seed and the number of draws since seeding
+*/
+void unifrnd_get_state(unsigned int* seed, unsigned long* draws)
+{
+	if (!unifrnd_main_ready) unifrnd_seed(unifrnd_seed_value);
+	*seed = unifrnd_seed_value;
+	*draws = (unsigned long)unifrnd_main_stream.counter;
+}
+
+/**
+* \brief Puts the main stream back to a position returned by \ref unifrnd_get_state
+*/
+void unifrnd_set_state(unsigned int seed, unsigned long draws)
+{
+	unifrnd_seed(seed);
+	unifrnd_main_stream.counter = draws;
 }
 
 /***********************************************************************
@@ -4,6 +4,7 @@
 #include<math.h>
 #include<stdarg.h>
 #include<stdio.h>
+#include<stdint.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -25,7 +26,13 @@ extern "C" {
 
 typedef double (*math_func)(double* x, void* args);
 
-typedef struct
+struct tagFMinSearch;
+typedef void (*fminsearch_callback)(struct tagFMinSearch* pfm, void* args);
+
+/* simplex step that asked for the function value being computed */
+enum FMINSEARCH_OP { FMINSEARCH_INIT, FMINSEARCH_REFLECT, FMINSEARCH_EXPAND, FMINSEARCH_CONTRACT_OUTSIDE, FMINSEARCH_CONTRACT_INSIDE, FMINSEARCH_SHRINK };
+
+typedef struct tagFMinSearch
 {
 	int maxiters;		
 	int bymax;
@@ -35,6 +42,7 @@ typedef struct
 
 	int 	N, N1;		
 	int 	iters;
+	int 	op;
 	double** v;
 	double* fv;
 	double** vsort;
@@ -45,6 +53,11 @@ typedef struct
 
 	void* args;
 	math_func eq;	
+
+	/* called with the current simplex every checkpoint_interval iterations */
+	fminsearch_callback checkpoint;
+	void* checkpoint_args;
+	int checkpoint_interval;
 }FMinSearch;
 
 typedef FMinSearch* pFMinSearch;
@@ -54,7 +67,26 @@ extern double __max(double* data, int size );
 extern double __min(double* data, int size );
 extern double ipow(double val, int expo);
 
+/* counter-based random stream: draw n is a hash of (key, n) */
+typedef struct tagRandomStream
+{
+	uint64_t key;
+	uint64_t counter;
+}RandomStream;
+
+typedef RandomStream* pRandomStream;
+
+extern void random_stream_init(pRandomStream stream, uint64_t seed, uint64_t id);
+extern uint64_t random_stream_next64(pRandomStream stream);
+extern double random_stream_next(pRandomStream stream);
+
 extern double unifrnd();
+extern pRandomStream unifrnd_set_stream(pRandomStream stream);
+extern uint64_t unifrnd_split();
+extern void unifrnd_seed(unsigned int seed);
+extern unsigned int unifrnd_get_seed();
+extern void unifrnd_get_state(unsigned int* seed, unsigned long* draws);
+extern void unifrnd_set_state(unsigned int seed, unsigned long draws);
 
 extern double gamma(double c);
 extern double gammaln(double c);
@@ -102,6 +134,9 @@ extern pFMinSearch fminsearch_new_with_eq(math_func eq, int Xsize, void* args);
 extern void fminsearch_set_equation(pFMinSearch pfm,math_func eq, int Xsize, void* args);
 extern void fminsearch_free(pFMinSearch pfm);
 extern int fminsearch_min(pFMinSearch pfm, double* X0);
+extern int fminsearch_min_resume(pFMinSearch pfm);
+extern void fminsearch_set_checkpoint(pFMinSearch pfm, fminsearch_callback checkpoint, int interval, void* args);
+extern const char* fminsearch_op_name(int op);
 extern double* fminsearch_get_minX(pFMinSearch pfm);
 extern double fminsearch_get_minF(pFMinSearch pfm);
 
@@ -5,6 +5,7 @@
 #include<time.h>
 #include "utils.h"
 #include "memalloc.h"
+#include "mathfunc.h"
 
 int __cmp_int(const void* a, const void* b)
 {
@@ -111,7 +112,7 @@ void arraylist_shuffle(pArrayList pal)
 {
 	int i;
 	for(i = 0; i < pal->size-1; i++) {
-		int c = rand() / (RAND_MAX/(pal->size-i) + 1); 
+		int c = (int)(unifrnd() * (pal->size-i));
 		void* t = pal->array[i]; pal->array[i] = pal->array[i+c]; pal->array[i+c] = t;	/* swap */
 	}
 }
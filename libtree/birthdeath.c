@@ -46,6 +46,20 @@ void chooseln_cache_free()
 	chooseln_cache_free2(&cache);
 }
 
+/**
+* \brief Makes sure the shared chooseln cache holds values up to the given family size
+*
+* Growing the cache is not threadsafe, so this should be called before worker threads
+* build their own birthdeath caches of the same size.
+*/
+void chooseln_cache_reserve(int size)
+{
+	if (!chooseln_is_init2(&cache))
+		chooseln_cache_init2(&cache, size);
+	else if (cache.size < size)
+		chooseln_cache_resize2(&cache, size);
+}
+
 
 
 
@@ -140,6 +154,22 @@ void square_matrix_init(struct square_matrix* matrix, int sz)
 {
 	matrix->values = (double*)memory_new(sz * sz, sizeof(double));
 	matrix->size = sz;
+	matrix->cumulative = NULL;
+	matrix->log_values = NULL;
+}
+
+static void __square_matrix_clear_cumulative(struct square_matrix* matrix)
+{
+	if (matrix->cumulative)
+	{
+		memory_free(matrix->cumulative);
+		matrix->cumulative = NULL;
+	}
+	if (matrix->log_values)
+	{
+		memory_free(matrix->log_values);
+		matrix->log_values = NULL;
+	}
 }
 
 void square_matrix_set(struct square_matrix* matrix, int x, int y, double val)
@@ -147,15 +177,102 @@ void square_matrix_set(struct square_matrix* matrix, int x, int y, double val)
 	assert(x < matrix->size);
 	assert(y < matrix->size);
 	matrix->values[x*matrix->size+y] = val;
+	__square_matrix_clear_cumulative(matrix);
 }
 
 void square_matrix_delete(struct square_matrix* matrix)
 {
+	__square_matrix_clear_cumulative(matrix);
 	memory_free((void*)matrix->values);
 }
 
+static pthread_mutex_t cumulative_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+* \brief Running sums along each row of matrix, built on first use and then shared read-only by all threads
+*
+* Each entry holds the largest running sum so far, which keeps the rows sorted
+* even if rounding left a slightly negative probability.
+*/
+static const double* __square_matrix_cumulative(struct square_matrix* matrix)
+{
+	double* cumulative = __atomic_load_n(&matrix->cumulative, __ATOMIC_ACQUIRE);
+	if (cumulative) return cumulative;
+
+	pthread_mutex_lock(&cumulative_lock);
+	cumulative = matrix->cumulative;
+	if (cumulative == NULL)
+	{
+		int sz = matrix->size;
+		cumulative = (double*)memory_new(sz * sz, sizeof(double));
+		for (int s = 0; s < sz; s++)
+		{
+			double sum = 0;
+			double highest = -MAX_DOUBLE;
+			for (int c = 0; c < sz; c++)
+			{
+				sum += matrix->values[s*sz + c];
+				if (sum > highest) highest = sum;
+				cumulative[s*sz + c] = highest;
+			}
+		}
+		__atomic_store_n(&matrix->cumulative, cumulative, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&cumulative_lock);
+	return cumulative;
+}
+
+/**
+* \brief Natural logarithm of every value of matrix, built on first use and then shared read-only by all threads
+*
+* Zero probabilities give -HUGE_VAL.
+*/
+const double* square_matrix_log_values(struct square_matrix* matrix)
+{
+	double* log_values = __atomic_load_n(&matrix->log_values, __ATOMIC_ACQUIRE);
+	if (log_values) return log_values;
+
+	pthread_mutex_lock(&cumulative_lock);
+	log_values = matrix->log_values;
+	if (log_values == NULL)
+	{
+		int n = matrix->size * matrix->size;
+		log_values = (double*)memory_new(n, sizeof(double));
+		for (int i = 0; i < n; i++)
+		{
+			log_values[i] = matrix->values[i] > 0 ? log(matrix->values[i]) : -HUGE_VAL;
+		}
+		__atomic_store_n(&matrix->log_values, log_values, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&cumulative_lock);
+	return log_values;
+}
+
+/**
+* \brief Draws a column for row: the first c below max whose running row sum reaches rnd, or max if none does
+*
+* Gives the same answer as adding up the row from column 0, with a binary search
+* over running sums kept with the matrix.
+*/
+int square_matrix_sample(struct square_matrix* matrix, int row, int max, double rnd)
+{
+	assert(row < matrix->size);
+	if (max > matrix->size) max = matrix->size;
+	const double* cumulative = __square_matrix_cumulative(matrix) + row*matrix->size;
+	int from = 0;
+	int to = max;
+	while (from < to)
+	{
+		int mid = from + (to - from) / 2;
+		if (cumulative[mid] >= rnd) to = mid;
+		else from = mid + 1;
+	}
+	return from;
+}
+
 void square_matrix_resize(struct square_matrix* matrix, int new_size)
 {
+	__square_matrix_clear_cumulative(matrix);
 	int n = new_size < matrix->size ? new_size : matrix->size;
 	double *new_values = memory_new(new_size*new_size, sizeof(double*));
 	for (int i = 0; i < n; ++i)
@@ -313,10 +430,7 @@ pBirthDeathCacheArray birthdeath_cache_init(int size)
 	pbdc_array->table = hash_table_new(MODE_VALUEREF);
 	pbdc_array->maxFamilysize = size;
 
-	if (!chooseln_is_init2(&cache))
-		chooseln_cache_init2(&cache, pbdc_array->maxFamilysize);
-	else if (cache.size < pbdc_array->maxFamilysize)
-		chooseln_cache_resize2(&cache, pbdc_array->maxFamilysize);
+	chooseln_cache_reserve(pbdc_array->maxFamilysize);
 
 	return pbdc_array;
 }
@@ -341,6 +455,7 @@ void birthdeath_cache_array_free(pBirthDeathCacheArray pbdc_array)
 struct square_matrix* birthdeath_cache_get_matrix(pBirthDeathCacheArray pbdc_array, double branchlength, double lambda, double mu )
 {
 	struct BirthDeathCacheKey key;
+	memset(&key, 0, sizeof(key));		// keys are hashed and compared bytewise, including padding
 	key.branchlength = branchlength;
 	key.lambda = lambda;
 	key.mu = mu;
@@ -350,7 +465,104 @@ struct square_matrix* birthdeath_cache_get_matrix(pBirthDeathCacheArray pbdc_arr
 	{
 		matrix = compute_birthdeath_rates(key.branchlength, key.lambda, key.mu, pbdc_array->maxFamilysize);
 		hash_table_add(pbdc_array->table, &key, sizeof(struct BirthDeathCacheKey), matrix, sizeof(struct square_matrix*));
+		pbdc_array->misses++;
+	}
+	else
+	{
+		pbdc_array->hits++;
 	}
 	return matrix;
 }
 
+
+/**
+* \brief Creates a cache that several threads can share while they evaluate different families
+*
+* Matrices are kept separately for each maximum family size up to max_size. Once the cache
+* holds max_values probabilities it stops growing, and new matrices go to the caller's
+* overflow cache instead. Matrices in the shared cache are never freed before
+* \ref shared_birthdeath_cache_free, so threads can use them without holding the lock.
+*/
+pSharedBirthDeathCache shared_birthdeath_cache_new(int max_size, size_t max_values)
+{
+	pSharedBirthDeathCache pshared = (pSharedBirthDeathCache)memory_new(1, sizeof(SharedBirthDeathCache));
+	pthread_mutex_init(&pshared->lock, NULL);
+	pshared->caches = (pBirthDeathCacheArray*)memory_new(max_size + 1, sizeof(pBirthDeathCacheArray));
+	pshared->max_size = max_size;
+	pshared->max_values = max_values;
+	chooseln_cache_reserve(max_size);
+	return pshared;
+}
+
+void shared_birthdeath_cache_free(pSharedBirthDeathCache pshared)
+{
+	for (int i = 0; i <= pshared->max_size; i++)
+	{
+		if (pshared->caches[i])
+			birthdeath_cache_array_free(pshared->caches[i]);
+	}
+	memory_free(pshared->caches);
+	pthread_mutex_destroy(&pshared->lock);
+	memory_free(pshared);
+}
+
+/**
+* \brief Returns the matrix for the given parameters, sized for family sizes up to maxFamilysize
+*
+* The matrix is computed outside the lock when it is missing. If the shared cache is full it
+* is stored in *overflow, which is created on first use and belongs to the calling thread.
+*/
+struct square_matrix* shared_birthdeath_cache_get_matrix(pSharedBirthDeathCache pshared, int maxFamilysize, pBirthDeathCacheArray* overflow, double branchlength, double lambda, double mu)
+{
+	assert(maxFamilysize <= pshared->max_size);
+	struct BirthDeathCacheKey key;
+	memset(&key, 0, sizeof(key));
+	key.branchlength = branchlength;
+	key.lambda = lambda;
+	key.mu = mu;
+
+	struct square_matrix* matrix = NULL;
+	pthread_mutex_lock(&pshared->lock);
+	if (pshared->caches[maxFamilysize])
+		matrix = hash_table_lookup(pshared->caches[maxFamilysize]->table, &key, sizeof(struct BirthDeathCacheKey));
+	pthread_mutex_unlock(&pshared->lock);
+	if (matrix) return matrix;
+
+	if (*overflow)
+	{
+		matrix = hash_table_lookup((*overflow)->table, &key, sizeof(struct BirthDeathCacheKey));
+		if (matrix) return matrix;
+	}
+
+	matrix = compute_birthdeath_rates(key.branchlength, key.lambda, key.mu, maxFamilysize);
+
+	size_t num_values = (size_t)matrix->size * matrix->size;
+	pthread_mutex_lock(&pshared->lock);
+	if (pshared->num_values + num_values <= pshared->max_values)
+	{
+		pBirthDeathCacheArray cache = pshared->caches[maxFamilysize];
+		if (cache == NULL)
+			cache = pshared->caches[maxFamilysize] = birthdeath_cache_init(maxFamilysize);
+		struct square_matrix* existing = hash_table_lookup(cache->table, &key, sizeof(struct BirthDeathCacheKey));
+		if (existing)
+		{
+			// another thread got there first
+			square_matrix_delete(matrix);
+			memory_free(matrix);
+			matrix = existing;
+		}
+		else
+		{
+			hash_table_add(cache->table, &key, sizeof(struct BirthDeathCacheKey), matrix, sizeof(struct square_matrix*));
+			pshared->num_values += num_values;
+		}
+		pthread_mutex_unlock(&pshared->lock);
+		return matrix;
+	}
+	pthread_mutex_unlock(&pshared->lock);
+
+	if (*overflow == NULL)
+		*overflow = birthdeath_cache_init(maxFamilysize);
+	hash_table_add((*overflow)->table, &key, sizeof(struct BirthDeathCacheKey), matrix, sizeof(struct square_matrix*));
+	return matrix;
+}
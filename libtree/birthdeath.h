@@ -2,16 +2,23 @@
 #define __BIRTHDEATH_H__
 
 #include <assert.h>
+#include <pthread.h>
 #include "hashtable.h"
 #include "chooseln_cache.h"
 
 struct square_matrix {
 	double *values;
 	int size;
+	/// running sums along each row, built by the first square_matrix_sample and dropped when values change
+	double *cumulative;
+	/// natural logarithm of each value, built by the first square_matrix_log_values and dropped when values change
+	double *log_values;
 };
 void square_matrix_init(struct square_matrix* matrix, int sz);
 void square_matrix_set(struct square_matrix* matrix, int x, int y, double val);
 void square_matrix_resize(struct square_matrix* matrix, int new_size);
+int square_matrix_sample(struct square_matrix* matrix, int row, int max, double rnd);
+const double* square_matrix_log_values(struct square_matrix* matrix);
 static inline double square_matrix_get(struct square_matrix *matrix, int x, int y)
 {
 	assert(x < matrix->size);
@@ -38,9 +45,28 @@ typedef struct
 	/// 
     hash_table_t* table;
 	int maxFamilysize;
+	/// lookups answered from the table, and lookups that computed a new matrix
+	size_t hits;
+	size_t misses;
 }BirthDeathCacheArray;
 typedef BirthDeathCacheArray* pBirthDeathCacheArray;
 
+/**
+* \brief A cache of transition probabilities that can be shared between threads
+*
+* Holds one \ref BirthDeathCacheArray per maximum family size so that families
+* of the same size reuse each other's matrices. See \ref shared_birthdeath_cache_new
+*/
+typedef struct
+{
+	pthread_mutex_t lock;
+	pBirthDeathCacheArray* caches;
+	int max_size;
+	size_t num_values;
+	size_t max_values;
+}SharedBirthDeathCache;
+typedef SharedBirthDeathCache* pSharedBirthDeathCache;
+
 extern void birthdeath_cache_array_free(pBirthDeathCacheArray pbdc_array);
 extern double birthdeath_likelihood_with_s_c(int s, int c, double branchlength, double lambda, double mu, struct chooseln_cache *cache);
 extern struct square_matrix* compute_birthdeath_rates( double branchlength, double lambda, double mu, int maxFamilysize );
@@ -49,6 +75,9 @@ extern void thread_run(int numthreads, void* (*run)(void*), void* param, int siz
 double birthdeath_rate_with_log_alpha(int s, int c, double log_alpha, double coeff, struct chooseln_cache *cache);
 extern void birthdeath_cache_resize(pBirthDeathCacheArray pbdc_array, int remaxFamilysize);
 pBirthDeathCacheArray birthdeath_cache_init(int size);
+pSharedBirthDeathCache shared_birthdeath_cache_new(int max_size, size_t max_values);
+void shared_birthdeath_cache_free(pSharedBirthDeathCache pshared);
+struct square_matrix* shared_birthdeath_cache_get_matrix(pSharedBirthDeathCache pshared, int maxFamilysize, pBirthDeathCacheArray* overflow, double branchlength, double lambda, double mu);
 
 /**
 * \brief A cache of values of chooseln
@@ -62,4 +91,5 @@ extern int get_chooseln_cache_size();
 extern void chooseln_cache_init(int size);
 extern void chooseln_cache_resize(int resize);
 extern void chooseln_cache_free();
+extern void chooseln_cache_reserve(int size);
 #endif
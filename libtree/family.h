@@ -98,6 +98,9 @@ typedef struct {
 void init_family_size(family_size_range* fs, int max);
 void copy_range_to_tree(pCafeTree tree, family_size_range* range);
 
+/// Verbosity of \ref cafe_log output; a message is written if its level is at most CafeParam::log_level
+enum CAFE_LOG_LEVEL { CAFE_LOG_ERROR, CAFE_LOG_INFO, CAFE_LOG_DETAIL };
+
 typedef struct tagCafeParam CafeParam;
 typedef CafeParam* pCafeParam;
 typedef void (*param_func)(pCafeParam param, double* parameters);
@@ -168,6 +171,10 @@ struct tagCafeParam
 	double** likelihoodRatios;
 
 	int quiet;
+	int log_level;
+
+	/// per-evaluation trace of the lambda search, NULL unless requested
+	struct tagOptimizerTrace* trace;
 };
 
 
@@ -11,6 +11,7 @@ extern "C" {
 }
 #include "cafe_commands.h"
 #include "Globals.h"
+#include "conditional_distribution.h"
 
 #ifdef USE_READLINE
 #include <readline/readline.h>
@@ -23,7 +24,9 @@ int main(int argc, char* argv[])
 {
 	//int i = 0;
 	Globals globals;
-	srand((unsigned int)time(NULL));
+	unifrnd_seed((unsigned int)time(NULL));
+	if (getenv("CAFE_CACHE_DIR"))
+		set_conditional_distribution_cache(getenv("CAFE_CACHE_DIR"));
 	int shell = 0;
 	if ( argc == 2 )
 	{
@@ -9,6 +9,7 @@
 #include "reports.h"
 #include "Globals.h"
 #include "viterbi.h"
+#include "conditional_distribution.h"
 
 extern "C" {
 #include <family.h>
@@ -35,7 +36,7 @@ TEST_GROUP(CommandTests)
 
 	void setup()
 	{
-		srand(10);
+		unifrnd_seed(10);
 		tokens.clear();
 		globals.param.pcafe = NULL;
 		globals.param.root_dist = NULL;
@@ -184,6 +185,99 @@ TEST(CommandTests, cafe_cmd_log)
 	STRCMP_EQUAL("log.txt", globals.param.str_log->buf);
 }
 
+TEST(CommandTests, cafe_cmd_log_level)
+{
+	LONGS_EQUAL(CAFE_LOG_DETAIL, globals.param.log_level);
+	tokens = tokenize("log -v 1");
+	cafe_cmd_log(globals, tokens);
+	LONGS_EQUAL(CAFE_LOG_INFO, globals.param.log_level);
+	CHECK_TRUE(cafe_log_enabled(&globals.param, CAFE_LOG_INFO));
+	CHECK_FALSE(cafe_log_enabled(&globals.param, CAFE_LOG_DETAIL));
+
+	tokens = tokenize("log -v 3");
+	try
+	{
+		cafe_cmd_log(globals, tokens);
+		FAIL("Expected exception not thrown");
+	}
+	catch (std::runtime_error& err)
+	{
+		STRCMP_EQUAL("ERROR(log): level must be between 0 and 2\n", err.what());
+	}
+}
+
+TEST(CommandTests, cafe_cmd_seed)
+{
+	tokens = tokenize("seed 42");
+	cafe_cmd_seed(globals, tokens);
+	LONGS_EQUAL(42, unifrnd_get_seed());
+	double first = unifrnd();
+
+	cafe_cmd_seed(globals, tokens);
+	DOUBLES_EQUAL(first, unifrnd(), 0);
+
+	tokens = tokenize("seed abc");
+	try
+	{
+		cafe_cmd_seed(globals, tokens);
+		FAIL("Expected exception not thrown");
+	}
+	catch (std::runtime_error& err)
+	{
+		STRCMP_EQUAL("ERROR(seed): seed must be a non-negative integer\n", err.what());
+	}
+}
+
+TEST(CommandTests, cafe_cmd_cache)
+{
+	tokens = tokenize("cache /tmp");
+	cafe_cmd_cache(globals, tokens);
+	STRCMP_EQUAL("/tmp", get_conditional_distribution_cache().c_str());
+
+	tokens = tokenize("cache off");
+	cafe_cmd_cache(globals, tokens);
+	CHECK(get_conditional_distribution_cache().empty());
+
+	tokens = tokenize("cache /nonexistent/dir");
+	try
+	{
+		cafe_cmd_cache(globals, tokens);
+		FAIL("Expected exception not thrown");
+	}
+	catch (std::runtime_error& err)
+	{
+		STRCMP_EQUAL("ERROR(cache): /nonexistent/dir is not a directory\n", err.what());
+	}
+}
+
+TEST(CommandTests, cafe_log_async)
+{
+	CafeParam param;
+	param.quiet = 1;
+	param.log_level = CAFE_LOG_INFO;
+	param.flog = tmpfile();
+
+	cafe_log_async_begin(&param);
+	cafe_log_async_begin(&param);
+	for (int i = 0; i < 1000; i++)
+		cafe_log(&param, "line %d\n", i);
+	cafe_log_level(&param, CAFE_LOG_DETAIL, "not written\n");
+	cafe_log_async_end();
+	cafe_log(&param, "line %d\n", 1000);
+	cafe_log_async_end();
+	cafe_log(&param, "line %d\n", 1001);
+
+	rewind(param.flog);
+	int n, expected = 0;
+	while (fscanf(param.flog, "line %d\n", &n) == 1)
+	{
+		LONGS_EQUAL(expected, n);
+		expected++;
+	}
+	LONGS_EQUAL(1002, expected);
+	fclose(param.flog);
+}
+
 TEST(CommandTests, get_load_arguments)
 {
 	vector<string> command = tokenize("load -t 1 -r 2 -p 0.05 -l log.txt -i fam.txt");
@@ -397,6 +491,8 @@ TEST(CommandTests, get_pvalue_arguments)
 	CHECK(args.infile.empty());
 	CHECK(args.outfile.empty());
 	LONGS_EQUAL(-1, args.index);
+	CHECK_FALSE(args.text);
+	CHECK_FALSE(args.all);
 
 	tokens.push_back("-i");
 	tokens.push_back("infile");
@@ -404,11 +500,15 @@ TEST(CommandTests, get_pvalue_arguments)
 	tokens.push_back("outfile");
 	tokens.push_back("-idx");
 	tokens.push_back("17");
+	tokens.push_back("-text");
+	tokens.push_back("-all");
 
 	args = get_pvalue_arguments(build_argument_list(tokens));
 	STRCMP_EQUAL("infile", args.infile.c_str());
 	STRCMP_EQUAL("outfile", args.outfile.c_str());
 	LONGS_EQUAL(17, args.index);
+	CHECK(args.text);
+	CHECK(args.all);
 }
 
 TEST(CommandTests, get_lhtest_arguments)
@@ -13,7 +13,7 @@ TEST_GROUP(ErrorModel)
 {
 	void setup()
 	{
-		srand(10);
+		unifrnd_seed(10);
 	}
 };
 
@@ -8,6 +8,7 @@
 
 extern "C" {
 #include <cafe_shell.h>
+#include <cafe.h>
 	int __cafe_cmd_lambda_tree(pArgument parg);
 	void cafe_shell_set_lambda(pCafeParam param, double* parameters);
 };
@@ -307,3 +308,305 @@ TEST(LambdaTests, lambda_set)
 }
 
 
+
+TEST(LambdaTests, read_lambda_distribution)
+{
+	std::vector<lambda_range> range(1);
+	range[0].start = 0.01;
+	range[0].step = 0.01;
+	range[0].end = 0.04;
+	pGMatrix pgm = lambda_distribution_new(range);
+	LONGS_EQUAL(4, pgm->num_elements);
+
+	FILE* fp = tmpfile();
+	fputs("0.020000\t-123.5\n", fp);
+	fputs("0.500000\t-1.0\n", fp);		// not on the grid
+	fputs("0.040000\t-99.25\n", fp);
+	fputs("0.030000\t-1", fp);			// interrupted write
+	rewind(fp);
+
+	std::vector<bool> done;
+	LONGS_EQUAL(2, read_lambda_distribution(fp, range, pgm, done));
+	fclose(fp);
+
+	CHECK_FALSE(done[0]);
+	CHECK_TRUE(done[1]);
+	CHECK_FALSE(done[2]);
+	CHECK_TRUE(done[3]);
+	DOUBLES_EQUAL(-123.5, gmatrix_double_get_with_index(pgm, 1), 0.0001);
+	DOUBLES_EQUAL(-99.25, gmatrix_double_get_with_index(pgm, 3), 0.0001);
+	gmatrix_free(pgm);
+}
+
+TEST(LambdaTests, cafe_lambda_distribution_threads)
+{
+	Globals globals;
+	globals.param.quiet = 1;
+	init_cafe_tree(globals);
+	char buf[100];
+	strcpy(buf, "load -i ../example/example_data.tab");
+	cafe_shell_dispatch_command(globals, buf);
+
+	pCafeParam param = &globals.param;
+	std::vector<lambda_range> range(1);
+	range[0].start = 0.001;
+	range[0].step = 0.001;
+	range[0].end = 0.004;
+	param->num_lambdas = param->num_params = 1;
+	param->posterior = 1;
+	cafe_set_prior_rfsize_empirical(param);
+	initialize_params_and_k_weights(param, INIT_PARAMS);
+
+	pGMatrix serial = cafe_lambda_distribution(param, range);
+	param->num_threads = 3;
+	pGMatrix parallel = cafe_lambda_distribution(param, range);
+
+	LONGS_EQUAL(4, parallel->num_elements);
+	for (int i = 0; i < serial->num_elements; i++)
+	{
+		CHECK(gmatrix_double_get_with_index(serial, i) < 0);
+		DOUBLES_EQUAL(gmatrix_double_get_with_index(serial, i), gmatrix_double_get_with_index(parallel, i), 1e-9);
+	}
+	gmatrix_free(serial);
+	gmatrix_free(parallel);
+}
+
+TEST(LambdaTests, cafe_lambda_distribution_maxlh)
+{
+	Globals globals;
+	globals.param.quiet = 1;
+	init_cafe_tree(globals);
+	char buf[100];
+	strcpy(buf, "load -i ../example/example_data.tab");
+	cafe_shell_dispatch_command(globals, buf);
+
+	pCafeParam param = &globals.param;
+	std::vector<lambda_range> range(1);
+	range[0].start = 0.001;
+	range[0].step = 0.001;
+	range[0].end = 0.004;
+	param->num_lambdas = param->num_params = 1;
+	param->posterior = 1;
+	param->num_threads = 3;
+	cafe_set_prior_rfsize_empirical(param);
+	initialize_params_and_k_weights(param, INIT_PARAMS);
+
+	cafe_family_reset_maxlh(param->pfamily);
+	gmatrix_free(cafe_lambda_distribution(param, range));
+	for (int i = 0; i < param->pfamily->flist->size; i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[i];
+		if (pitem->ref < 0 || pitem->ref == i)
+			CHECK(pitem->maxlh >= 0);
+	}
+
+	// a zero lambda scores zero, which resets every maxlh once the scan is over
+	range[0].start = 0;
+	pGMatrix pgm = cafe_lambda_distribution(param, range);
+	CHECK(-gmatrix_double_get_with_index(pgm, 0) > 1e300);
+	CHECK(gmatrix_double_get_with_index(pgm, 1) < 0);
+	for (int i = 0; i < param->pfamily->flist->size; i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)param->pfamily->flist->array[i];
+		LONGS_EQUAL(-1, pitem->maxlh);
+	}
+	gmatrix_free(pgm);
+}
+
+TEST(LambdaTests, cafe_each_best_lambda_by_fminsearch_threads)
+{
+	Globals globals;
+	globals.param.quiet = 1;
+	init_cafe_tree(globals);
+	char buf[100];
+	strcpy(buf, "load -i ../example/example_data.tab");
+	cafe_shell_dispatch_command(globals, buf);
+
+	pCafeParam param = &globals.param;
+	pArrayList flist = param->pfamily->flist;
+	param->num_lambdas = param->num_params = 1;
+	initialize_params_and_k_weights(param, INIT_PARAMS);
+
+	cafe_each_best_lambda_by_fminsearch(param, 1);
+	std::vector<double> serial;
+	for (int i = 0; i < flist->size; i++)
+		serial.push_back(((pCafeFamilyItem)flist->array[i])->lambda[0]);
+
+	param->num_threads = 4;
+	cafe_each_best_lambda_by_fminsearch(param, 1);
+	for (int i = 0; i < flist->size; i++)
+	{
+		pCafeFamilyItem pitem = (pCafeFamilyItem)flist->array[i];
+		DOUBLES_EQUAL(serial[i], pitem->lambda[0], 1e-12);
+	}
+}
+
+static double distance_from_one_percent(double* x, void* args)
+{
+	(*(int*)args)++;
+	return (x[0] - 0.01) * (x[0] - 0.01);
+}
+
+TEST(LambdaTests, cafe_restart_search)
+{
+	Globals globals;
+	init_cafe_tree(globals);
+	pCafeParam param = &globals.param;
+	param->num_lambdas = param->num_params = 1;
+	initialize_params_and_k_weights(param, INIT_PARAMS);
+	param->checkconv = 1;
+
+	int evaluations = 0;
+	double scores[10];
+	RandomStream stream;
+	random_stream_init(&stream, 5, 0);
+	RestartSearch rs;
+	memset(&rs, 0, sizeof(RestartSearch));
+	rs.eq = distance_from_one_percent;
+	rs.eq_args = &evaluations;
+	rs.N = 1;
+	rs.tol = 1e-6;
+	rs.lambda_len = 1;
+	rs.stream = &stream;
+	rs.max_runs = 10;
+	rs.scores = scores;
+
+	unifrnd_seed(3);
+	double expected = unifrnd();
+	unifrnd_seed(3);
+	int runs;
+	CHECK(cafe_restart_search(param, &rs, &runs));
+	CHECK(runs >= 2);
+	CHECK(evaluations > 0);
+	DOUBLES_EQUAL(0.01, param->parameters[0], 1e-3);
+	// the starting points came from the stream
+	DOUBLES_EQUAL(expected, unifrnd(), 0);
+
+	RandomStream again;
+	random_stream_init(&again, 5, 0);
+	for (int i = 0; i < runs; i++)
+		random_stream_next(&again);
+	DOUBLES_EQUAL(random_stream_next(&again), random_stream_next(&stream), 0);
+}
+
+TEST(LambdaTests, Test_checkpoint_argument)
+{
+	std::vector<std::string> strs;
+	strs.push_back("lambda");
+	strs.push_back("-s");
+	strs.push_back("-checkpoint");
+	strs.push_back("search.txt");
+	strs.push_back("2");
+	std::vector<Argument> pal = build_argument_list(strs);
+	lambda_args args = get_arguments(pal);
+	STRCMP_EQUAL("search.txt", args.checkpoint.c_str());
+	LONGS_EQUAL(2, args.checkpoint_interval);
+	CHECK_FALSE(args.resume);
+
+	strs.resize(2);
+	strs.push_back("-resume");
+	strs.push_back("search.txt");
+	pal = build_argument_list(strs);
+	args = get_arguments(pal);
+	STRCMP_EQUAL("search.txt", args.checkpoint.c_str());
+	LONGS_EQUAL(DEFAULT_CHECKPOINT_INTERVAL, args.checkpoint_interval);
+	CHECK_TRUE(args.resume);
+}
+
+TEST(LambdaTests, cafe_best_lambda_by_fminsearch_resume)
+{
+	Globals globals;
+	globals.param.quiet = 1;
+	init_cafe_tree(globals);
+	char buf[100];
+	strcpy(buf, "load -i ../example/example_data.tab");
+	cafe_shell_dispatch_command(globals, buf);
+
+	pCafeParam param = &globals.param;
+	param->num_lambdas = param->num_params = 1;
+	param->posterior = 1;
+	cafe_set_prior_rfsize_empirical(param);
+	initialize_params_and_k_weights(param, INIT_PARAMS);
+
+	// only the starting simplex is saved, so resuming repeats the whole search
+	const char* file = "checkpoint_test.txt";
+	remove(file);
+	POINTERS_EQUAL(NULL, cafe_best_lambda_by_fminsearch_checkpoint(param, 1, 0, file, 1000000, 1));
+	CHECK(cafe_best_lambda_by_fminsearch_checkpoint(param, 1, 0, file, 1000000, 0) != NULL);
+	double lambda = param->parameters[0];
+
+	param->parameters[0] = 0.5;
+	CHECK(cafe_best_lambda_by_fminsearch_checkpoint(param, 1, 0, file, 1000000, 1) != NULL);
+	DOUBLES_EQUAL(lambda, param->parameters[0], 1e-15);
+	remove(file);
+}
+
+TEST(LambdaTests, lambdamu_resume)
+{
+	Globals globals;
+	globals.param.quiet = 1;
+	init_cafe_tree(globals);
+	char buf[100];
+	strcpy(buf, "load -i ../example/example_data.tab");
+	cafe_shell_dispatch_command(globals, buf);
+	pCafeParam param = &globals.param;
+
+	const char* file = "checkpoint_test.txt";
+	remove(file);
+	std::vector<std::string> strs;
+	strs.push_back("lambdamu");
+	strs.push_back("-s");
+	strs.push_back("-resume");
+	strs.push_back(file);
+	CHECK_THROWS(std::runtime_error, cafe_cmd_lambdamu(globals, strs));
+	strcpy(buf, "lambdamu -s -checkpoint checkpoint_test.txt 1000000");
+	cafe_shell_dispatch_command(globals, buf);
+	double lambda = param->parameters[0];
+	double mu = param->parameters[1];
+
+	// a lambda search cannot pick up a lambda/mu checkpoint
+	param->num_params = 1;
+	POINTERS_EQUAL(NULL, cafe_best_lambda_by_fminsearch_checkpoint(param, 1, 0, file, 1000000, 1));
+
+	strcpy(buf, "lambdamu -s -resume checkpoint_test.txt");
+	cafe_shell_dispatch_command(globals, buf);
+	DOUBLES_EQUAL(lambda, param->parameters[0], 1e-15);
+	DOUBLES_EQUAL(mu, param->parameters[1], 1e-15);
+	remove(file);
+}
+
+TEST(LambdaTests, cafe_best_lambda_by_fminsearch_trace)
+{
+	Globals globals;
+	globals.param.quiet = 1;
+	init_cafe_tree(globals);
+	char buf[100];
+	strcpy(buf, "load -i ../example/example_data.tab");
+	cafe_shell_dispatch_command(globals, buf);
+
+	std::vector<std::string> strs;
+	strs.push_back("lambda");
+	strs.push_back("-s");
+	strs.push_back("-trace");
+	strs.push_back("trace_test.tsv");
+	cafe_cmd_lambda(globals, strs);
+	POINTERS_EQUAL(NULL, globals.param.trace);
+
+	FILE* fp = fopen("trace_test.tsv", "r");
+	CHECK(fp != NULL);
+	char line[STRING_STEP_SIZE];
+	CHECK(fgets(line, STRING_STEP_SIZE, fp) != NULL);
+	STRCMP_CONTAINS("evaluation\tstep\tscore", line);
+	int rows = 0, evaluation;
+	char step[100];
+	while (fgets(line, STRING_STEP_SIZE, fp))
+	{
+		rows++;
+		LONGS_EQUAL(2, sscanf(line, "%d\t%99s", &evaluation, step));
+		LONGS_EQUAL(rows, evaluation);
+		if (rows == 1) STRCMP_EQUAL("init", step);
+	}
+	fclose(fp);
+	remove("trace_test.tsv");
+	CHECK(rows > 2);
+}
@@ -1,10 +1,14 @@
 #include <stdexcept>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <fstream>
 #include "CppUTest/TestHarness.h"
 #include "CppUTest/CommandLineTestRunner.h"
 #include <math.h>
+#include <float.h>
+#include <unistd.h>
 
 extern "C" {
 #include <utils_string.h>
@@ -25,11 +29,13 @@ extern "C" {
 #include <error_model.h>
 #include <Globals.h>
 #include <viterbi.h>
+#include <marginal.h>
 
 extern "C" {
 	extern pCafeParam cafe_param;
 	void show_sizes(FILE*, pCafeTree pcafe, family_size_range*range, pCafeFamilyItem pitem, int i);
 	void phylogeny_lambda_parse_func(pTree ptree, pTreeNode ptnode);
+	void cafe_shell_set_lambda(pCafeParam param, double* parameters);
 	extern pBirthDeathCacheArray probability_cache;
 }
 
@@ -57,7 +63,7 @@ TEST_GROUP(FirstTestGroup)
 
 	void setup()
 	{
-		srand(10);
+		unifrnd_seed(10);
 		range.min = range.root_min = 0;
 		range.max = range.root_max = 15;
 
@@ -73,7 +79,7 @@ TEST_GROUP(LikelihoodRatio)
 {
 	void setup()
 	{
-		srand(10);
+		unifrnd_seed(10);
 	}
 };
 
@@ -83,7 +89,7 @@ TEST_GROUP(TreeTests)
 
 	void setup()
 	{
-		srand(10);
+		unifrnd_seed(10);
 		range.min = range.root_min = 0;
 		range.max = range.root_max = 15;
 	}
@@ -93,7 +99,7 @@ TEST_GROUP(ReportTests)
 {
 	void setup()
 	{
-		srand(10);
+		unifrnd_seed(10);
 	}
 };
 
@@ -101,7 +107,7 @@ TEST_GROUP(PValueTests)
 {
 	void setup()
 	{
-		srand(10);
+		unifrnd_seed(10);
 	}
 
 	void teardown()
@@ -425,6 +431,253 @@ TEST(TreeTests, cafe_tree_random_probabilities)
 	DOUBLES_EQUAL(0.0, trials[4], .001);
 }
 
+TEST(TreeTests, random_probabilities_match_single_family_likelihoods)
+{
+	pCafeTree tree = create_tree(range);
+	probability_cache = NULL;
+	reset_birthdeath_cache(tree, 0, &range);
+
+	unifrnd_seed(3);
+	std::vector<double> batched = get_random_probabilities(tree, 4, 100);
+
+	unifrnd_seed(3);
+	tree->rfsize = 1;
+	tree->rootfamilysizes[0] = tree->rootfamilysizes[1] = 4;
+	std::vector<double> single;
+	for (int i = 0; i < 100; i++)
+	{
+		cafe_tree_random_familysize(tree, 4);
+		compute_tree_likelihoods(tree);
+		single.push_back(get_likelihoods(tree)[0]);
+	}
+	std::sort(single.begin(), single.end());
+
+	LONGS_EQUAL(100, batched.size());
+	for (int i = 0; i < 100; i++)
+		DOUBLES_EQUAL(single[i], batched[i], 1e-12);
+}
+
+TEST(TreeTests, pooled_conditional_distribution_scores_pool_families)
+{
+	pCafeTree tree = create_tree(range);
+	for (int i = 0; i < tree->super.nlist->size; i++)
+	{
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
+	probability_cache = NULL;
+	reset_birthdeath_cache(tree, 0, &range);
+	tree->rfsize = 1;
+
+	family_size_range r = range;
+	r.root_min = 2;
+	r.root_max = 3;
+	unifrnd_seed(5);
+	simulation_pool pool = cafe_simulation_pool(tree, &r, 2, 20);
+	LONGS_EQUAL(2, pool.states.size());
+	LONGS_EQUAL(((pTree)tree)->nlist->size, pool.num_nodes);
+
+	pArrayList nlist = ((pTree)tree)->nlist;
+	std::vector<int> ids(nlist->size);
+	for (int n = 0; n < nlist->size; n++)
+		ids[n] = n;
+	matrix cd = pooled_conditional_distribution(pool, tree, ids, &r, 2, 20);
+	LONGS_EQUAL(2, cd.size());
+
+	for (int s = 2; s <= 3; s++)
+	{
+		// the whole tree has the pool's own families at each root size
+		tree->rootfamilysizes[0] = tree->rootfamilysizes[1] = s;
+		std::vector<double> expected;
+		for (int i = 0; i < 20; i++)
+		{
+			for (int n = 0; n < nlist->size; n++)
+				((pCafeNode)nlist->array[n])->familysize = pool.states[s - 2][i * pool.num_nodes + n];
+			compute_tree_likelihoods(tree);
+			expected.push_back(get_likelihoods(tree)[0]);
+		}
+		std::sort(expected.begin(), expected.end());
+		for (int i = 0; i < 20; i++)
+			DOUBLES_EQUAL(expected[i], cd[s - 2][i], 1e-12);
+	}
+
+	// a cut takes both of its distributions from the pool
+	CutBranch cb(nlist->size);
+	std::ostringstream ost;
+	cut_branch(cb, (pTree)tree, tree, r, 2, 200, 1, ost, &pool);
+	std::vector<double>& row = cb.pCDSs[1].second[1];
+	LONGS_EQUAL(2, cb.pCDSs[1].first.size());
+	LONGS_EQUAL(20, cb.pCDSs[1].first[0].size());
+	LONGS_EQUAL(2, cb.pCDSs[1].second.size());
+	CHECK(std::adjacent_find(row.begin(), row.end(), std::greater<double>()) == row.end());
+	CHECK(row[19] > 0);
+
+	// cutting chimp merges human's branch with that of their parent, which has other rates
+	((pCafeNode)nlist->array[1])->birth_death_probabilities.lambda = 0.02;
+	CutBranch direct(nlist->size);
+	unifrnd_seed(7);
+	cut_branch(cb, (pTree)tree, tree, r, 2, 20, 0, ost, &pool);
+	unifrnd_seed(7);
+	cut_branch(direct, (pTree)tree, tree, r, 2, 20, 0, ost);
+	CHECK(cb.pCDSs[0].first == direct.pCDSs[0].first);
+}
+
+TEST(TreeTests, branch_pvalue_tables_match_row_scan)
+{
+	probability_cache = NULL;
+	pBirthDeathCacheArray cache = birthdeath_cache_init(40);
+	struct square_matrix* matrix = birthdeath_cache_get_matrix(cache, 20, 0.01, -1);
+	branch_pvalue_tables tables;
+	for (int parent = 0; parent < 10; parent++)
+	{
+		for (int child = 0; child <= 30; child++)
+		{
+			double p = square_matrix_get(matrix, parent, child);
+			double expected = 0;
+			for (int m = 0; m <= 25; m++)
+			{
+				double q = square_matrix_get(matrix, parent, m);
+				if (q == p) expected += q / 2.0;
+				else if (q < p) expected += q;
+			}
+			DOUBLES_EQUAL(expected, tables.pvalue(matrix, parent, child, 25), 1e-12);
+			// a second lookup comes from the table
+			DOUBLES_EQUAL(expected, tables.pvalue(matrix, parent, child, 25), 1e-12);
+		}
+	}
+	birthdeath_cache_array_free(cache);
+}
+
+TEST(TreeTests, cafe_tree_viterbi_deep_tree)
+{
+	// a caterpillar of 300 taxa, whose likelihoods are far below the smallest double
+	std::string newick = "(a0:50,a1:50)";
+	for (int i = 2; i < 300; i++)
+	{
+		std::ostringstream ost;
+		ost << "(" << newick << ":50,a" << i << ":50)";
+		newick = ost.str();
+	}
+	family_size_range r;
+	r.min = 0;
+	r.root_min = 1;
+	r.max = r.root_max = 20;
+	std::vector<char> buf(newick.begin(), newick.end());
+	buf.push_back(0);
+	pCafeTree tree = cafe_tree_new(&buf[0], &r, 0, 0);
+	for (int i = 0; i < tree->super.nlist->size; i++)
+	{
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
+	probability_cache = NULL;
+	reset_birthdeath_cache(tree, 0, &r);
+	for (int i = 0; i < tree->super.nlist->size; i++)
+	{
+		pTreeNode node = (pTreeNode)tree->super.nlist->array[i];
+		if (tree_is_leaf(node))
+			((pCafeNode)node)->familysize = 5;
+	}
+
+	cafe_tree_viterbi(tree);
+
+	for (int i = 0; i < tree->super.nlist->size; i++)
+		LONGS_EQUAL(5, ((pCafeNode)tree->super.nlist->array[i])->familysize);
+	double lh = ((pCafeNode)tree->super.root)->likelihoods[4];
+	CHECK(lh < log(DBL_MIN) && lh > -HUGE_VAL);
+	cafe_free_birthdeath_cache(tree);
+	cafe_tree_free(tree);
+}
+
+/* adds to marginals and changes the weight of every assignment of sizes to the internal nodes from node on */
+static void enumerate_sizes(pCafeTree tree, int node, std::vector<int>& sizes, std::vector<std::vector<double> >& marginals, std::vector<expected_change>& changes)
+{
+	pTree ptree = (pTree)tree;
+	if (node < ptree->nlist->size)
+	{
+		pTreeNode pnode = (pTreeNode)ptree->nlist->array[node];
+		int first = tree_is_root(ptree, pnode) ? tree->rootfamilysizes[0] : tree->familysizes[0];
+		int last = tree_is_root(ptree, pnode) ? tree->rootfamilysizes[1] : tree->familysizes[1];
+		for (sizes[node] = first; sizes[node] <= last; sizes[node]++)
+			enumerate_sizes(tree, node + 2, sizes, marginals, changes);
+		return;
+	}
+	double weight = 1;
+	for (int n = 0; n < ptree->nlist->size; n++)
+	{
+		pTreeNode pnode = (pTreeNode)ptree->nlist->array[n];
+		if (pnode->parent)
+			weight *= square_matrix_get(((pCafeNode)pnode)->birthdeath_matrix, sizes[pnode->parent->id], sizes[n]);
+	}
+	for (int n = 0; n < ptree->nlist->size; n++)
+	{
+		marginals[n][sizes[n]] += weight;
+		pTreeNode pnode = (pTreeNode)ptree->nlist->array[n];
+		if (!pnode->parent)
+			continue;
+		int m = 2 * ((pnode->parent->id - 1) / 2) + (tree_get_child(pnode->parent, 0) == pnode ? 0 : 1);
+		int diff = sizes[n] - sizes[pnode->parent->id];
+		changes[m].gain += weight * MAX(diff, 0);
+		changes[m].loss += weight * MAX(-diff, 0);
+		changes[m].remain += diff == 0 ? weight : 0;
+	}
+}
+
+TEST(TreeTests, cafe_tree_marginals_matches_enumeration)
+{
+	family_size_range r;
+	r.min = 0;
+	r.root_min = 1;
+	r.max = r.root_max = 7;
+	pCafeTree tree = create_tree(r);
+	pTree ptree = (pTree)tree;
+	for (int i = 0; i < ptree->nlist->size; i++)
+	{
+		((pCafeNode)ptree->nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)ptree->nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
+	probability_cache = NULL;
+	reset_birthdeath_cache(tree, 0, &r);
+	int leaves[] = { 3, 5, 2, 4, 6 };
+	for (int i = 0; i < 5; i++)
+		((pCafeNode)ptree->nlist->array[2 * i])->familysize = leaves[i];
+
+	std::vector<std::vector<double> > posteriors;
+	std::vector<expected_change> changes;
+	double lnl = cafe_tree_marginals(tree, NULL, posteriors, changes);
+
+	compute_tree_likelihoods(tree);
+	double* lh = get_likelihoods(tree);
+	double sum = 0;
+	for (int s = 0; s < tree->rfsize; s++)
+		sum += lh[s];
+	DOUBLES_EQUAL(log(sum), lnl, 1e-9);
+
+	std::vector<int> sizes(ptree->nlist->size);
+	for (int i = 0; i < 5; i++)
+		sizes[2 * i] = leaves[i];
+	std::vector<std::vector<double> > expected(ptree->nlist->size, std::vector<double>(8));
+	std::vector<expected_change> expected_changes(ptree->nlist->size - 1);
+	enumerate_sizes(tree, 1, sizes, expected, expected_changes);
+
+	for (int n = 0; n < ptree->nlist->size; n++)
+	{
+		int first = tree_is_root(ptree, (pTreeNode)ptree->nlist->array[n]) ? 1 : 0;
+		LONGS_EQUAL(8 - first, posteriors[n].size());
+		for (int s = first; s < 8; s++)
+			DOUBLES_EQUAL(expected[n][s] / sum, posteriors[n][s - first], 1e-9);
+	}
+	for (size_t m = 0; m < changes.size(); m++)
+	{
+		DOUBLES_EQUAL(expected_changes[m].gain / sum, changes[m].gain, 1e-9);
+		DOUBLES_EQUAL(expected_changes[m].loss / sum, changes[m].loss, 1e-9);
+		DOUBLES_EQUAL(expected_changes[m].remain / sum, changes[m].remain, 1e-9);
+		DOUBLES_EQUAL(1, changes[m].expand + changes[m].remain + changes[m].decrease, 1e-9);
+	}
+	cafe_free_birthdeath_cache(tree);
+	cafe_tree_free(tree);
+}
+
 TEST(ReportTests, get_report_parameters)
 {
 	std::vector<std::string> tokens;
@@ -446,6 +699,21 @@ TEST(ReportTests, get_report_parameters)
 	tokens.push_back("html");
 	params = get_report_parameters(tokens);
 	CHECK(params.html);
+	CHECK_FALSE(params.sequential);
+
+	tokens.push_back("sequential");
+	params = get_report_parameters(tokens);
+	CHECK(params.sequential);
+	CHECK_FALSE(params.importance);
+
+	tokens.push_back("importance");
+	params = get_report_parameters(tokens);
+	CHECK(params.importance);
+	CHECK_FALSE(params.marginal);
+
+	tokens.push_back("marginal");
+	params = get_report_parameters(tokens);
+	CHECK(params.marginal);
 }
 
 TEST(ReportTests, write_report)
@@ -501,6 +769,24 @@ TEST(ReportTests, write_viterbi)
 	STRCMP_CONTAINS("Expansion :\t(1,3)\t(5,7)\t(11,13)\n", ost.str().c_str());
 	STRCMP_CONTAINS("Remain :\t(17,19)\t(23,29)\t(31,37)\n", ost.str().c_str());
 	STRCMP_CONTAINS("Decrease :\t(41,43)\t(47,53)\t(59,61)\n", ost.str().c_str());
+	CHECK(ost.str().find("Expected") == std::string::npos);
+
+	r.expectedExpansion.push_back(0.5);
+	r.expectedExpansion.push_back(-1.25);
+	r.expectedChanges.resize(2);
+	r.expectedChanges[0].gain = 2.5;
+	r.expectedChanges[0].expand = 0.75;
+	r.expectedChanges[1].loss = 3;
+	r.expectedChanges[1].decrease = 0.5;
+	r.expectedChanges[1].remain = 0.5;
+	ost.str("");
+	write_viterbi(ost, r);
+	STRCMP_CONTAINS("Expected Average Expansion:\t(0.5,-1.25)\n", ost.str().c_str());
+	STRCMP_CONTAINS("Expected Expansion :\t(0.75,0)\n", ost.str().c_str());
+	STRCMP_CONTAINS("Expected nRemain :\t(0,0.5)\n", ost.str().c_str());
+	STRCMP_CONTAINS("Expected nDecrease :\t(0,0.5)\n", ost.str().c_str());
+	STRCMP_CONTAINS("Expected Gains :\t(2.5,0)\n", ost.str().c_str());
+	STRCMP_CONTAINS("Expected Losses :\t(0,3)\n", ost.str().c_str());
 }
 
 
@@ -517,6 +803,10 @@ TEST(ReportTests, write_families_header)
 	std::ostringstream ost3;
 	write_families_header(ost3, (double **)1, (double **)1);
 	STRCMP_EQUAL("'ID'\t'Newick'\t'Family-wide P-value'\t'Viterbi P-values'\t'cut P-value'\t'Likelihood Ratio'\n", ost3.str().c_str());
+
+	std::ostringstream ost4;
+	write_families_header(ost4, false, false, true);
+	STRCMP_EQUAL("'ID'\t'Newick'\t'Family-wide P-value'\t'Viterbi P-values'\t'Monte Carlo error'\t'Samples'\n", ost4.str().c_str());
 }
 
 TEST(ReportTests, write_families_line)
@@ -562,6 +852,13 @@ TEST(ReportTests, write_families_line)
 	family_line_item item3(globals.param.pfamily, globals.param.pcafe, globals.param.likelihoodRatios, *globals.viterbi, 0, "NodeZero");
 	ost3 << item3;
 	STRCMP_EQUAL("NodeZero\t(((chimp_3:6,human_5:6)_0:81,(mouse_7:17,rat_11:17)_0:70)_0:6,dog_13:9)_0\t0.1\t((0.025,0),(0,0),(0,0))\t(0,0,0,0,0,0,0,0,0)", ost3.str().c_str());
+
+	v->maximumPvalueErrors.push_back(.01);
+	v->pvalueSamples.push_back(400);
+	std::ostringstream ost4;
+	family_line_item item4(globals.param.pfamily, globals.param.pcafe, globals.param.likelihoodRatios, *globals.viterbi, 0, "NodeZero");
+	ost4 << item4;
+	STRCMP_EQUAL("NodeZero\t(((chimp_3:6,human_5:6)_0:81,(mouse_7:17,rat_11:17)_0:70)_0:6,dog_13:9)_0\t0.1\t((0.025,0),(0,0),(0,0))\t(0,0,0,0,0,0,0,0,0)\t0.01\t400", ost4.str().c_str());
 }
 
 TEST(FirstTestGroup, cafe_tree_new_empty_node)
@@ -626,6 +923,31 @@ TEST(FirstTestGroup, square_matrix_resize)
 	square_matrix_resize(&matrix, 1);
 	LONGS_EQUAL(1, square_matrix_get(&matrix, 0, 0));
 }
+TEST(FirstTestGroup, square_matrix_sample)
+{
+	chooseln_cache_init(20);
+	struct square_matrix* matrix = compute_birthdeath_rates(10, 0.02, 0.01, 20);
+	unifrnd_seed(5);
+	for (int i = 0; i < 1000; ++i)
+	{
+		int s = i % 21;
+		double rnd = unifrnd();
+		double cumul = 0;
+		int c = 0;
+		for (; c < 20; c++)
+		{
+			cumul += square_matrix_get(matrix, s, c);
+			if (cumul >= rnd) break;
+		}
+		LONGS_EQUAL(c, square_matrix_sample(matrix, s, 20, rnd));
+	}
+	LONGS_EQUAL(20, square_matrix_sample(matrix, 1, 20, 2.0));
+
+	// changing a value drops the running sums
+	square_matrix_set(matrix, 1, 0, 1.0);
+	LONGS_EQUAL(0, square_matrix_sample(matrix, 1, 20, 0.99));
+}
+
 TEST(FirstTestGroup, compute_birthdeath_rates)
 {
 	chooseln_cache_init(3);
@@ -689,7 +1011,7 @@ TEST(FirstTestGroup, cafe_tree_random_familysize)
 	LONGS_EQUAL(10, max);
 	LONGS_EQUAL(10, get_family_size((pTree)tree, 3));
 	LONGS_EQUAL(10, get_family_size((pTree)tree, 7));
-	LONGS_EQUAL(8, get_family_size((pTree)tree, 5));
+	LONGS_EQUAL(5, get_family_size((pTree)tree, 5));
 }
 
 TEST(FirstTestGroup, reset_birthdeath_cache)
@@ -940,6 +1262,428 @@ TEST(FirstTestGroup, conditional_distribution)
 	LONGS_EQUAL(2, cd.size());
 }
 
+TEST(FirstTestGroup, conditional_distribution_tasks)
+{
+	std::vector<CDTask> tasks = conditional_distribution_tasks(1, 3, 10, 4);
+
+	// 16 blocks requested over 3 roots gives 6 blocks per root
+	LONGS_EQUAL(18, tasks.size());
+	LONGS_EQUAL(3, tasks[0].root);
+	LONGS_EQUAL(1, tasks[17].root);
+	int total = 0;
+	for (size_t i = 0; i < tasks.size(); ++i)
+	{
+		if (tasks[i].root == 2) total += tasks[i].count;
+	}
+	LONGS_EQUAL(10, total);
+
+	// never more blocks than samples
+	tasks = conditional_distribution_tasks(0, 0, 2, 8);
+	LONGS_EQUAL(2, tasks.size());
+	LONGS_EQUAL(1, tasks[1].start);
+}
+
+TEST(FirstTestGroup, cafe_conditional_distribution)
+{
+	pCafeTree tree = create_tree(range);
+	reset_birthdeath_cache(tree, 0, &range);
+	family_size_range r;
+	r.min = 0; r.max = 15; r.root_min = 1; r.root_max = 3;
+
+	matrix cd = cafe_conditional_distribution(tree, &r, 3, 7);
+
+	LONGS_EQUAL(3, cd.size());
+	for (size_t i = 0; i < cd.size(); ++i)
+	{
+		LONGS_EQUAL(7, cd[i].size());
+		for (size_t j = 1; j < cd[i].size(); ++j)
+			CHECK(cd[i][j - 1] <= cd[i][j]);
+	}
+}
+
+TEST(FirstTestGroup, random_stream)
+{
+	RandomStream a, b, c;
+	random_stream_init(&a, 7, 0);
+	random_stream_init(&b, 7, 0);
+	random_stream_init(&c, 7, 1);
+	for (int i = 0; i < 100; ++i)
+	{
+		double x = random_stream_next(&a);
+		CHECK(x >= 0 && x < 1);
+		DOUBLES_EQUAL(x, random_stream_next(&b), 0);
+	}
+	CHECK(random_stream_next(&a) != random_stream_next(&c));
+
+	unifrnd_seed(3);
+	double first = unifrnd();
+	unifrnd();
+	unsigned int seed;
+	unsigned long draws;
+	unifrnd_get_state(&seed, &draws);
+	LONGS_EQUAL(3, seed);
+	LONGS_EQUAL(2, draws);
+	unifrnd_set_state(3, 0);
+	DOUBLES_EQUAL(first, unifrnd(), 0);
+
+	random_stream_init(&b, 7, 2);
+	random_stream_init(&c, 7, 2);
+	pRandomStream old = unifrnd_set_stream(&b);
+	double x = unifrnd();
+	unifrnd_set_stream(old);
+	DOUBLES_EQUAL(x, random_stream_next(&c), 0);
+}
+
+TEST(FirstTestGroup, cafe_conditional_distribution_reproducible)
+{
+	pCafeTree tree = create_tree(range);
+	reset_birthdeath_cache(tree, 0, &range);
+	family_size_range r;
+	r.min = 0; r.max = 15; r.root_min = 1; r.root_max = 3;
+
+	unifrnd_seed(11);
+	matrix cd1 = cafe_conditional_distribution(tree, &r, 3, 7);
+	unifrnd_seed(11);
+	matrix cd2 = cafe_conditional_distribution(tree, &r, 3, 7);
+
+	CHECK(cd1 == cd2);
+}
+
+TEST(FirstTestGroup, weighted_pvalue)
+{
+	std::vector<double> lh, cumulative;
+	lh.push_back(0.1); cumulative.push_back(0.001);
+	lh.push_back(0.2); cumulative.push_back(0.01);
+	lh.push_back(0.3); cumulative.push_back(1);
+	DOUBLES_EQUAL(0, weighted_pvalue(0.05, lh, cumulative), 0);
+	DOUBLES_EQUAL(0.0005, weighted_pvalue(0.1, lh, cumulative), 1e-15);
+	DOUBLES_EQUAL(0.01, weighted_pvalue(0.25, lh, cumulative), 0);
+	DOUBLES_EQUAL(1, weighted_pvalue(0.5, lh, cumulative), 0);
+
+	// ties count by half, as in pvalue
+	lh.assign(4, 0.2);
+	lh[0] = 0.1;
+	lh[3] = 0.3;
+	cumulative.clear();
+	for (int i = 1; i <= 4; i++)
+		cumulative.push_back(i / 4.0);
+	DOUBLES_EQUAL(0.5, weighted_pvalue(0.2, lh, cumulative), 1e-15);
+	DOUBLES_EQUAL(0.75, weighted_pvalue(0.25, lh, cumulative), 1e-15);
+}
+
+TEST(FirstTestGroup, cafe_weighted_conditional_distribution)
+{
+	pCafeTree tree = create_tree(range);
+	for (int i = 0; i < tree->super.nlist->size; i++)
+	{
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
+	probability_cache = NULL;
+	reset_birthdeath_cache(tree, 0, &range);
+	family_size_range r;
+	r.min = 0; r.max = 15; r.root_min = 1; r.root_max = 3;
+
+	// without tilting every weight is 1, and the families are the ones plain sampling draws
+	matrix cumulative;
+	unifrnd_seed(5);
+	matrix weighted = cafe_weighted_conditional_distribution(tree, &r, 2, 20, 1.0, cumulative);
+	unifrnd_seed(5);
+	matrix plain = cafe_conditional_distribution_uncached(tree, &r, 2, 20);
+	CHECK(weighted == plain);
+	LONGS_EQUAL(3, cumulative.size());
+	for (int j = 0; j < 20; j++)
+		DOUBLES_EQUAL((j + 1) / 20.0, cumulative[1][j], 1e-12);
+
+	// with inflated rates the weights differ from 1, and still sum to 1 once normalized
+	pCafeTree tilted = cafe_tree_tilted_copy(tree, 3.0);
+	pCafeNode node = (pCafeNode)tree->super.nlist->array[0];
+	CHECK(((pCafeNode)tilted->super.nlist->array[0])->birthdeath_matrix != node->birthdeath_matrix);
+	std::vector<double> weights;
+	std::vector<double> lh = get_weighted_random_probabilities(tree, tilted, 2, 20, weights);
+	LONGS_EQUAL(20, lh.size());
+	CHECK(weights[0] > 0 && weights[0] != 1);
+	cafe_tree_free(tilted);
+
+	unifrnd_seed(5);
+	weighted = cafe_weighted_conditional_distribution(tree, &r, 2, 20, 3.0, cumulative);
+	DOUBLES_EQUAL(1.0, cumulative[2][19], 1e-12);
+	for (int j = 1; j < 20; j++)
+		CHECK(cumulative[2][j] >= cumulative[2][j - 1]);
+}
+
+TEST(FirstTestGroup, conditional_distribution_cache)
+{
+	pCafeTree tree = create_tree(range);
+	reset_birthdeath_cache(tree, 0, &range);
+	family_size_range r;
+	r.min = 0; r.max = 15; r.root_min = 1; r.root_max = 3;
+
+	char dir[] = "/tmp/cafe_cdXXXXXX";
+	CHECK(mkdtemp(dir) != NULL);
+	set_conditional_distribution_cache(dir);
+
+	uint64_t key = conditional_distribution_key(tree, &r, 7);
+	CHECK(key != conditional_distribution_key(tree, &r, 8));
+
+	unifrnd_seed(1);
+	matrix cd1 = cafe_conditional_distribution(tree, &r, 2, 7);
+	unifrnd_seed(2);
+	matrix cd2 = cafe_conditional_distribution(tree, &r, 2, 7);
+	CHECK(cd1 == cd2);
+
+	// a lambda change gives a new key
+	((pCafeNode)tree->super.nlist->array[1])->birth_death_probabilities.lambda = 0.02;
+	CHECK(key != conditional_distribution_key(tree, &r, 7));
+
+	char file[64];
+	sprintf(file, "%s/cd_%016llx.bin", dir, (unsigned long long)key);
+	matrix cd3;
+	CHECK(read_conditional_distribution_cache(file, key, 3, 7, cd3));
+	CHECK(cd1 == cd3);
+	CHECK_FALSE(read_conditional_distribution_cache(file, key + 1, 3, 7, cd3));
+	CHECK_FALSE(read_conditional_distribution_cache(file, key, 3, 8, cd3));
+
+	set_conditional_distribution_cache("");
+	remove(file);
+	rmdir(dir);
+}
+
+TEST(FirstTestGroup, conditional_distribution_key_clusters)
+{
+	pCafeTree tree = create_tree(range);
+	family_size_range r;
+	r.min = 0; r.max = 15; r.root_min = 1; r.root_max = 3;
+
+	// with clusters lambda and mu stay at -1 and the rates are in param_lambdas and param_mus
+	tree->k = 2;
+	for (int i = 0; i < tree->super.nlist->size; i++)
+	{
+		struct probabilities* probs = &((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities;
+		probs->lambda = probs->mu = -1;
+		probs->param_lambdas = (double*)memory_new(2, sizeof(double));
+		probs->param_mus = (double*)memory_new(2, sizeof(double));
+		probs->param_lambdas[0] = 0.01; probs->param_lambdas[1] = 0.02;
+		probs->param_mus[0] = 0.01; probs->param_mus[1] = 0.03;
+	}
+	uint64_t key = conditional_distribution_key(tree, &r, 7);
+
+	struct probabilities* probs = &((pCafeNode)tree->super.nlist->array[1])->birth_death_probabilities;
+	probs->param_lambdas[1] = 0.04;
+	uint64_t lambda_key = conditional_distribution_key(tree, &r, 7);
+	CHECK(key != lambda_key);
+	probs->param_mus[0] = 0.02;
+	CHECK(lambda_key != conditional_distribution_key(tree, &r, 7));
+
+	probs->param_lambdas[1] = 0.02;
+	probs->param_mus[0] = 0.01;
+	LONGS_EQUAL(key, conditional_distribution_key(tree, &r, 7));
+	tree->k = 1;
+	CHECK(key != conditional_distribution_key(tree, &r, 7));
+
+	for (int i = 0; i < tree->super.nlist->size; i++)
+		free_probabilities(&((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities);
+	cafe_tree_free(tree);
+}
+
+TEST(FirstTestGroup, viterbi_results_store)
+{
+	CafeParam param;
+	param.pcafe = create_tree(range);
+	reset_birthdeath_cache(param.pcafe, 0, &range);
+	param.family_size = range;
+	param.num_random_samples = 100;
+	param.pvalue = 0.01;
+	param.parameters = NULL;
+	param.num_params = 0;
+	const char *species[] = { "", "", "chimp", "human", "mouse", "rat", "dog" };
+	param.pfamily = cafe_family_init(build_arraylist(species, 7));
+	const char *values[] = { "description", "id", "3", "5", "7", "11", "13" };
+	cafe_family_add_item(param.pfamily, build_arraylist(values, 7));
+
+	uint64_t key = viterbi_results_key(&param, VITERBI_PVALUES_FIXED);
+	CHECK(key != viterbi_results_key(&param, VITERBI_PVALUES_SEQUENTIAL));
+	((pCafeFamilyItem)param.pfamily->flist->array[0])->count[2] = 8;
+	CHECK(key != viterbi_results_key(&param, VITERBI_PVALUES_FIXED));
+
+	int nnodes = param.pcafe->super.nlist->size - 1;
+	viterbi_parameters viterbi;
+	viterbi_parameters_init(&viterbi, nnodes, 2);
+	viterbi.cutPvalues = (double**)memory_new_2dim(nnodes + 1, 2, sizeof(double));
+	for (int j = 0; j < nnodes; j++)
+	{
+		if (j < nnodes / 2)
+			viterbi.viterbiNodeFamilysizes[j][1] = j + 3;
+		viterbi.viterbiPvalues[j][0] = j * 0.125;
+		viterbi.averageExpansion[j] = -j;
+		viterbi.expandRemainDecrease[j] = change(j, 2 * j, 1);
+	}
+	viterbi.maximumPvalues[1] = 0.75;
+	viterbi.cutPvalues[nnodes][1] = -1;
+
+	char file[] = "/tmp/cafe_vtXXXXXX";
+	int fd = mkstemp(file);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(write_viterbi_results(file, key, viterbi));
+
+	viterbi_parameters stored;
+	CHECK_FALSE(read_viterbi_results(file, key + 1, stored));
+	CHECK(read_viterbi_results(file, key, stored));
+	LONGS_EQUAL(nnodes, stored.num_nodes);
+	LONGS_EQUAL(2, stored.num_rows);
+	LONGS_EQUAL(nnodes / 2 + 2, stored.viterbiNodeFamilysizes[nnodes / 2 - 1][1]);
+	DOUBLES_EQUAL(0.25, stored.viterbiPvalues[2][0], 1e-12);
+	DOUBLES_EQUAL(0.75, stored.maximumPvalues[1], 1e-12);
+	DOUBLES_EQUAL(-3, stored.averageExpansion[3], 1e-12);
+	LONGS_EQUAL(6, stored.expandRemainDecrease[3].remain);
+	CHECK(stored.maximumPvalueErrors.empty());
+	CHECK(stored.cutPvalues != NULL);
+	DOUBLES_EQUAL(-1, stored.cutPvalues[nnodes][1], 1e-12);
+
+	// a file cut short is not loaded
+	CHECK(truncate(file, 40) == 0);
+	viterbi_parameters_clear(&stored, nnodes + 1);
+	CHECK_FALSE(read_viterbi_results(file, key, stored));
+	POINTERS_EQUAL(NULL, stored.viterbiNodeFamilysizes);
+	remove(file);
+}
+
+TEST(FirstTestGroup, cafe_clustered_viterbi_uses_most_probable_cluster)
+{
+	CafeParam param;
+	param.flog = stdout;
+	param.quiet = 1;
+	param.pcafe = create_tree(range);
+	reset_birthdeath_cache(param.pcafe, 0, &range);
+	pArrayList nlist = param.pcafe->super.nlist;
+	double lambdas[2] = { 0.001, 0.05 };
+	for (int n = 0; n < nlist->size; n++)
+	{
+		pCafeNode node = (pCafeNode)nlist->array[n];
+		node->k_bd = arraylist_new(2);
+		if (node->super.branchlength <= 0) continue;
+		for (int k = 0; k < 2; k++)
+			arraylist_add(node->k_bd, birthdeath_cache_get_matrix(probability_cache, node->super.branchlength, lambdas[k], -1));
+	}
+
+	const char *species[] = { "", "", "chimp", "human", "mouse", "rat", "dog" };
+	param.pfamily = cafe_family_init(build_arraylist(species, 7));
+	cafe_family_set_species_index(param.pfamily, param.pcafe);
+	const char *values[3][7] = { { "description", "a", "3", "5", "7", "11", "13" },
+		{ "description", "b", "1", "0", "2", "6", "9" },
+		{ "description", "c", "4", "4", "0", "1", "4" } };
+	for (int i = 0; i < 3; i++)
+		cafe_family_add_item(param.pfamily, build_arraylist(values[i], 7));
+
+	int clusters[3] = { 1, 0, 1 };
+	double membership[3][2] = { { .2, .8 }, { .9, .1 }, { .4, .6 } };
+	double* rows[3] = { membership[0], membership[1], membership[2] };
+	param.p_z_membership = rows;
+	param.parameterized_k_value = 2;
+
+	for (int threads = 1; threads <= 3; threads += 2)
+	{
+		param.num_threads = threads;
+		viterbi_parameters viterbi;
+		viterbi.cutPvalues = NULL;
+		cafe_clustered_viterbi(&param, viterbi);
+
+		for (int i = 0; i < 3; i++)
+		{
+			for (int n = 0; n < nlist->size; n++)
+			{
+				pCafeNode node = (pCafeNode)nlist->array[n];
+				if (node->k_bd->size)
+					node->birthdeath_matrix = (struct square_matrix*)node->k_bd->array[clusters[i]];
+			}
+			cafe_family_set_size(param.pfamily, i, param.pcafe);
+			cafe_tree_viterbi(param.pcafe);
+			for (int j = 1; j < nlist->size; j += 2)
+				LONGS_EQUAL(((pCafeNode)nlist->array[j])->familysize, viterbi.viterbiNodeFamilysizes[j / 2][i]);
+		}
+		change c = viterbi.expandRemainDecrease[0];
+		LONGS_EQUAL(3, c.expand + c.remain + c.decrease);
+		viterbi_parameters_clear(&viterbi, nlist->size);
+	}
+}
+
+TEST(FirstTestGroup, wilson_interval)
+{
+	double lower, upper;
+	wilson_interval(0.5, 100, 1.96, &lower, &upper);
+	DOUBLES_EQUAL(0.404, lower, .001);
+	DOUBLES_EQUAL(0.596, upper, .001);
+
+	wilson_interval(0, 100, 1.96, &lower, &upper);
+	DOUBLES_EQUAL(0, lower, 1e-12);
+	DOUBLES_EQUAL(0.037, upper, .001);
+}
+
+TEST(FirstTestGroup, sequential_pvalues)
+{
+	pCafeTree tree = create_tree(range);
+	reset_birthdeath_cache(tree, 0, &range);
+	family_size_range r;
+	r.min = 0; r.max = 15; r.root_min = 1; r.root_max = 2;
+
+	sequential_distribution distribution(tree, &r, 2, 400);
+	LONGS_EQUAL(3, distribution.num_levels());
+	LONGS_EQUAL(200, distribution.level(1)[0].size());
+	for (size_t j = 1; j < 200; ++j)
+		CHECK(distribution.level(1)[1][j - 1] <= distribution.level(1)[1][j]);
+
+	// a likelihood above every sample is clearly not significant after the first block
+	double pvalues[2];
+	double high[] = { 2, 2 };
+	sequential_pvalue result = sequential_pvalues(distribution, high, 2, 0.05, pvalues);
+	DOUBLES_EQUAL(1, result.max_pvalue, 1e-12);
+	LONGS_EQUAL(SEQUENTIAL_PVALUE_BLOCK, result.samples);
+
+	// below every sample the bound only drops under 0.01 with more samples
+	double low[] = { -1, -1 };
+	result = sequential_pvalues(distribution, low, 2, 0.01, pvalues);
+	DOUBLES_EQUAL(0, result.max_pvalue, 1e-12);
+	// no sample below the likelihood still leaves the upper Wilson bound as the error
+	double lower, upper;
+	wilson_interval(0, 400, SEQUENTIAL_PVALUE_Z, &lower, &upper);
+	CHECK(result.error > 0);
+	DOUBLES_EQUAL(upper, result.error, 1e-12);
+	LONGS_EQUAL(400, result.samples);
+}
+
+static void* request_level(void* ptr)
+{
+	std::pair<sequential_distribution*, int>* request = (std::pair<sequential_distribution*, int>*)ptr;
+	request->first->level(request->second);
+	return NULL;
+}
+
+TEST(FirstTestGroup, sequential_distribution_levels_from_threads)
+{
+	pCafeTree tree = create_tree(range);
+	reset_birthdeath_cache(tree, 0, &range);
+	family_size_range r;
+	r.min = 0; r.max = 15; r.root_min = 1; r.root_max = 2;
+
+	unifrnd_seed(4);
+	sequential_distribution serial(tree, &r, 2, 400);
+	matrix expected = serial.level(2);
+
+	// threads asking for different levels at once get the levels a single thread would
+	unifrnd_seed(4);
+	sequential_distribution distribution(tree, &r, 2, 400);
+	std::vector<std::pair<sequential_distribution*, int> > requests;
+	for (int i = 0; i < 6; i++)
+		requests.push_back(std::make_pair(&distribution, i % 3));
+	std::vector<pthread_t> threads(requests.size());
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_create(&threads[i], NULL, request_level, &requests[i]);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	CHECK(expected == distribution.level(2));
+}
+
 TEST(FirstTestGroup, set_size_for_split)
 {
 	pCafeTree tree = create_tree(range);
@@ -962,6 +1706,11 @@ TEST(FirstTestGroup, set_size_for_split)
 TEST(FirstTestGroup, compute_cutpvalues)
 {
 	pCafeTree tree = create_tree(range);
+	for (int i = 0; i < tree->super.nlist->size; i++)
+	{
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
 
 	probability_cache = NULL;
 	reset_birthdeath_cache(tree, 0, &range);
@@ -977,22 +1726,90 @@ TEST(FirstTestGroup, compute_cutpvalues)
 	viterbi_parameters_init(&viterbi, nnodes, 1);
 	LONGS_EQUAL(nnodes, viterbi.averageExpansion.size());
 	LONGS_EQUAL(nnodes, viterbi.expandRemainDecrease.size());
-	double* p1 = (double*)memory_new(5, sizeof(double));
-	double** p2 = (double**)memory_new_2dim(5, 5, sizeof(double));
+	double* p1 = (double*)memory_new(tree->rfsize, sizeof(double));
 
 	viterbi.cutPvalues = (double**)memory_new_2dim(6, 1, sizeof(double));
 
+	// every likelihood lies strictly between 0 and 1, so against the row of root size 2
+	// three of five samples are less likely and the p-value is 0.6; every other row gives 0
+	std::vector<double> ones(5, 1.0);
+	std::vector<double> mixed(ones);
+	mixed[0] = mixed[1] = mixed[2] = 0;
 	CutBranch cb(nnodes);
-	for (int i = 0; i < nnodes; ++i)
+	for (int j = 0; j < tree->rfsize; ++j)
+	{
+		cb.pCDSs[0].first.push_back(j == 2 ? mixed : ones);
+	}
+	compute_cutpvalues(tree, pfamily, 5, 0, 0, 1, viterbi, 0.05, p1, cb);
+	DOUBLES_EQUAL(0.6, viterbi.cutPvalues[0][0], .001);
+
+	// the cut above chimp and human leaves two trees that are both scored, each with a tenth
+	// of the samples; a product of likelihoods over 1 is below three of five samples again
+	for (int j = 0; j < tree->rfsize; ++j)
+	{
+		cb.pCDSs[1].first.push_back(j == 3 ? mixed : ones);
+		cb.pCDSs[1].second.push_back(ones);
+	}
+	compute_cutpvalues(tree, pfamily, 50, 1, 0, 1, viterbi, 0.05, p1, cb);
+	DOUBLES_EQUAL(0.6, viterbi.cutPvalues[1][0], .001);
+}
+
+TEST(FirstTestGroup, max_p_value_of_two_trees_matches_grid)
+{
+	pCafeTree tree = create_tree(range);
+	for (int i = 0; i < tree->super.nlist->size; i++)
 	{
-		for (int j = 0; j < tree->rfsize; ++j)
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)tree->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
+	probability_cache = NULL;
+	reset_birthdeath_cache(tree, 0, &range);
+	pCafeTree other = cafe_tree_copy(tree);
+	for (int i = 0; i < tree->super.nlist->size; i += 2)
+	{
+		((pCafeNode)tree->super.nlist->array[i])->familysize = 3 + i % 4;
+		((pCafeNode)other->super.nlist->array[i])->familysize = 5 - i % 3;
+	}
+
+	// coarse values, so that many of them tie
+	const int cdlen = 40;
+	std::pair<matrix, matrix> cd;
+	for (int s = 0; s < tree->rfsize; s++)
+	{
+		std::vector<double> first, second;
+		for (int t = 0; t < cdlen; t++)
 		{
-			cb.pCDSs[i].first.push_back(std::vector<double>(1, .5));
-			cb.pCDSs[i].second.push_back(std::vector<double>(1, .5));
+			first.push_back(pow(10.0, -((s * 7 + t * 3) % 20)));
+			second.push_back(pow(10.0, -((s * 5 + t * 11) % 9)));
 		}
+		std::sort(first.begin(), first.end());
+		std::sort(second.begin(), second.end());
+		cd.first.push_back(first);
+		cd.second.push_back(second);
 	}
-	compute_cutpvalues(tree, pfamily, 5, 0, 0, 1, viterbi, 0.05, p1, p2, cb);
-	DOUBLES_EQUAL(0.6, viterbi.cutPvalues[0][0], .001);
+
+	double** grid = (double**)memory_new_2dim(tree->rfsize, tree->rfsize, sizeof(double));
+	p_values_of_two_trees(tree, other, grid, cd, cdlen);
+	double expected = 0;
+	for (int s1 = 0; s1 < tree->rfsize; s1++)
+	{
+		for (int s2 = 0; s2 < tree->rfsize; s2++)
+		{
+			double* lh1 = get_likelihoods(tree);
+			double* lh2 = get_likelihoods(other);
+			double p = 0;
+			for (int t = 0; t < cdlen; t++)
+				p += pvalue(lh1[s1] * lh2[s2] / cd.second[s2][t], &cd.first[s1][0], cdlen);
+			DOUBLES_EQUAL(p / cdlen, grid[s1][s2], 0);
+			expected = std::max(expected, grid[s1][s2]);
+		}
+	}
+	CHECK(expected > 0 && expected < 1);
+	DOUBLES_EQUAL(expected, max_p_value_of_two_trees(tree, other, cd, cdlen), 0);
+
+	memory_free_2dim((void**)grid, tree->rfsize, tree->rfsize, NULL);
+	cafe_tree_free(other);
+	cafe_tree_free(tree);
 }
 
 TEST(FirstTestGroup, simulate_misclassification)
@@ -1020,7 +1837,7 @@ TEST(FirstTestGroup, simulate_misclassification)
 	write_species_counts(pfamily, ost);
 
 	STRCMP_CONTAINS("Desc\tFamily ID\tchimp\n", ost.str().c_str());
-	STRCMP_CONTAINS("description\tid\t1\n", ost.str().c_str());
+	STRCMP_CONTAINS("description\tid\t0\n", ost.str().c_str());
 
 }
 
@@ -1028,7 +1845,7 @@ TEST(FirstTestGroup, get_random)
 {
 	std::vector<double> v(5, 0.2);
 
-	LONGS_EQUAL(2, get_random(v));
+	LONGS_EQUAL(1, get_random(v));
 }
 
 TEST(FirstTestGroup, tree_set_branch_lengths)
@@ -1313,6 +2130,195 @@ TEST(PValueTests, pvalues_for_family)
 
 }
 
+TEST(PValueTests, pvalues_for_all_families)
+{
+	const char *species[] = { "", "", "chimp", "human", "mouse", "rat", "dog" };
+	family_size_range range;
+	range.min = range.root_min = 0;
+	range.max = range.root_max = 70;
+
+	pCafeTree pcafe = create_tree(range);
+	for (int i = 0; i < pcafe->super.nlist->size; i++)
+	{
+		((pCafeNode)pcafe->super.nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)pcafe->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
+	probability_cache = NULL;
+	reset_birthdeath_cache(pcafe, 0, &range);
+	pCafeFamily pfamily = cafe_family_init(build_arraylist(species, 7));
+	cafe_family_set_species_index(pfamily, pcafe);
+	const char *values1[] = { "description", "id1", "3", "5", "7", "11", "13" };
+	const char *values2[] = { "description", "id2", "3", "5", "7", "11", "13" };
+	const char *values3[] = { "description", "id3", "1", "1", "2", "2", "1" };
+	cafe_family_add_item(pfamily, build_arraylist(values1, 7));
+	cafe_family_add_item(pfamily, build_arraylist(values2, 7));
+	cafe_family_add_item(pfamily, build_arraylist(values3, 7));
+	((pCafeFamilyItem)pfamily->flist->array[0])->ref = 0;
+	((pCafeFamilyItem)pfamily->flist->array[1])->ref = 0;
+
+	for (int i = 0; i < 20; i++)
+	{
+		std::vector<double> row;
+		row.push_back(1e-20);
+		row.push_back(1e-10);
+		row.push_back(1);
+		ConditionalDistribution::matrix.push_back(row);
+	}
+
+	std::vector<family_pvalue> single = pvalues_for_all_families(pcafe, pfamily, 1, 3);
+	std::vector<family_pvalue> threaded = pvalues_for_all_families(pcafe, pfamily, 2, 3);
+	LONGS_EQUAL(3, single.size());
+	for (int i = 0; i < 3; i++)
+	{
+		LONGS_EQUAL(single[i].root_size, threaded[i].root_size);
+		DOUBLES_EQUAL(single[i].max_pvalue, threaded[i].max_pvalue, 0);
+	}
+	LONGS_EQUAL(single[0].root_size, single[1].root_size);
+	DOUBLES_EQUAL(single[0].max_pvalue, single[1].max_pvalue, 0);
+	CHECK(single[2].root_size < single[0].root_size);
+
+	std::ostringstream ost;
+	write_family_pvalues(ost, pfamily, single);
+	STRCMP_CONTAINS("Family ID\tRoot size\tMax p-value\n", ost.str().c_str());
+	STRCMP_CONTAINS("id3\t", ost.str().c_str());
+}
+
+TEST(PValueTests, cafe_viterbi_counts_do_not_depend_on_threads)
+{
+	const char *species[] = { "", "", "chimp", "human", "mouse", "rat", "dog" };
+	CafeParam param;
+	memset(&param, 0, sizeof(param));
+	param.flog = stdout;
+	param.quiet = 1;
+	param.family_size.min = param.family_size.root_min = 0;
+	param.family_size.max = param.family_size.root_max = 70;
+	param.pcafe = create_tree(param.family_size);
+	for (int i = 0; i < param.pcafe->super.nlist->size; i++)
+	{
+		((pCafeNode)param.pcafe->super.nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)param.pcafe->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
+	probability_cache = NULL;
+	reset_birthdeath_cache(param.pcafe, 0, &param.family_size);
+	param.pfamily = cafe_family_init(build_arraylist(species, 7));
+	cafe_family_set_species_index(param.pfamily, param.pcafe);
+	for (int i = 0; i < 40; i++)
+	{
+		std::ostringstream sizes[5];
+		for (int j = 0; j < 5; j++)
+			sizes[j] << 1 + (i * (j + 3)) % 11;
+		std::string s[5];
+		for (int j = 0; j < 5; j++)
+			s[j] = sizes[j].str();
+		const char *values[] = { "description", "id", s[0].c_str(), s[1].c_str(), s[2].c_str(), s[3].c_str(), s[4].c_str() };
+		cafe_family_add_item(param.pfamily, build_arraylist(values, 7));
+	}
+	for (int i = 0; i < 71; i++)
+	{
+		std::vector<double> row;
+		row.push_back(1e-20);
+		row.push_back(1);
+		ConditionalDistribution::matrix.push_back(row);
+	}
+	param.num_random_samples = 2;
+	param.pvalue = 0.01;
+
+	viterbi_parameters single, threaded;
+	single.cutPvalues = threaded.cutPvalues = NULL;
+	pArrayList cd = ConditionalDistribution::to_arraylist();
+	param.num_threads = 1;
+	cafe_viterbi(&param, single, cd);
+	param.num_threads = 3;
+	cafe_viterbi(&param, threaded, cd);
+	arraylist_free(cd, NULL);
+
+	int nnodes = param.pcafe->super.nlist->size - 1;
+	int total = 0;
+	for (int m = 0; m < nnodes; m++)
+	{
+		LONGS_EQUAL(single.expandRemainDecrease[m].expand, threaded.expandRemainDecrease[m].expand);
+		LONGS_EQUAL(single.expandRemainDecrease[m].remain, threaded.expandRemainDecrease[m].remain);
+		LONGS_EQUAL(single.expandRemainDecrease[m].decrease, threaded.expandRemainDecrease[m].decrease);
+		DOUBLES_EQUAL(single.averageExpansion[m], threaded.averageExpansion[m], 1e-12);
+		total += threaded.expandRemainDecrease[m].expand + threaded.expandRemainDecrease[m].remain + threaded.expandRemainDecrease[m].decrease;
+	}
+	// every branch of every family is counted once
+	LONGS_EQUAL(40 * nnodes, total);
+	for (int i = 0; i < 40; i++)
+		LONGS_EQUAL(single.viterbiNodeFamilysizes[0][i], threaded.viterbiNodeFamilysizes[0][i]);
+
+	viterbi_parameters_clear(&single, nnodes + 1);
+	viterbi_parameters_clear(&threaded, nnodes + 1);
+}
+
+TEST(PValueTests, cafe_branch_cutting_does_not_depend_on_threads)
+{
+	const char *species[] = { "", "", "chimp", "human", "mouse", "rat", "dog" };
+	CafeParam param;
+	memset(&param, 0, sizeof(param));
+	param.flog = stdout;
+	param.quiet = 1;
+	param.family_size.min = param.family_size.root_min = 0;
+	param.family_size.max = param.family_size.root_max = 15;
+	param.pcafe = create_tree(param.family_size);
+	for (int i = 0; i < param.pcafe->super.nlist->size; i++)
+	{
+		((pCafeNode)param.pcafe->super.nlist->array[i])->birth_death_probabilities.lambda = 0.01;
+		((pCafeNode)param.pcafe->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	}
+	probability_cache = NULL;
+	reset_birthdeath_cache(param.pcafe, 0, &param.family_size);
+	param.pfamily = cafe_family_init(build_arraylist(species, 7));
+	cafe_family_set_species_index(param.pfamily, param.pcafe);
+	for (int i = 0; i < 40; i++)
+	{
+		std::ostringstream sizes[5];
+		for (int j = 0; j < 5; j++)
+			sizes[j] << 1 + (i * (j + 3)) % 7;
+		std::string s[5];
+		for (int j = 0; j < 5; j++)
+			s[j] = sizes[j].str();
+		const char *values[] = { "description", "id", s[0].c_str(), s[1].c_str(), s[2].c_str(), s[3].c_str(), s[4].c_str() };
+		cafe_family_add_item(param.pfamily, build_arraylist(values, 7));
+	}
+	param.num_random_samples = 100;
+	param.pvalue = 0.01;
+
+	std::vector<double> maximumPvalues(40, 0);
+	viterbi_parameters single, threaded;
+	single.viterbiPvalues = threaded.viterbiPvalues = NULL;
+	single.maximumPvalues = threaded.maximumPvalues = &maximumPvalues[0];
+	single.cutPvalues = threaded.cutPvalues = NULL;
+	unifrnd_seed(7);
+	param.num_threads = 1;
+	cafe_branch_cutting(&param, single);
+	unifrnd_seed(7);
+	param.num_threads = 3;
+	cafe_branch_cutting(&param, threaded);
+
+	int nnodes = param.pcafe->super.nlist->size;
+	int rid = param.pcafe->super.root->id;
+	for (int b = 0; b < nnodes; b++)
+	{
+		for (int i = 0; i < 40; i++)
+		{
+			DOUBLES_EQUAL(single.cutPvalues[b][i], threaded.cutPvalues[b][i], 1e-12);
+			if (b == rid)
+			{
+				DOUBLES_EQUAL(-1, threaded.cutPvalues[b][i], 0);
+			}
+			else
+			{
+				CHECK(threaded.cutPvalues[b][i] >= 0 && threaded.cutPvalues[b][i] <= 1);
+			}
+		}
+	}
+
+	single.maximumPvalues = threaded.maximumPvalues = NULL;
+	viterbi_parameters_clear(&single, nnodes);
+	viterbi_parameters_clear(&threaded, nnodes);
+}
+
 TEST(PValueTests, read_pvalues)
 {
 	std::string str("1.0\t2.0\t3.0\n1.5\t2.5\t3.5\n");
@@ -1328,6 +2334,79 @@ TEST(PValueTests, read_pvalues)
 	DOUBLES_EQUAL(3.5, vals[2], .001);
 }
 
+TEST(PValueTests, write_pvalues_round_trip)
+{
+	matrix m(2, std::vector<double>(2));
+	m[0][0] = 0.1; m[0][1] = 1.0 / 3;
+	m[1][0] = 2e-300; m[1][1] = 0.7;
+	std::ostringstream ost;
+	write_pvalues(ost, m);
+	std::istringstream ist(ost.str());
+	read_pvalues(ist, 2);
+	CHECK(ConditionalDistribution::matrix == m);
+}
+
+TEST(PValueTests, map_binary_pvalues)
+{
+	matrix m(2, std::vector<double>(3));
+	m[0][0] = 0.1; m[0][1] = 0.2; m[0][2] = 0.3;
+	m[1][0] = 0.4; m[1][1] = 0.5; m[1][2] = 0.6;
+	char file[] = "/tmp/cafe_pvXXXXXX";
+	int fd = mkstemp(file);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(write_conditional_distribution_cache(file, 42, m));
+
+	CHECK(ConditionalDistribution::map(file));
+	LONGS_EQUAL(42, ConditionalDistribution::mapped.key);
+	LONGS_EQUAL(2, ConditionalDistribution::rows());
+	LONGS_EQUAL(3, ConditionalDistribution::mapped.cols);
+	DOUBLES_EQUAL(0.2, ConditionalDistribution::row(0)[1], 0);
+	DOUBLES_EQUAL(0.6, ConditionalDistribution::row(1)[2], 0);
+	DOUBLES_EQUAL(2.0 / 3, pvalue(0.55, ConditionalDistribution::row(1), 3), 0.0001);
+	ConditionalDistribution::clear();
+	CHECK(ConditionalDistribution::empty());
+
+	// a text file is not mapped
+	std::ofstream(file) << "0.1\t0.2\t0.3\n";
+	CHECK_FALSE(ConditionalDistribution::map(file));
+	remove(file);
+}
+
+TEST(PValueTests, distribution_knows_its_parameters)
+{
+	family_size_range r;
+	r.min = 0; r.max = 15; r.root_min = 1; r.root_max = 3;
+	pCafeTree tree = create_tree(r);
+	reset_birthdeath_cache(tree, 0, &r);
+
+	ConditionalDistribution::reset(tree, &r, 1, 7);
+	CHECK(ConditionalDistribution::simulated_for(tree, &r, 7));
+	CHECK_FALSE(ConditionalDistribution::simulated_for(tree, &r, 8));
+
+	// a distribution read from a text file could have come from anywhere
+	std::istringstream ist("0.1\t0.2\n0.3\t0.4\n");
+	read_pvalues(ist, 2);
+	CHECK_FALSE(ConditionalDistribution::simulated_for(tree, &r, 2));
+
+	matrix m(3, std::vector<double>(7, 0.5));
+	char file[] = "/tmp/cafe_pvXXXXXX";
+	int fd = mkstemp(file);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(write_conditional_distribution_cache(file, conditional_distribution_key(tree, &r, 7), m));
+	CHECK(ConditionalDistribution::map(file));
+	CHECK(ConditionalDistribution::simulated_for(tree, &r, 7));
+	ConditionalDistribution::clear();
+	CHECK(write_conditional_distribution_cache(file, 42, m));
+	CHECK(ConditionalDistribution::map(file));
+	CHECK_FALSE(ConditionalDistribution::simulated_for(tree, &r, 7));
+	ConditionalDistribution::clear();
+	CHECK_FALSE(ConditionalDistribution::simulated_for(tree, &r, 7));
+	remove(file);
+	cafe_tree_free(tree);
+}
+
 TEST(LikelihoodRatio, cafe_likelihood_ratio_test)
 {
 	double *maximumPvalues = NULL;
@@ -1345,6 +2424,75 @@ TEST(LikelihoodRatio, cafe_likelihood_ratio_test)
 	DOUBLES_EQUAL(0, param.likelihoodRatios[0][0], .0001);
 }
 
+static std::string lhr_for_diff_lambdas(pCafeParam param, pTree lambda_tree, int num_threads)
+{
+	char outbuf[4000];
+	memset(outbuf, 0, sizeof(outbuf));
+	param->fout = fmemopen(outbuf, sizeof(outbuf) - 1, "w");
+	param->num_threads = num_threads;
+	unifrnd_seed(10);
+	cafe_lhr_for_diff_lambdas(param, lambda_tree, 2, cafe_shell_set_lambda);
+	fclose(param->fout);
+	param->fout = NULL;
+	return outbuf;
+}
+
+TEST(LikelihoodRatio, cafe_lhr_for_diff_lambdas_does_not_depend_on_threads)
+{
+	const char *species[] = { "", "", "chimp", "human", "mouse", "rat", "dog" };
+	CafeParam param;
+	memset(&param, 0, sizeof(param));
+	param.flog = stdout;
+	param.quiet = 1;
+	param.family_size.min = param.family_size.root_min = 0;
+	param.family_size.max = param.family_size.root_max = 20;
+	param.pcafe = create_tree(param.family_size);
+	param.max_branch_length = 87;
+	std::vector<double> prior(param.pcafe->rfsize, 1.0 / param.pcafe->rfsize);
+	param.prior_rfsize = &prior[0];
+	param.num_lambdas = param.num_params = 1;
+	param.parameters = (double*)memory_new(1, sizeof(double));
+	param.parameters[0] = 0.01;
+	param.lambda = param.parameters;
+	param.param_set_func = cafe_lambda_set_default;
+	for (int i = 0; i < param.pcafe->super.nlist->size; i++)
+		((pCafeNode)param.pcafe->super.nlist->array[i])->birth_death_probabilities.mu = -1;
+	param.param_set_func(&param, param.parameters);
+	probability_cache = NULL;
+	reset_birthdeath_cache(param.pcafe, 0, &param.family_size);
+	param.pfamily = cafe_family_init(build_arraylist(species, 7));
+	cafe_family_set_species_index(param.pfamily, param.pcafe);
+	for (int i = 0; i < 10; i++)
+	{
+		std::ostringstream sizes[5];
+		for (int j = 0; j < 5; j++)
+			sizes[j] << 1 + (i * (j + 3)) % 9 + (j == 2 || j == 3 ? i % 5 : 0);
+		std::string s[5];
+		for (int j = 0; j < 5; j++)
+			s[j] = sizes[j].str();
+		const char *values[] = { "description", "id", s[0].c_str(), s[1].c_str(), s[2].c_str(), s[3].c_str(), s[4].c_str() };
+		cafe_family_add_item(param.pfamily, build_arraylist(values, 7));
+	}
+
+	// the second lambda and the longer branches go to mouse and rat
+	pCafeTree lambda_tree = create_tree(param.family_size);
+	for (int i = 0; i < lambda_tree->super.nlist->size; i++)
+		((pPhylogenyNode)lambda_tree->super.nlist->array[i])->taxaid = (i == 4 || i == 6) ? 1 : 0;
+
+	std::string single = lhr_for_diff_lambdas(&param, (pTree)lambda_tree, 1);
+	std::string threaded = lhr_for_diff_lambdas(&param, (pTree)lambda_tree, 3);
+	STRCMP_EQUAL(single.c_str(), threaded.c_str());
+	LONGS_EQUAL(10, std::count(threaded.begin(), threaded.end(), '\n'));
+
+	// the searches run on copies, and the global cache is left set up for the parameters
+	DOUBLES_EQUAL(0.01, param.parameters[0], 0);
+	CHECK(probability_cache != NULL);
+	DOUBLES_EQUAL(0.01, ((pCafeNode)param.pcafe->super.nlist->array[0])->birth_death_probabilities.lambda, 0);
+
+	cafe_tree_free(lambda_tree);
+	memory_free(param.parameters);
+}
+
 TEST(LikelihoodRatio, likelihood_ratio_report)
 {
 	family_size_range range;